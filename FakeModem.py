@@ -0,0 +1,214 @@
+# Stand-in for the ESP8266 AT firmware, to run NetLoaderZ's WiFi link without a module.
+# It answers the AT commands of uzenet.c from a script and bridges the transparent
+# (AT+CIPMODE=1) link to a real TCP connection opened from this computer.
+#
+# Connect a USB serial adapter to the Uzebox UART header in place of the module, or
+# use --pty to get a pseudo terminal for an emulator.
+
+import os
+import sys
+import time
+import select
+import socket
+import termios
+import tty
+import re
+import argparse
+
+version = 1.0
+
+# Variables #######################################################################################
+
+bauds = {9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400,
+         57600: termios.B57600, 115200: termios.B115200, 230400: termios.B230400}
+if hasattr(termios, 'B460800'): bauds[460800] = termios.B460800
+
+# Replies of the stock firmware, the first command prefix that matches a line wins.
+# The commands with side effects (UART, CIPSTART, CIPMODE, CIPSEND) are handled in code
+# and only use the script for their reply.
+defaultScript = [
+    ('ATE0', 'OK\r\nWIFI CONNECTED\r\nWIFI GOT IP\r\n'),
+    ('AT+GMR', 'AT version:1.2.0.0(Jul  1 2016 20:04:45)\r\nSDK version:1.5.4.1(39cb9a32)\r\nFakeModem\r\nOK\r\n'),
+    ('AT+CIPSTART', 'CONNECT\r\n\r\nOK\r\n'),
+    ('AT+CIPSEND', '\r\nOK\r\n\r\n>'),
+    ('AT+CIPSTATUS', 'STATUS:2\r\n\r\nOK\r\n'),
+    ('AT+RST', 'OK\r\n'),
+    ('AT', 'OK\r\n'),
+]
+
+bootBanner = '\r\n\r\nready\r\n'
+
+###################################################################################################
+
+print("FakeModem version", version)
+
+# Arguments #######################################################################################
+
+cmdparser = argparse.ArgumentParser(description='Pretend to be an ESP8266 on a serial line for NetLoaderZ')
+cmdparser.add_argument('-p', '--port', dest='port', help="serial device wired to the Uzebox UART header")
+cmdparser.add_argument('--pty', action='store_true', help="create a pseudo terminal instead of opening a serial device")
+cmdparser.add_argument('-b', '--baud', dest='baud', type=int, default=115200, help="initial baud rate (default 115200)")
+cmdparser.add_argument('-s', '--script', dest='script', help="file of 'COMMAND => reply' lines, tried before the default replies")
+cmdparser.add_argument('-c', '--connect', dest='connect', help="host:port to connect to instead of the one in AT+CIPSTART")
+cmdparser.add_argument('-v', '--verbose', action='store_true', help="print the AT dialog")
+args = cmdparser.parse_args()
+
+if (args.port is None) == (not args.pty):
+    print("Use either --port or --pty")
+    sys.exit()
+
+###################################################################################################
+
+def loadScript(fileName):
+    rules = []
+    for line in open(fileName):
+        line = line.rstrip('\r\n')
+        if line == '' or line.startswith('#'): continue
+        command, reply = line.split('=>', 1)
+        reply = reply.strip().encode().decode('unicode_escape')
+        rules.append((command.strip(), reply))
+    return rules
+
+def setBaud(fd, baud):
+    if args.pty: return
+    attr = termios.tcgetattr(fd)
+    attr[4] = attr[5] = bauds[baud]
+    termios.tcsetattr(fd, termios.TCSADRAIN, attr)
+
+def log(direction, data):
+    if args.verbose: print(direction, repr(data))
+
+def reply(fd, text):
+    log('<', text)
+    os.write(fd, text.encode('latin-1'))
+
+def findReply(line):
+    for command, text in script:
+        if line.startswith(command): return text
+    return 'ERROR\r\n'
+
+script = (loadScript(args.script) if args.script else []) + defaultScript
+
+if args.pty:
+    fd, slave = os.openpty()
+    tty.setraw(slave)
+    print("Serial line is", os.ttyname(slave))
+else:
+    fd = os.open(args.port, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    setBaud(fd, args.baud)
+
+# Modem loop ######################################################################################
+
+line = b''
+echo = True
+booted = False
+transparent = False
+passthrough = False
+link = None
+lastBanner = 0
+lastRx = time.time()
+
+while True:
+    # Until the Uzebox talks to us, keep sending the boot banner: wifi_Init() resets the
+    # module and waits for it at each baud rate it tries
+    if not booted and time.time() - lastBanner > 1.0:
+        reply(fd, bootBanner)
+        lastBanner = time.time()
+
+    inputs = [fd] + ([link] if link else [])
+    ready = select.select(inputs, [], [], 0.1)[0]
+
+    if link in ready:
+        data = link.recv(4096)
+        if not data:
+            link.close()
+            link = None
+            passthrough = False
+            reply(fd, 'CLOSED\r\n')
+        elif passthrough:
+            os.write(fd, data)
+        else:
+            reply(fd, '+IPD,%d:' % len(data) + data.decode('latin-1'))
+
+    if fd not in ready: continue
+
+    try:
+        data = os.read(fd, 4096)
+    except OSError:
+        continue    # No one on the other side of the pty yet
+    now = time.time()
+    idle = now - lastRx
+    lastRx = now
+
+    if passthrough:
+        # A lone "+++" after a pause leaves the transparent mode
+        if data == b'+++' and idle > 1.0:
+            log('>', data)
+            passthrough = False
+        else:
+            link.sendall(data)
+        continue
+
+    if echo: os.write(fd, data)
+
+    line += data
+    while b'\n' in line:
+        command, line = line.split(b'\n', 1)
+        command = command.strip(b'\r').decode('latin-1')
+        if command == '': continue
+        log('>', command)
+        booted = True
+
+        if command == 'ATE0': echo = False
+        elif command == 'ATE1': echo = True
+
+        m = re.match(r'AT\+UART_(CUR|DEF)=(\d+)', command)
+        if m:
+            # uzenet asks for the rates the AVR divides exactly, refuse the ones the adapter lacks
+            if not args.pty and int(m.group(2)) not in bauds:
+                reply(fd, 'ERROR\r\n')
+                continue
+            reply(fd, 'OK\r\n')
+            if not args.pty: termios.tcdrain(fd)
+            setBaud(fd, int(m.group(2)))
+            continue
+
+        m = re.match(r'AT\+CIPMODE=(\d)', command)
+        if m:
+            transparent = (m.group(1) == '1')
+            reply(fd, 'OK\r\n')
+            continue
+
+        m = re.match(r'AT\+CIPSTART="TCP","([^"]+)",(\d+)', command)
+        if m:
+            host, port = m.group(1), int(m.group(2))
+            if args.connect:
+                host, port = args.connect.rsplit(':', 1)
+                port = int(port)
+            try:
+                link = socket.create_connection((host, port), 10)
+                link.settimeout(None)
+                print("Connected to", host, port)
+                reply(fd, findReply(command))
+            except OSError as e:
+                print("Connection to", host, port, "failed:", e)
+                reply(fd, 'ERROR\r\nCLOSED\r\n')
+            continue
+
+        if command == 'AT+CIPSEND' and transparent:
+            if link is None:
+                reply(fd, 'ERROR\r\n')
+                continue
+            reply(fd, findReply(command))
+            passthrough = True
+            print("Transparent link up")
+            if line: link.sendall(line)
+            line = b''
+            break
+
+        if command in ('AT+RST', 'AT+RESTORE'):
+            booted = False
+            lastBanner = 0
+
+        reply(fd, findReply(command))
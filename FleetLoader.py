@@ -0,0 +1,306 @@
+# Flashes one .uze rom to many Uzeboxes at once.
+#
+# Each target is a unit: a serial port wired to its UART header, which gets the rom with
+# ZMODEM as from NetLoaderZ.py, or the host[:port] of its ESP8266, which gets it with the
+# windowed protocol of NetLoader.py (NETLOADERZ_WIFI=3). The rom is read and checked once,
+# and each unit runs in its own thread: the transfers wait on their links, not on each
+# other, so the whole fleet takes about as long as its slowest unit. A unit that fails is
+# tried again on a new connection, up to --retries times. A unit whose card holds the rom
+# already stops the transfer after its header and boots it. At the end a report lists the
+# result, attempts, time, throughput and retransmits of each unit, and for serial units the
+# slowest SD write and the UART ring peak from the loader's statistics. --csv appends all
+# of it to a file, one line per unit, to compare links and cards across the fleet.
+#
+# With --watch it then waits for the rom to be rebuilt and flashes it again, for as long as
+# it runs. Serial units get a break first, which returns a game built with LOADER_RETURN=1
+# to the loader; the others need the game's button combo. Each unit is given --wait
+# seconds to find its loader before its attempts count.
+#
+#   python3 FleetLoader.py game.uze /dev/ttyUSB0 /dev/ttyUSB1 192.168.1.50 192.168.1.51:333
+#   python3 FleetLoader.py game.uze -t lab.txt                 one target per line
+#   python3 FleetLoader.py default/game.uze /dev/ttyUSB0 -W    flash each build of the game
+
+import os
+import sys
+import csv
+import time
+import functools
+import threading
+import argparse
+
+import NetLoader
+import NetLoaderZ
+
+version = 1.0
+
+# Variables #######################################################################################
+
+interval = 2.0 # seconds between progress lines
+retryDelay = 1.0 # seconds before connecting again, while the loader starts over
+pollInterval = 0.25 # seconds between looks at the rom with --watch
+settleTime = 0.5 # seconds the rom must stay the same before it is read, the linker may still write it
+
+# Every unit gets the same frames: each one is encoded once for the whole fleet rather than
+# once per unit, which would cost about as much CPU time as the transfers take. flash()
+# empties the caches when it returns, so --watch only ever keeps the frames of one build.
+NetLoader.frame = functools.lru_cache(maxsize=None)(NetLoader.frame)
+NetLoaderZ.subpacket = functools.lru_cache(maxsize=None)(NetLoaderZ.subpacket)
+
+def clearFrames():
+    NetLoader.frame.cache_clear()
+    NetLoaderZ.subpacket.cache_clear()
+
+output = threading.Lock()
+
+def log(*text):
+    with output:
+        print(*text, flush=True)
+
+# Units ###########################################################################################
+
+class Unit(threading.Thread):
+    def __init__(self, target, data, name, args):
+        threading.Thread.__init__(self, daemon=True)
+        self.target = target
+        self.data = data
+        self.fileName = name
+        self.args = args
+        self.serial = target.startswith('/dev/') or os.path.exists(target)
+        self.sendBreak = args.watch
+        self.state = 'waiting'
+        self.pos = 0
+        self.attempts = 0
+        self.retransmits = 0
+        self.skipped = False
+        self.error = ''
+        self.stats = {} # the loader's NLZSTATS fields, serial units only
+        self.began = self.ended = 0.0
+
+    def verbose(self, *text):
+        if self.args.verbose: log(self.target + ':', *text)
+
+    def progress(self, pos, size):
+        self.pos = pos
+
+    # Seconds left to find the loader
+    def waitLeft(self):
+        return max(0.0, self.began + self.args.wait - time.time())
+
+    def sendSerial(self):
+        link = NetLoaderZ.SerialLink(self.target)
+        sender = NetLoaderZ.ZSender(link, self.verbose, self.args.zwindow)
+        try:
+            if self.sendBreak:
+                self.verbose("Returning to the loader")
+                link.sendBreak()
+                self.sendBreak = False
+            if self.args.baud == 'auto':
+                sender.findBaud(sorted(NetLoaderZ.bauds, reverse=True), wait=self.waitLeft())
+            else:
+                link.setBaud(int(self.args.baud))
+            self.state = 'sending'
+            sender.init()
+            try:
+                pos = sender.offer(self.fileName, len(self.data))
+                sender.send(self.data, pos, self.progress)
+            except NetLoaderZ.Skipped:
+                self.skipped = True
+            sender.finish()
+            self.stats = sender.readStats()
+        except (NetLoaderZ.LinkError, OSError):
+            # cancel, so the loader starts over for the next attempt
+            try:
+                link.write(b'\x18' * 8 + b'\x08' * 8)
+            except OSError:
+                pass
+            raise
+        finally:
+            self.retransmits += sender.retransmits
+            link.close()
+
+    def sendTcp(self):
+        address, _, port = self.target.partition(':')
+        s = NetLoader.connect(address, int(port) if port else NetLoader.tcp_port)
+        sender = NetLoader.WinSender(s.fileno(), s.fileno(), self.args.window, self.verbose)
+        try:
+            self.state = 'sending'
+            self.skipped = sender.sendFile(self.data, self.progress)
+        finally:
+            self.retransmits += sender.goBacks
+            s.close()
+
+    def run(self):
+        self.began = time.time()
+        while True:
+            self.attempts += 1
+            self.state = 'connecting'
+            self.pos = 0
+            try:
+                if self.serial:
+                    self.sendSerial()
+                else:
+                    self.sendTcp()
+                self.state = 'done'
+                break
+            except (NetLoaderZ.LinkError, ConnectionError, OSError, ValueError) as e:
+                self.error = str(e) or type(e).__name__
+                if self.waitLeft() > 0 and self.state == 'connecting':
+                    # the loader may still be booting
+                    self.verbose("no loader yet (%s)" % self.error)
+                    self.attempts -= 1
+                    time.sleep(retryDelay)
+                    continue
+                if self.attempts > self.args.retries:
+                    self.state = 'failed'
+                    break
+                log("%s: attempt %d failed (%s), trying again" % (self.target, self.attempts, self.error))
+                time.sleep(retryDelay)
+        self.ended = time.time()
+        if self.state == 'done':
+            log("%s: %s in %.2f s" % (self.target, 'had it already, booted' if self.skipped else 'done', self.ended - self.began))
+        else:
+            log("%s: failed (%s)" % (self.target, self.error))
+
+###################################################################################################
+
+def report(units, t):
+    width = max(len('unit'), max(len(u.target) for u in units))
+    log()
+    log("%-*s  %-6s  %8s  %7s  %8s  %11s  %6s  %4s" % (width, 'unit', 'result', 'attempts', 'time', 'bytes/s', 'retransmits',
+        'sd max', 'peak'))
+    for u in units:
+        d = u.ended - u.began
+        result = 'FAILED' if u.state != 'done' else 'same' if u.skipped else 'ok'
+        log("%-*s  %-6s  %8d  %6.2fs  %8s  %11d  %6s  %4s" % (width, u.target, result,
+            u.attempts, d, '%.0f' % (len(u.data) / d) if result == 'ok' and d > 0 else '-', u.retransmits,
+            u.stats.get('sdmax', '-'), u.stats.get('peak', '-')))
+        if u.state != 'done': log("%-*s  %s" % (width, '', u.error))
+    done = [u for u in units if u.state == 'done']
+    slowest = max((u.ended - u.began for u in done), default=0)
+    log()
+    log("%d of %d units flashed in %.2f s, slowest unit %.2f s" % (len(done), len(units), t, slowest))
+    same = sum(u.skipped for u in done)
+    if same: log("%d of them had the rom on their card already" % same)
+
+# Appends a line per unit to a CSV file, with the header line if the file is new
+statsFields = ['bytes', 'lines', 'rate', 'resends', 'crc', 'timeouts', 'commits', 'sdmin', 'sdavg', 'sdmax',
+               'peak', 'fe', 'ov', 'drops']
+
+def writeCsv(fileName, units, gameName):
+    new = not os.path.exists(fileName)
+    with open(fileName, 'a', newline='') as f:
+        w = csv.writer(f)
+        if new: w.writerow(['time', 'unit', 'game', 'result', 'attempts', 'seconds', 'retransmits'] + statsFields)
+        for u in units:
+            result = 'FAILED' if u.state != 'done' else 'same' if u.skipped else 'ok'
+            w.writerow([time.strftime('%Y-%m-%d %H:%M:%S'), u.target, gameName, result, u.attempts,
+                '%.2f' % (u.ended - u.began), u.retransmits] + [u.stats.get(name, '') for name in statsFields])
+
+# Flashes every target, returns True if all of them got the rom
+def flash(targets, data, name, gameName, args):
+    try:
+        return flashUnits(targets, data, name, gameName, args)
+    finally:
+        clearFrames()
+
+def flashUnits(targets, data, name, gameName, args):
+    start = time.time()
+    units = [Unit(target, data, name, args) for target in targets]
+    for u in units: u.start()
+
+    while any(u.is_alive() for u in units):
+        for u in units: u.join(interval / len(units))
+        busy = [u for u in units if u.is_alive()]
+        if not busy: break
+        slowest = min(busy, key=lambda u: u.pos)
+        log("%5.1fs  %d done, %d failed, %d busy, slowest %s %d%% (%s)" % (time.time() - start,
+            sum(u.state == 'done' for u in units), sum(u.state == 'failed' for u in units), len(busy),
+            slowest.target, slowest.pos * 100 // len(data), slowest.state))
+
+    report(units, time.time() - start)
+    if args.csv: writeCsv(args.csv, units, gameName)
+    return all(u.state == 'done' for u in units)
+
+# Returns the rom and its game name, None if it isn't a valid .uze file
+def readRom(fileName, force):
+    data = open(fileName, 'rb').read()
+    if data[:6] != b'UZEBOX' and not force: return None, ''
+    return data, data[14:45].split(b'\0')[0].decode('latin-1')
+
+# Changes whenever the file is written again, None while it is missing
+def stamp(fileName):
+    try:
+        st = os.stat(fileName)
+    except OSError:
+        return None
+    return st.st_mtime_ns, st.st_size
+
+# Waits for a new build of the rom: a stamp that changed and then stayed the same
+def waitRebuild(fileName, last):
+    while True:
+        time.sleep(pollInterval)
+        now = stamp(fileName)
+        if now is None or now == last: continue
+        time.sleep(settleTime)
+        if stamp(fileName) == now: return now
+
+if __name__ == '__main__':
+    cmdparser = argparse.ArgumentParser(description='Send a .uze file to many Uzeboxes at once')
+    cmdparser.add_argument('filename', help="file to be sent to the Uzeboxes")
+    cmdparser.add_argument('targets', nargs='*', help="serial port of a UART header, or host[:port] of an ESP8266 (port %d by default)" % NetLoader.tcp_port)
+    cmdparser.add_argument('-t', '--targets', dest='targetFile', help="file of targets, one per line, # starts a comment")
+    cmdparser.add_argument('-r', '--retries', dest='retries', type=int, default=2, help="attempts after the first, per unit (default 2)")
+    cmdparser.add_argument('-b', '--baud', dest='baud', default='auto', help="baud rate of the serial ports, or auto to find each loader's (default)")
+    cmdparser.add_argument('-w', '--window', dest='window', type=int, default=NetLoader.window,
+                           help="bytes in flight on TCP units, at most (default %d)" % NetLoader.window)
+    cmdparser.add_argument('-z', '--zwindow', dest='zwindow', type=int, default=NetLoaderZ.ringSize - 32,
+                           help="bytes past a sector being written on serial units, at most (default %d)" % (NetLoaderZ.ringSize - 32))
+    cmdparser.add_argument('-v', '--verbose', action='store_true', help="print each unit's retransmits and acknowledgements")
+    cmdparser.add_argument('-f', '--force', action='store_true', help="force the file to be sent, even if it isn't a valid .uze file")
+    cmdparser.add_argument('-c', '--csv', dest='csv', help="append each unit's result and loader statistics to this CSV file")
+    cmdparser.add_argument('-W', '--watch', action='store_true', help="flash the rom again each time it is rebuilt, with a break first on serial units")
+    cmdparser.add_argument('--wait', dest='wait', type=float,
+                           help="seconds each unit keeps looking for its loader before an attempt counts (default 30 with --watch, else 0)")
+    args = cmdparser.parse_args()
+    if args.wait is None: args.wait = NetLoaderZ.bootWait if args.watch else 0.0
+
+    log("FleetLoader version", version)
+
+    targets = list(args.targets)
+    if args.targetFile:
+        for line in open(args.targetFile):
+            line = line.split('#')[0].strip()
+            if line: targets.append(line)
+    if not targets:
+        log("No targets")
+        sys.exit(2)
+    if len(set(targets)) != len(targets):
+        log("A target is given twice")
+        sys.exit(2)
+
+    name = os.path.basename(args.filename)
+    last = stamp(args.filename)
+    data, gameName = readRom(args.filename, args.force)
+    if data is None:
+        log("The specified file doesn't appear to be a valid .uze file. Use --force to send it anyways.")
+        sys.exit(2)
+
+    log("Sending", gameName, "to", len(targets), "units")
+    ok = flash(targets, data, name, gameName, args)
+    if not args.watch: sys.exit(0 if ok else 1)
+
+    try:
+        while True:
+            log()
+            log("Watching", args.filename, "for a new build, ^C to stop")
+            last = waitRebuild(args.filename, last)
+            built = last[0] / 1e9 # when the linker wrote it
+            data, gameName = readRom(args.filename, args.force)
+            if data is None:
+                log("The new", name, "isn't a valid .uze file, skipped")
+                continue
+            log("Rebuilt, sending", gameName, "to", len(targets), "units")
+            if flash(targets, data, name, gameName, args):
+                log("Running %.2f s after the build" % (time.time() - built))
+    except KeyboardInterrupt:
+        pass
@@ -1,13 +1,21 @@
 # Multiple Connections as TCP Server here: https://www.espressif.com/sites/default/files/documentation/4b-esp8266_at_command_examples_en.pdf
+#
+# Sends the rom in frames of one SD sector with a CRC each, and keeps a window of frames in
+# flight: NetLoaderZ (built with NETLOADERZ_WIFI=3, see netwin.h) acknowledges what it has
+# written and asks to go back when a frame was damaged on its UART. --lockstep talks to the
+# original NetLoader instead, which echoes every 128 byte chunk.
+#
+# WinSender is also used by FleetLoader.py to flash several units at once.
 
 import socket
 import os
 import sys
 import time
 import math
+import select
 import argparse
 
-version = 1.0
+version = 2.1
 
 # Variables #######################################################################################
 
@@ -15,101 +23,262 @@ tcp_ip = '192.168.4.1' # default IP on ESP8266
 tcp_port = 333 # default port on ESP8266
 
 chunkSize = 128
-currentChunk = 0
-totalChunks = 0
-fileSize = 0
+
+frameSize = 512 # one SD sector per frame
+window = 512 + 192 # bytes in flight past the acknowledged frames: the sector being written and what the UART ring holds meanwhile
+timeout = 1.0 # seconds without an acknowledgement before going back
+giveUp = 30.0 # seconds without progress before giving up
+
+NW_START = 0xffffffff
 
 ###################################################################################################
 
-print("NetLoader version", version)
+def crc16(data, crc=0):
+    for c in data:
+        crc ^= c << 8
+        for i in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xffff
+    return crc
 
-# Arguments #######################################################################################
+def frame(offset, data):
+    head = offset.to_bytes(4, 'little') + len(data).to_bytes(2, 'little')
+    return b'NL' + head + data + crc16(head + data).to_bytes(2, 'big')
 
-cmdparser = argparse.ArgumentParser(description='Send a .uze file to a Uzebox over wifi')
-cmdparser.add_argument('-i', '--input', dest='filename', help="file to be sent to Uzebox", required=True)
-cmdparser.add_argument('-v', '--verbose', action='store_true', help="enable verbose output while sending a file")
-cmdparser.add_argument('-f', '--force', action='store_true', help="force the file to be sent, even if it isn't a valid .uze file")
-args = cmdparser.parse_args()
+# Connects to the module's server
+def connect(address, port=tcp_port):
+    s = socket.create_connection((address, port), 10)
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    s.settimeout(None)
+    return s
 
-###################################################################################################
+# Windowed ########################################################################################
 
-fileName = args.filename
+class WinSender:
+    def __init__(self, rfd, wfd, window=window, log=None):
+        self.rfd = rfd
+        self.wfd = wfd
+        self.window = window
+        self.log = log or (lambda *text: None)
+        self.replies = b''
+        self.goBacks = 0
 
-f = open(fileName,'rb')
+    def send(self, data):
+        while data:
+            n = os.write(self.wfd, data)
+            data = data[n:]
 
-# check if the file is a valid .uze file
-# if the "UZEBOX" marker isn't there, then the file is either corrupted or not a valid .uze file
-fileHeader = f.read(6)
-if fileHeader != b'UZEBOX' and not args.force:
-    print("The specified file doesn't appear to be a valid .uze file. Use --force to send it anyways.")
-    f.close()
-    sys.exit()
+    # Returns what came within timeout seconds, b'' if nothing
+    def receive(self, timeout):
+        if not select.select([self.rfd], [], [], timeout)[0]: return b''
+        data = os.read(self.rfd, 4096)
+        if not data: raise ConnectionError("connection closed")
+        return data
 
-# read game name from the .uze header
-f.seek(14) # set file pointer to the beginning of the game name
-gameName = f.read(31)
-gameName = gameName.decode()
-f.seek(0) # reset back to the beginning of the file
+    # Returns the next reply of the loader as ('A', 'N' or 'S', offset), or (None, 0) after
+    # timeout. Anything else the module lets through fails the CRC and is skipped.
+    def reply(self, timeout):
+        limit = time.time() + timeout
+        while True:
+            while self.replies and (self.replies[:1] not in (b'A', b'N', b'S') or (len(self.replies) >= 7 and crc16(self.replies[:7]) != 0)):
+                self.replies = self.replies[1:]
+            if len(self.replies) >= 7:
+                r = self.replies[:7]
+                self.replies = self.replies[7:]
+                return chr(r[0]), int.from_bytes(r[1:5], 'little')
+            left = limit - time.time()
+            data = self.receive(max(0, left))
+            if not data and left <= 0: return None, 0
+            self.replies += data
 
-s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-s.settimeout(10)
-s.connect((tcp_ip, tcp_port))
-#s.settimeout(None)
+    # Sends the whole file, progress(acked, size) is called as the loader acknowledges it.
+    # Returns True if the loader stopped it as the rom is on its card already.
+    def sendFile(self, data, progress=None):
+        size = len(data)
+        acked = 0 # everything before is on the card
+        sent = 0 # next frame to send
+        furthest = 0 # end of the furthest frame sent
+        pending = b'' # rest of the frame being sent
+        streamed = 0 # bytes sent, frames included
+        base = 0 # streamed when the last acknowledged frame was sent
+        ends = {} # streamed at the end of each frame, by the offset after it
 
-fileSize = os.path.getsize(fileName)
+        # The reply gives the offset to start from: 0, or where a transfer broken
+        # by a lost connection stopped if the loader is still in it
+        for attempt in range(5):
+            self.send(frame(NW_START, size.to_bytes(4, 'little')))
+            kind, offset = self.reply(2.0)
+            if kind is not None: break
+        else:
+            raise ConnectionError("Uzebox didn't reply to the start frame")
+        if kind == 'S': return True
+        if offset > size:
+            raise ConnectionError("Uzebox is receiving another file")
+        acked = sent = furthest = offset
+        if offset: self.log("Resuming at", offset)
+        last = progressed = time.time()
 
-totalChunks = math.ceil(fileSize/chunkSize) # round up to nearest int
+        while acked < size:
+            # Frames go out a piece at a time, as the window allows: the loader
+            # can't hold a whole frame while it writes the previous one.
+            while base + self.window > streamed:
+                if not pending:
+                    if sent >= size: break
+                    pending = frame(sent, data[sent:sent + frameSize])
+                    sent = min(size, sent + frameSize)
+                    furthest = max(furthest, sent)
+                    ends[sent] = streamed + len(pending)
+                n = min(len(pending), base + self.window - streamed)
+                self.send(pending[:n])
+                pending = pending[n:]
+                streamed += n
 
-print("Sending", gameName)
+            kind, offset = self.reply(0.05 if pending or sent < size else 0.5)
+            if time.time() - progressed > giveUp:
+                raise ConnectionError("Uzebox stopped acknowledging at %d" % acked)
+            if kind is None:
+                if time.time() - last < timeout: continue
+                kind, offset = 'N', acked
+            else:
+                last = time.time()
+            if kind == 'S': return True
+            if offset > furthest: continue
+            if offset > acked:
+                acked = offset
+                sent = max(sent, acked)
+                base = max(base, ends.get(acked, base))
+                progressed = time.time()
+                self.log("Acknowledged", acked, "of", size)
+                if progress: progress(acked, size)
+            if kind == 'N':
+                # go back to the frame the loader expects, after the one being sent;
+                # the frames in flight are dropped by the loader without a write
+                self.log("Going back to", offset)
+                self.goBacks += 1
+                sent = offset
+                base = streamed
+                last = time.time()
 
-if args.verbose: print("File size:", fileSize, "bytes")
-if args.verbose: print("Chunks:", totalChunks)
+        # Empty frame at the end of the file, acknowledged once the last sector is written
+        for attempt in range(5):
+            self.send(frame(size, b''))
+            limit = time.time() + 2.0
+            while time.time() < limit:
+                kind, offset = self.reply(limit - time.time())
+                if kind == 'A' and offset == size: return False
+                if kind == 'S': return True
+        raise ConnectionError("Uzebox didn't acknowledge the end of the file")
 
-if args.verbose: print("Sending size data")
-s.send(str(totalChunks).encode())
+# Lockstep ########################################################################################
 
-if args.verbose: print("Waiting for reply")
-response = s.recv(int(math.log10(totalChunks))+1) # get number of digits in totalChunks variable
-if response.decode() != str(totalChunks):
-    print("Error\nData mismatch\nExpected:", totalChunks, "\nUzebox replied:", response.decode())
-    s.close()
-    f.close()
-    sys.exit()
+def sendLockstep(link, data, log):
+    fileSize = len(data)
+    currentChunk = 0
+    totalChunks = math.ceil(fileSize/chunkSize) # round up to nearest int
+
+    log("Chunks:", totalChunks)
+
+    log("Sending size data")
+    link.send(str(totalChunks).encode())
+
+    log("Waiting for reply")
+    response = link.receive(10)
+    if response.decode() != str(totalChunks):
+        raise ConnectionError("Data mismatch\nExpected: %s\nUzebox replied: %s" % (totalChunks, response.decode()))
 
-if args.verbose: print("") # new line
+    time.sleep(0.150)
 
-time.sleep(0.150)
+    while (currentChunk < totalChunks):
+        log("Sending chunk", currentChunk, "of", totalChunks)
+        l = data[currentChunk*chunkSize:(currentChunk+1)*chunkSize]
+        link.send(l)
+
+        log("Waiting for reply")
+        response = b''
+        while len(response) < len(l):
+            r = link.receive(10)
+            if not r: break
+            response += r
+        if response != l:
+            raise ConnectionError("Data mismatch\nExpected: %s\nUzebox replied: %s" % (l, response))
+
+        currentChunk += 1
+
+    link.send(b'DONE')
+    response = link.receive(10)
+    if response != b'DONE':
+        raise ConnectionError("Uzebox didn't reply to DONE signal\nUzebox replied %s" % response)
 
 ###################################################################################################
 
-while (currentChunk < totalChunks):
-    if args.verbose: print("Sending chunk", currentChunk, "of", totalChunks)
-    l = f.read(chunkSize)
+if __name__ == '__main__':
+    cmdparser = argparse.ArgumentParser(description='Send a .uze file to a Uzebox over wifi')
+    cmdparser.add_argument('-i', '--input', dest='filename', help="file to be sent to Uzebox", required=True)
+    cmdparser.add_argument('-a', '--address', dest='address', default=tcp_ip, help="address of the ESP8266 (default %s)" % tcp_ip)
+    cmdparser.add_argument('-p', '--port', dest='port', type=int, default=tcp_port, help="port of the ESP8266 (default %d)" % tcp_port)
+    cmdparser.add_argument('-w', '--window', dest='window', type=int, default=window, help="bytes in flight, at most (default %d)" % window)
+    cmdparser.add_argument('--lockstep', action='store_true', help="echoed 128 byte chunks, for the original NetLoader")
+    cmdparser.add_argument('--stdio', action='store_true', help="use stdin/stdout instead of a TCP connection")
+    cmdparser.add_argument('-v', '--verbose', action='store_true', help="enable verbose output while sending a file")
+    cmdparser.add_argument('-f', '--force', action='store_true', help="force the file to be sent, even if it isn't a valid .uze file")
+    args = cmdparser.parse_args()
+
+    # stdout is the link with --stdio
+    def log(*text):
+        print(*text, file=sys.stderr if args.stdio else sys.stdout, flush=True)
+    def verbose(*text):
+        if args.verbose: log(*text)
+
+    log("NetLoader version", version)
 
-    if args.verbose: print(l)
+    fileName = args.filename
 
-    s.send(l)
+    f = open(fileName,'rb')
 
-    if args.verbose: print("Waiting for reply")
-    response = s.recv(chunkSize)
-    if response != l:
-        print("Error\nData mismatch\nExpected:", l, "\nUzebox replied:", response)
-        s.close()
+    # check if the file is a valid .uze file
+    # if the "UZEBOX" marker isn't there, then the file is either corrupted or not a valid .uze file
+    fileHeader = f.read(6)
+    if fileHeader != b'UZEBOX' and not args.force:
+        log("The specified file doesn't appear to be a valid .uze file. Use --force to send it anyways.")
         f.close()
         sys.exit()
-        
-    currentChunk += 1
 
-    if args.verbose: print("") # new line
+    # read game name from the .uze header
+    f.seek(14) # set file pointer to the beginning of the game name
+    gameName = f.read(31)
+    gameName = gameName.split(b'\0')[0].decode()
+    f.seek(0) # reset back to the beginning of the file
 
-s.send(b'DONE')
-response = s.recv(4)
-if response != b'DONE':
-    print("Error\nUzebox didn't reply to DONE signal\nUzebox replied", response)
-    s.close()
+    data = f.read()
     f.close()
+    fileSize = len(data)
+
+    s = None
+    try:
+        if args.stdio:
+            link = WinSender(0, 1, args.window, verbose)
+        else:
+            s = connect(args.address, args.port)
+            link = WinSender(s.fileno(), s.fileno(), args.window, verbose)
+
+        log("Sending", gameName)
+        verbose("File size:", fileSize, "bytes")
+
+        start = time.time()
+        skipped = False
+        if args.lockstep:
+            sendLockstep(link, data, verbose)
+        else:
+            skipped = link.sendFile(data)
+        t = time.time() - start
+    except (ConnectionError, OSError) as e:
+        log("Error\n" + str(e))
+        sys.exit(1)
+    finally:
+        if s: s.close()
+
+    if skipped:
+        log("Done! The loader has this rom already, booted in %.2f s" % t)
+        sys.exit()
+    log("Done! %d bytes in %.2f s, %.0f bytes/s" % (fileSize, t, fileSize / t))
+    if link.goBacks: log(link.goBacks, "go back(s)")
     sys.exit()
-print("Done!")
-s.close()
-f.close()
-sys.exit()
\ No newline at end of file
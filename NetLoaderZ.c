@@ -30,49 +30,12 @@
 #include <uzebox.h>
 #include <bootlib.h>
 #include "uzenet.h"
+#include "zmodem.h"
+#include "netwin.h"
 
 #include "data/tileset.inc"
 #include "data/font-8x8-full.inc"
 
-// ZMODEM constants
-#define ZPAD            '*'
-#define ZDLE            0x18
-#define ZDLEE           0x58
-#define ZBIN            'A'
-#define ZHEX            'B'
-#define ZBIN32          'C'
-
-// ZMODEM frame types
-#define ZRQINIT         0
-#define ZRINIT          1
-#define ZSINIT          2
-#define ZACK            3
-#define ZFILE           4
-#define ZSKIP           5
-#define ZNAK            6
-#define ZABORT          7
-#define ZFIN            8
-#define ZRPOS           9
-#define ZDATA           10
-#define ZEOF            11
-#define ZFERR          12
-#define ZCRC           13
-#define ZCHALLENGE     14
-#define ZCOMPL         15
-#define ZCAN           16
-#define ZFREECNT       17
-#define ZCOMMAND       18
-#define ZSTDERR        19
-
-// ZMODEM frame end markers
-#define ZCRCE          'h'  // Frame ends, header follows
-#define ZCRCG          'i'  // Frame continues, no header follows
-#define ZCRCQ          'j'  // Frame continues, header follows
-#define ZCRCW          'k'  // Frame ends, header follows, wait for ZACK
-
-// Buffer size as a constant
-#define BUFFER_SIZE    1024
-
 //Common baud rates
 //In UART double speed mode
 #define UART_300_BAUD    		0 //11931
@@ -85,10 +48,74 @@
 #define UART_57600_BAUD			7 //61
 #define UART_115200_BAUD		8 //30
 
+// Speed of the UART header, an index of the bauds table of initializeUART()
+#ifndef NETLOADERZ_UART_SPEED
+    #define NETLOADERZ_UART_SPEED UART_57600_BAUD
+#endif
+
+// Transfer link. With NETLOADERZ_WIFI=1 the loader brings up the ESP8266,
+// connects to the sender at NETLOADERZ_HOST:NETLOADERZ_PORT and runs ZMODEM
+// over the transparent TCP link. With NETLOADERZ_WIFI=2 it downloads
+// NETLOADERZ_URL from the HTTP server at NETLOADERZ_HOST:NETLOADERZ_PORT.
+// With NETLOADERZ_WIFI=3 the module listens on NETLOADERZ_PORT and
+// NetLoader.py connects to it and sends the rom in windowed frames. All
+// fall back to ZMODEM on the UART header if the module or the connection
+// fails.
+#ifndef NETLOADERZ_WIFI
+    #define NETLOADERZ_WIFI 0
+#endif
+#ifndef NETLOADERZ_HOST
+    #define NETLOADERZ_HOST "192.168.4.2"
+#endif
+#ifndef NETLOADERZ_PORT
+    #if NETLOADERZ_WIFI == 3
+        #define NETLOADERZ_PORT 333
+    #else
+        #define NETLOADERZ_PORT 2333
+    #endif
+#endif
+#ifndef NETLOADERZ_URL
+    #define NETLOADERZ_URL "/netload.uze"
+#endif
+// HTTP downloads interrupted by the link resume with a Range request from
+// the last sector written, this many times
+#ifndef NETLOADERZ_HTTP_RETRIES
+    #define NETLOADERZ_HTTP_RETRIES 3
+#endif
+
+// Windowed transfers that fail wait for the sender to connect again and
+// start over, this many times
+#ifndef NETLOADERZ_NETWIN_RETRIES
+    #define NETLOADERZ_NETWIN_RETRIES 3
+#endif
+
+// EEPROM block recording the rom of the last complete transfer, see checkCardRom()
+#ifndef NETLOADERZ_EEPROM_ID
+    #define NETLOADERZ_EEPROM_ID 0x5558
+#endif
+
+// Rate of GetScanlineCounter(), the clock of the statistics
+#define LINE_RATE 15734UL   // scanlines per second, F_CPU / 1820
+
+
 // Strings
 static const char txt_sdno[] PROGMEM = "No SD card!";
 static const char txt_filn[] PROGMEM = "File doesn't exist!";
 static const char txt_zmodem[] PROGMEM = "Waiting for ZMODEM transfer...";
+static const char txt_same[] PROGMEM = "Same rom on card, booting...";
+#if NETLOADERZ_WIFI != 0
+static const char txt_wifi[] PROGMEM = "Connecting to WiFi...";
+static const char txt_wifino[] PROGMEM = "Link: UART (WiFi failed)";
+#endif
+#if NETLOADERZ_WIFI == 1
+static const char txt_wifiok[] PROGMEM = "Link: WiFi";
+#endif
+#if NETLOADERZ_WIFI == 2
+static const char txt_http[] PROGMEM = "Downloading over HTTP...";
+#endif
+#if NETLOADERZ_WIFI == 3
+static const char txt_netwin[] PROGMEM = "Waiting for NetLoader.py...";
+#endif
 
 // Global variables
 long int currentChunk = 0;
@@ -96,8 +123,38 @@ int totalChunks = 0;
 int sd_bufCount = 0;
 int sdSector = 0;
 
-// Static buffer allocation
-static uint8_t receive_buffer[BUFFER_SIZE];
+// NETLOAD.BIN on the SD card
+static sdc_struct_t sd_struct;
+static u8 sd_buf[512];
+
+// Identity of a rom: the program size and CRC32 from its .uze header, and
+// the CRC of the whole header sector
+typedef struct {
+    u32 progSize;
+    u32 crc32;
+    u16 headerCrc;
+} RomId;
+
+static RomId cardRom;       // rom in NETLOAD.BIN
+static RomId newRom;        // rom being received
+static bool romOnCard = false;  // NETLOAD.BIN holds all of cardRom
+static bool newRomValid = false;
+static bool romSkipped = false;
+
+// Statistics of the transfer, shown by printStats() and sent by sendStats()
+typedef struct {
+    u32 size;           // file size from the sender, 0 if unknown
+    u32 start;          // scanline clock when the file began
+    u16 commits;        // sectors written
+    u16 commitMin;      // scanlines per sector written, including the move to the next one
+    u16 commitMax;
+    u32 commitTotal;
+} TransferStats;
+
+static TransferStats xfer;
+#if NETLOADERZ_WIFI == 3
+static bool windowed = false;   // the transfer running is NetLoader.py's, not ZMODEM
+#endif
 
 char gameName[32];
 char gameAuthor[32];
@@ -108,38 +165,112 @@ unsigned int gameYear = 0;
 // UART initialization (matching Uzebox defaults)
 void initializeUART(void) {
     const u16 bauds[]={11931,2982,1490,745,372,185,92,61,30}; //UART baud rate dividers for double speed
-	u16 baud=bauds[UART_57600_BAUD];
+	u16 baud=bauds[NETLOADERZ_UART_SPEED];
 	UBRR0H=(baud>>8);
 	UBRR0L=(baud&0xff);
 	UCSR0A=(1<<U2X0); // double speed mode
 	UCSR0C=(1<<UCSZ01)+(1<<UCSZ00)+(0<<USBS0); //8-bit frame, no parity, 1 stop bit
-	UCSR0B=(1<<RXEN0); //Enable UART RX
+	UCSR0B=(1<<RXEN0)+(1<<TXEN0); //Enable UART RX & TX, both served by the kernel rings
 	InitUartRxBuffer();
+	InitUartTxBuffer();
+#if UART_STATS == 1
+	UartResetStats();
+#endif
 }
 
-// CRC functions for ZMODEM
-uint16_t crc16_ccitt(uint8_t *data, int length) {
-    uint16_t crc = 0xFFFF;
-    while (length--) {
-        crc ^= *data++ << 8;
-        for (uint8_t i = 0; i < 8; i++) {
-            if (crc & 0x8000) {
-                crc = (crc << 1) ^ 0x1021;
-            } else {
-                crc <<= 1;
-            }
-        }
+#if NETLOADERZ_WIFI != 0
+// Brings up the module. wifi_Tick() runs from VSYNC meanwhile, so that the
+// blocking uzenet calls time out when no module answers.
+// In transparent mode the ESP8266 forwards every byte between the UART and
+// the TCP connection, so the ZMODEM code is the same for both links.
+bool connectWifi(void) {
+    bool ok;
+
+    Print(1, 1, txt_wifi);
+    SetUserPostVsyncCallback(&wifi_Tick);
+    ok = (wifi_Init(NULL) == WIFI_OK);
+#if NETLOADERZ_WIFI == 1
+    static char host[] = NETLOADERZ_HOST;
+    if (ok) ok = (wifi_TcpConnect(host, NETLOADERZ_PORT, true) == WIFI_OK);
+#endif
+    SetUserPostVsyncCallback(NULL);
+    return ok;
+}
+#endif
+
+// Starts the statistics of a file of size bytes, 0 if unknown
+void startStats(u32 size) {
+    memset(&xfer, 0, sizeof(xfer));
+    xfer.size = size;
+    xfer.start = GetScanlineCounter();
+    xfer.commitMin = 0xffff;
+}
+
+// Records a sector written since the scanline clock was at start
+void noteCommit(u32 start) {
+    u32 d = GetScanlinesSince(start);
+    if (d > 0xffff) d = 0xffff;
+    xfer.commits++;
+    xfer.commitTotal += d;
+    if (d < xfer.commitMin) xfer.commitMin = d;
+    if (d > xfer.commitMax) xfer.commitMax = d;
+}
+
+// Bytes on the card or in the sector buffer
+u32 storedBytes(void) {
+    return (u32)sdSector * 512 + sd_bufCount;
+}
+
+// Effective bytes/s since the file began
+u16 transferRate(void) {
+    u32 lines = GetScanlinesSince(xfer.start);
+    if (lines == 0) return 0;
+    return storedBytes() * LINE_RATE / lines;
+}
+
+// Go back requests and CRC failures of the link in use
+void linkErrors(u16 *resends, u16 *crcErrors) {
+#if NETLOADERZ_WIFI == 3
+    if (windowed) {
+        *resends = nw_stats.naks;
+        *crcErrors = nw_stats.crcErrors;
+        return;
     }
-    return crc;
+#endif
+    *resends = zm_stats.retransmits;
+    *crcErrors = zm_stats.crcErrors;
 }
 
-void updateUI() {
-    int progressAmount = (currentChunk * 100) / totalChunks;
+// Rate, ETA, link errors and SD commit times in scanlines, to tune links and cards
+void printStats() {
+    u16 rate = transferRate();
+    u32 stored = storedBytes();
+    u16 resends, crcErrors;
+
+    Print(1,11,PSTR("Speed          B/s ETA     s"));
+    Print(1,12,PSTR("Resends            CRC"));
+    Print(1,13,PSTR("SD write   min   avg   max"));
+    Print(1,14,PSTR("lines"));
+
+    PrintInt(14,11,rate,false);
+    if (rate != 0 && xfer.size > stored) {
+        PrintInt(27,11,(xfer.size - stored) / rate,false);
+    } else {
+        Print(23,11,PSTR("    -"));
+    }
+
+    linkErrors(&resends, &crcErrors);
+    PrintInt(14,12,resends,false);
+    PrintInt(27,12,crcErrors,false);
 
-    int onesDigit = progressAmount % 10;
-    int tensDigit = (progressAmount / 10) % 10;
-    int progressBlockAmount = (onesDigit * 8) / 10;
+    if (xfer.commits != 0) {
+        PrintInt(14,14,xfer.commitMin,false);
+        PrintInt(20,14,xfer.commitTotal / xfer.commits,false);
+        PrintInt(26,14,xfer.commitMax,false);
+    }
+}
 
+void updateUI() {
     SetTile(9,20,9);
     SetTile(20,20,9);
     SetTile(9,19,11);
@@ -149,7 +280,14 @@ void updateUI() {
     Fill(10,19,10,1,10);
     Fill(10,21,10,1,10);
 
+    // totalChunks is 0 until the sender gives the file size, if ever
     if (totalChunks != 0) {
+        int progressAmount = (currentChunk * 100) / totalChunks;
+
+        int onesDigit = progressAmount % 10;
+        int tensDigit = (progressAmount / 10) % 10;
+        int progressBlockAmount = (onesDigit * 8) / 10;
+
         if (tensDigit != 0) SetTile(9+tensDigit,20,8);
         if (onesDigit != 0) SetTile(10+tensDigit,20,progressBlockAmount+1);
 
@@ -160,6 +298,74 @@ void updateUI() {
         PrintInt(13,23,currentChunk,false);
         PrintChar(15,23,'/');
     }
+
+    printStats();
+}
+
+#if UART_STATS == 1
+// UART line errors, ring drops and peak ring occupancy, to tune the baud rate
+void printUartStats() {
+    struct UartStatsStruct stats;
+    UartGetStats(&stats);
+
+    Print(1,26,PSTR("FE    OV    DROP    PEAK"));
+    PrintInt(5,26,stats.frameErrors,false);
+    PrintInt(11,26,stats.overruns,false);
+    PrintInt(19,26,stats.drops,false);
+    PrintInt(28,26,stats.peak,false);
+}
+#endif
+
+// Sends text on the UART, waiting for room in the ring
+void uartPrint_P(const char *text) {
+    char c;
+    while ((c = pgm_read_byte(text++)) != 0) {
+        while (UartSendChar(c) != 0);
+    }
+}
+
+void uartField(const char *name, u32 value) {
+    char digits[11];
+    uartPrint_P(name);
+    ultoa(value, digits, 10);
+    for (char *c = digits; *c != 0; c++) {
+        while (UartSendChar(*c) != 0);
+    }
+}
+
+// Machine readable summary of the transfer, sent after the sender ended the
+// ZMODEM session and before the boot. One line of name=value fields:
+//   NLZSTATS bytes=61440 lines=173664 rate=5566 resends=0 crc=0 timeouts=0 commits=120 sdmin=29 ...
+// with the SD commit times in scanlines of 63.6 us. The ring peak and line
+// errors (peak, fe, ov, drops) are only there with UART_STATS.
+void sendStats(void) {
+    u16 resends, crcErrors;
+
+    linkErrors(&resends, &crcErrors);
+    uartPrint_P(PSTR("NLZSTATS"));
+    uartField(PSTR(" bytes="), storedBytes());
+    uartField(PSTR(" lines="), GetScanlinesSince(xfer.start));
+    uartField(PSTR(" rate="), transferRate());
+    uartField(PSTR(" resends="), resends);
+    uartField(PSTR(" crc="), crcErrors);
+    uartField(PSTR(" timeouts="), zm_stats.timeouts);
+    uartField(PSTR(" commits="), xfer.commits);
+    uartField(PSTR(" sdmin="), xfer.commits ? xfer.commitMin : 0);
+    uartField(PSTR(" sdavg="), xfer.commits ? xfer.commitTotal / xfer.commits : 0);
+    uartField(PSTR(" sdmax="), xfer.commitMax);
+#if UART_STATS == 1
+    struct UartStatsStruct stats;
+    UartGetStats(&stats);
+    uartField(PSTR(" peak="), stats.peak);
+    uartField(PSTR(" fe="), stats.frameErrors);
+    uartField(PSTR(" ov="), stats.overruns);
+    uartField(PSTR(" drops="), stats.drops);
+#endif
+    uartPrint_P(PSTR("\r\n"));
+
+    // let the last bytes leave the USART before the bootloader takes over
+    while (!IsUartTxBufferEmpty());
+    WaitVsync(1);
 }
 
 void printGameInfo() {
@@ -189,90 +395,252 @@ void printGameInfo() {
     SetTile(1,8,13);
 }
 
-// ZMODEM protocol functions
-uint8_t readZModemByte(void) {
-    while (!(UCSR0A & (1<<RXC0)));  // Wait for data
-    return UDR0;
+// Reads the identity of the rom whose header sector is in sd_buf. Returns
+// false if it isn't an .uze header.
+bool readRomId(RomId *id) {
+    u16 crc = 0;
+
+    if (memcmp_P(sd_buf, PSTR("UZEBOX"), 6) != 0) return false;
+    for (u16 i = 0; i < 512; i++) crc = SDC_CRC16_Byte(crc, sd_buf[i]);
+    memcpy(&id->progSize, &sd_buf[8], 4);
+    memcpy(&id->crc32, &sd_buf[334], 4);
+    id->headerCrc = crc;
+    return true;
 }
 
-void sendZModemByte(uint8_t byte) {
-    if (byte == ZDLE || byte == 0x13 || byte == 0x11 || byte == 0x91 || byte == 0x93) {
-        while (!(UCSR0A & (1<<UDRE0)));  // Wait for empty transmit buffer
-        UDR0 = ZDLE;
-        while (!(UCSR0A & (1<<UDRE0)));  // Wait again
-        UDR0 = byte ^ 0x40;
-    } else {
-        while (!(UCSR0A & (1<<UDRE0)));  // Wait for empty transmit buffer
-        UDR0 = byte;
-    }
+// NETLOAD.BIN holds a whole rom when its header, in sd_buf, is the one
+// recorded after the last complete transfer. A transfer that broke after
+// writing the header of another rom left that header instead.
+void checkCardRom(void) {
+    struct EepromBlockStruct block;
+
+    romOnCard = readRomId(&cardRom) && EepromReadBlock(NETLOADERZ_EEPROM_ID, &block) == EEPROM_OK &&
+        memcmp(block.data, &cardRom, sizeof(cardRom)) == 0;
 }
 
-bool receiveZModemHeader(uint8_t *frameType) {
-    uint8_t header[4];
-    uint16_t crc;
+// Frees the block of the recorded rom before NETLOAD.BIN is first written,
+// so a transfer that breaks leaves no record of the file's header over the
+// body of another rom. Writing the id alone takes 7ms, rewriting the block
+// would stall the transfer for 100ms.
+void forgetCardRom(void) {
+    u16 addr;
 
-    // Wait for ZPAD
-    while (readZModemByte() != ZPAD);
+    if (EepromBlockExists(NETLOADERZ_EEPROM_ID, &addr, NULL) != EEPROM_OK) return;
+    WriteEeprom(addr, (u8)EEPROM_FREE_BLOCK);
+    WriteEeprom(addr + 1, (u8)(EEPROM_FREE_BLOCK >> 8));
+}
 
-    // Check frame type
-    *frameType = readZModemByte();
+// Records the rom just received, from bootRom() only. The EEPROM is written
+// when it changes.
+void saveCardRom(void) {
+    struct EepromBlockStruct block;
 
-    // Read 4 byte header
-    for (int i = 0; i < 4; i++) {
-        header[i] = readZModemByte();
-    }
+    if (!newRomValid) return;
+    if (EepromReadBlock(NETLOADERZ_EEPROM_ID, &block) == EEPROM_OK &&
+        memcmp(block.data, &newRom, sizeof(newRom)) == 0) return;
+
+    memset(&block, 0, sizeof(block));
+    block.id = NETLOADERZ_EEPROM_ID;
+    memcpy(block.data, &newRom, sizeof(newRom));
+    EepromWriteBlock(&block);
+}
+
+// The rom being sent is the one on the card: the sender is told to stop and
+// the rest of the transfer is dropped. An HTTP download runs to its end
+// without writing.
+void skipTransfer(void) {
+    romSkipped = true;
+    sd_bufCount = 0;
+    zm_Skip();
+#if NETLOADERZ_WIFI == 3
+    nw_Skip();
+#endif
+    Print(1, 24, txt_same);
+}
 
-    // Read and verify CRC
-    crc = (readZModemByte() << 8) | readZModemByte();
-    return (crc == crc16_ccitt(header, 4));
+// Appends received rom bytes to the file, writing each sector once full
+void storeData(const u8 *data, u16 length) {
+    u8 res;
+
+    if (romSkipped) return;
+
+    for (u16 i = 0; i < length; i++) {
+        sd_buf[sd_bufCount++] = data[i];
+
+        if (sd_bufCount == 512) {
+            if (sdSector == 0) {
+                // Extract game info from the .uze header
+                memcpy(gameName, &sd_buf[14], 31);
+                memcpy(gameAuthor, &sd_buf[46], 31);
+                gameYear0C = sd_buf[12];
+                gameYear0D = sd_buf[13];
+                gameYear = (gameYear0D<<8) | gameYear0C;
+                printGameInfo();
+
+                newRomValid = readRomId(&newRom);
+                if (newRomValid && romOnCard && memcmp(&newRom, &cardRom, sizeof(cardRom)) == 0) {
+                    skipTransfer();
+                    return;
+                }
+                romOnCard = false;
+                forgetCardRom();
+            }
+
+            u32 t = GetScanlineCounter();
+            res = FS_Write_Sector(&sd_struct);
+            if (res != 0U) {
+                PrintChar(2, 25, res + '0');
+                while(1);
+            }
+            FS_Next_Sector(&sd_struct);
+            FS_Read_Sector(&sd_struct);
+            noteCommit(t);
+            sd_bufCount = 0;
+            currentChunk++;
+            sdSector++;
+        }
+    }
 }
 
-void sendZModemHeader(uint8_t frameType) {
-    sendZModemByte(ZPAD);
-    sendZModemByte(ZDLE);
-    sendZModemByte(ZBIN);
-    sendZModemByte(frameType);
+// Writes the last, partial sector
+void flushData(void) {
+    u8 res;
 
-    // Send empty header
-    for (int i = 0; i < 4; i++) {
-        sendZModemByte(0);
+    if (sd_bufCount > 0) {
+        u32 t = GetScanlineCounter();
+        res = FS_Write_Sector(&sd_struct);
+        if (res != 0U) {
+            PrintChar(2, 25, res + '0');
+            while(1);
+        }
+        noteCommit(t);
     }
+}
+
+// Restarts writing at the beginning of the file
+void rewindData(void) {
+    FS_Reset_Sector(&sd_struct);
+    FS_Read_Sector(&sd_struct);
+    sd_bufCount = 0;
+    sdSector = 0;
+    currentChunk = 0;
+    totalChunks = 0;
+    romSkipped = false;
+    newRomValid = false;
+}
 
-    // Send CRC
-    uint16_t crc = crc16_ccitt((uint8_t[]){0,0,0,0}, 4);
-    sendZModemByte(crc >> 8);
-    sendZModemByte(crc & 0xFF);
+// Boots NETLOAD.BIN, once the rom it now holds is recorded
+void bootRom(void) {
+    saveCardRom();
+    FS_Reset_Sector(&sd_struct);
+    Bootld_Request(&sd_struct);
 }
 
-bool receiveZModemData(uint8_t *buffer, int *length) {
-    uint8_t byte;
-    int count = 0;
-    bool escaped = false;
+#if NETLOADERZ_WIFI == 2
+static bool httpFinished = false;
+static s8 httpResult;
+static u16 httpCode;
+
+void httpBody(u8 *data, u16 length) {
+    if (totalChunks == 0 && HttpTotalLength() != HTTP_UNTIL_CLOSED) {
+        totalChunks = (HttpTotalLength() + 511) / 512;
+        xfer.size = HttpTotalLength();
+    }
+    storeData(data, length);
+}
 
-    while (1) {
-        byte = readZModemByte();
+void httpDone(s8 result, u16 responseCode) {
+    httpResult = result;
+    httpCode = responseCode;
+    httpFinished = true;
+}
 
-        if (byte == ZDLE) {
-            escaped = true;
-            continue;
+// Streams the rom from the HTTP server straight into the file. The UART is
+// polled continuously so that the link runs at full speed. When the
+// transfer breaks, the bytes of the partial sector are dropped and the rest
+// is requested from the last sector written.
+bool downloadHttp(void) {
+    static char host[] = NETLOADERZ_HOST;
+    static char url[] = NETLOADERZ_URL;
+    u16 frame = GetVsyncCounter();
+
+    Print(1, 1, txt_http);
+    startStats(0);
+
+    for (u8 attempt = 0; attempt <= NETLOADERZ_HTTP_RETRIES; attempt++) {
+        sd_bufCount = 0;
+        httpFinished = false;
+        if (HttpGetRange(host, NETLOADERZ_PORT, url, (u32)sdSector * 512, httpBody, httpDone) != WIFI_OK) return false;
+
+        while (!httpFinished) {
+            wifi_Poll();
+
+            if (GetVsyncCounter() != frame) {
+                frame = GetVsyncCounter();
+                wifi_Tick();
+                if (totalChunks != 0) updateUI();
+#if UART_STATS == 1
+                printUartStats();
+#endif
+            }
         }
 
-        if (escaped) {
-            escaped = false;
-            if (byte == ZCRCE || byte == ZCRCG || byte == ZCRCQ || byte == ZCRCW) {
-                break;
-            }
-            byte ^= 0x40;
+        if (httpResult == WIFI_OK) {
+            flushData();
+            return true;
         }
 
-        buffer[count++] = byte;
-        if (count >= BUFFER_SIZE) break;
+        // Nothing left past the last sector written: the rom ended on a sector boundary
+        if (httpCode == 416 && sdSector != 0) return true;
+        if (httpResult == WIFI_ERR_HTTP) return false;
     }
+    return false;
+}
+#endif
 
-    *length = count;
-    return true;
+// ZMODEM callbacks, see zmodem.c
+void zmodemFile(const char *name, u32 size) {
+    totalChunks = (size + 511) / 512;
+    startStats(size);
 }
 
+// Called once per frame while the transfer runs
+void zmodemIdle(void) {
+    if (totalChunks != 0) updateUI();
+#if UART_STATS == 1
+    printUartStats();
+#endif
+}
+
+#if NETLOADERZ_WIFI == 3
+void netwinFile(u32 size) {
+    totalChunks = (size + 511) / 512;
+    startStats(size);
+}
+
+// Every frame is parsed into sd_buf, including those resent or damaged
+// after the last one is accepted, so the last one is written at once
+// instead of waiting in sd_buf for the end of the transfer.
+void storeFrame(const u8 *data, u16 length) {
+    storeData(data, length);
+    if (length < NW_FRAME_SIZE) flushData();
+}
+
+// NetLoader.py sends one sector per frame, received straight into sd_buf,
+// so storeFrame writes each frame in place.
+bool receiveWindowed(void) {
+    Print(1, 1, txt_netwin);
+    if (wifi_TcpListen(NETLOADERZ_PORT) != WIFI_OK) return false;
+    windowed = true;
+    for (u8 attempt = 0; attempt <= NETLOADERZ_NETWIN_RETRIES; attempt++) {
+        if (nw_Receive(sd_buf, &netwinFile, &storeFrame, &zmodemIdle) == NW_OK) return true;
+        rewindData();
+    }
+    windowed = false;
+    return false;
+}
+#endif
+
 int main() {
     ClearVram();
     SetTileTable(tileset);
@@ -281,10 +649,17 @@ int main() {
     // Initialize UART for ZMODEM
     initializeUART();
 
+#if NETLOADERZ_WIFI == 1
+    if (connectWifi()) {
+        Print(1, 24, txt_wifiok);
+    } else {
+        initializeUART();
+        Print(1, 24, txt_wifino);
+    }
+#endif
+
     // SD card initialization
     u8 res;
-    sdc_struct_t sd_struct;
-    u8 sd_buf[512];
     u32 t32;
 
     sd_struct.bufp = &(sd_buf[0]);
@@ -313,88 +688,36 @@ int main() {
 
     FS_Select_Cluster(&sd_struct, t32);
     FS_Read_Sector(&sd_struct);
+    checkCardRom();
 
-    Print(1, 1, txt_zmodem);
+#if NETLOADERZ_WIFI == 2
+    if (connectWifi() && downloadHttp()) bootRom();
 
-    // ZMODEM receive loop
-    uint8_t frameType;
-    int dataLength;
-    bool receiving = true;
-
-    // Send ZRINIT
-    sendZModemHeader(ZRINIT);
-
-    while(receiving) {
-        if (receiveZModemHeader(&frameType)) {
-            switch(frameType) {
-                case ZFILE:
-                    // Handle file info
-                    receiveZModemData(receive_buffer, &dataLength);
-                    // Extract file info here
-                    sendZModemHeader(ZRPOS);
-                    break;
-
-                case ZDATA:
-                    // Receive data block
-                    if (receiveZModemData(receive_buffer, &dataLength)) {
-                        // Write to SD buffer
-                        for (int i = 0; i < dataLength; i++) {
-                            sd_buf[sd_bufCount++] = receive_buffer[i];
-
-                            if (sd_bufCount == 512) {
-                                res = FS_Write_Sector(&sd_struct);
-                                if (res != 0U) {
-                                    PrintChar(2, 25, res + '0');
-                                    while(1);
-                                }
-                                FS_Next_Sector(&sd_struct);
-                                FS_Read_Sector(&sd_struct);
-                                sd_bufCount = 0;
-                                currentChunk++;
-                                sdSector++;
-
-                                if (sdSector == 1) {
-                                    // Extract game info from first sector
-                                    memcpy(gameName, &receive_buffer[14], 31);
-                                    memcpy(gameAuthor, &receive_buffer[46], 31);
-                                    gameYear0C = receive_buffer[12];
-                                    gameYear0D = receive_buffer[13];
-                                    gameYear = (gameYear0D<<8) | gameYear0C;
-                                    printGameInfo();
-                                }
-                            }
-                        }
-                        sendZModemHeader(ZACK);
-                    }
-                    break;
-
-                case ZEOF:
-                    // Write any remaining data
-                    if (sd_bufCount > 0) {
-                        res = FS_Write_Sector(&sd_struct);
-                        if (res != 0U) {
-                            PrintChar(2, 25, res + '0');
-                            while(1);
-                        }
-                    }
-                    sendZModemHeader(ZRINIT);
-                    break;
-
-                case ZFIN:
-                    // Transfer complete
-                    sendZModemHeader(ZFIN);
-                    receiving = false;
-                    break;
-            }
-        }
+    // Start over with ZMODEM on the UART header
+    rewindData();
+    initializeUART();
+    Print(1, 24, txt_wifino);
+#endif
+
+#if NETLOADERZ_WIFI == 3
+    if (connectWifi() && receiveWindowed()) bootRom();
 
-        updateUI();
-        WaitVsync(1);
+    rewindData();
+    initializeUART();
+    Print(1, 24, txt_wifino);
+#endif
+
+    Print(1, 1, txt_zmodem);
+
+    // Receive the rom, starting over when a transfer is cancelled
+    while (zm_Receive(&zmodemFile, &storeData, &zmodemIdle) != ZM_OK) {
+        rewindData();
     }
+    flushData();
+    sendStats();
 
     // Boot the loaded game
-    FS_Reset_Sector(&sd_struct);
-    Bootld_Request(&sd_struct);
+    bootRom();
 
     while(1);
     return 0;
@@ -0,0 +1,488 @@
+# Sends a .uze rom to NetLoaderZ with ZMODEM, tuned for the Uzebox receiver.
+#
+# Generic senders know nothing about the loader: it writes the rom to the SD card one
+# 512 byte sector at a time, and while a sector is written (1.5 ms, 10 ms or more when the
+# card erases a block) the bytes that arrive pile up in the kernel's 256 byte UART ring.
+# This sender cuts the data into subpackets that end on sector boundaries, so each one is
+# committed as soon as it is checked, and ends them with ZCRCQ: the loader acknowledges
+# each sector once it is written. The sender never has more than --window bytes on the wire
+# past a sector that is not acknowledged yet, which is what the ring can take during the
+# write, so the stream never stops while the card is idle and never overruns the ring
+# while it is busy. A retransmit halves the window, clean sectors grow it back.
+#
+# On a serial port it finds the loader's rate by itself (NETLOADERZ_UART_SPEED), highest
+# first, and only keeps a rate where the loader answered every probe with a valid header.
+# After the session the loader sends a line of statistics (NLZSTATS, see sendStats() in
+# NetLoaderZ.c), which is printed: its rate, SD write times and UART ring peak.
+#
+# With --break it first sends a break, which returns a game built with LOADER_RETURN=1 to
+# the loader (see kernel/defines.h), and waits for the loader to come up.
+#
+#   python3 NetLoaderZ.py --port /dev/ttyUSB0 game.uze       UART header
+#   python3 NetLoaderZ.py --listen 2333 game.uze             WiFi link (NETLOADERZ_WIFI=1)
+#   python3 NetLoaderZ.py --stdio game.uze                   stdin/stdout, as sz
+
+import os
+import sys
+import time
+import select
+import socket
+import termios
+import tty
+import argparse
+
+version = 1.0
+
+# Variables #######################################################################################
+
+sectorSize = 512    # the loader writes the rom one SD sector at a time
+ringSize = 256      # UART_RX_BUFFER_SIZE of default/Makefile
+bootWait = 30.0     # seconds for the loader to come up after a break: the bootloader flashes it first
+
+# Rates of the loader's initializeUART() table, tried from the highest
+bauds = {9600: termios.B9600, 19200: termios.B19200, 38400: termios.B38400,
+         57600: termios.B57600, 115200: termios.B115200}
+
+ZPAD = 0x2a
+ZDLE = 0x18
+ZBIN = 0x41
+ZHEX = 0x42
+
+# Frame types
+ZRQINIT = 0
+ZRINIT = 1
+ZACK = 3
+ZFILE = 4
+ZSKIP = 5
+ZNAK = 6
+ZABORT = 7
+ZFIN = 8
+ZRPOS = 9
+ZDATA = 10
+ZEOF = 11
+ZFERR = 12
+ZCAN = 16
+
+# Subpacket ends
+ZCRCE = 0x68    # frame ends, header follows
+ZCRCG = 0x69    # frame continues
+ZCRCQ = 0x6a    # frame continues, ZACK expected
+ZCRCW = 0x6b    # frame ends, ZACK expected
+
+# ZRINIT flags
+CANFDX = 0x01
+CANOVIO = 0x02
+
+escaped = {ZDLE, 0x10, 0x90, 0x11, 0x91, 0x13, 0x93}
+
+###################################################################################################
+
+def crc16(data, crc=0):
+    for c in data:
+        crc ^= c << 8
+        for i in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xffff
+    return crc
+
+def escape(data):
+    out = bytearray()
+    for c in data:
+        if c in escaped:
+            out += bytes((ZDLE, c ^ 0x40))
+        else:
+            out.append(c)
+    return bytes(out)
+
+def hexHeader(type, pos):
+    d = bytes((type,)) + pos.to_bytes(4, 'little')
+    frame = b'**\x18B' + (d + crc16(d).to_bytes(2, 'big')).hex().encode() + b'\r\x8a'
+    return frame if type in (ZACK, ZFIN) else frame + b'\x11'
+
+def binHeader(type, pos):
+    d = bytes((type,)) + pos.to_bytes(4, 'little')
+    return b'*\x18A' + escape(d + crc16(d).to_bytes(2, 'big'))
+
+def subpacket(data, end):
+    return escape(data) + bytes((ZDLE, end)) + escape(crc16(data + bytes((end,))).to_bytes(2, 'big'))
+
+class LinkError(Exception):
+    pass
+
+# The loader has the rom already, on its card: the session is ended with finish()
+class Skipped(Exception):
+    pass
+
+# Links ###########################################################################################
+
+class Link:
+    def __init__(self, rfd, wfd):
+        self.rfd = rfd
+        self.wfd = wfd
+
+    def read(self, timeout):
+        if not select.select([self.rfd], [], [], timeout)[0]: return b''
+        data = os.read(self.rfd, 4096)
+        if not data: raise LinkError("link closed")
+        return data
+
+    def write(self, data):
+        while data:
+            n = os.write(self.wfd, data)
+            data = data[n:]
+
+    def setBaud(self, baud):
+        pass
+
+    def flush(self):
+        pass
+
+    def sendBreak(self):
+        pass
+
+    def close(self):
+        pass
+
+class SerialLink(Link):
+    def __init__(self, port):
+        fd = os.open(port, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(fd)
+        Link.__init__(self, fd, fd)
+
+    def setBaud(self, baud):
+        attr = termios.tcgetattr(self.rfd)
+        attr[4] = attr[5] = bauds[baud]
+        termios.tcsetattr(self.rfd, termios.TCSADRAIN, attr)
+
+    def flush(self):
+        termios.tcflush(self.rfd, termios.TCIOFLUSH)
+
+    # Holds the line low for 0.25 to 0.5 s
+    def sendBreak(self):
+        termios.tcsendbreak(self.rfd, 0)
+
+    def close(self):
+        os.close(self.rfd)
+
+class SocketLink(Link):
+    def __init__(self, sock):
+        self.sock = sock
+        Link.__init__(self, sock.fileno(), sock.fileno())
+
+    def close(self):
+        self.sock.close()
+
+# Sender ##########################################################################################
+
+class ZSender:
+    def __init__(self, link, log, window=ringSize - 32, timeout=10.0):
+        self.link = link
+        self.log = log
+        self.maxWindow = window
+        self.window = window
+        self.timeout = timeout
+        self.buf = b''
+        self.rxBuffer = 0
+        self.rxFlags = CANFDX | CANOVIO
+        self.retransmits = 0
+        self.ackWait = 0.0
+        self.latencies = []
+
+    # Returns the next hex header from the loader as (type, position), or (None, 0) after timeout
+    def readHeader(self, timeout):
+        limit = time.time() + timeout
+        while True:
+            if b'\x18\x18\x18\x18\x18' in self.buf: raise LinkError("cancelled by the loader")
+            i = self.buf.find(b'\x18B')
+            if i >= 0 and len(self.buf) >= i + 16:
+                try:
+                    d = bytes.fromhex(self.buf[i + 2:i + 16].decode('latin-1'))
+                except ValueError:
+                    d = b''
+                if len(d) == 7 and crc16(d) == 0:
+                    self.buf = self.buf[i + 16:]
+                    return d[0], int.from_bytes(d[1:5], 'little')
+                self.buf = self.buf[i + 2:]
+                continue
+            if i < 0: self.buf = self.buf[-4:]
+            left = limit - time.time()
+            data = self.link.read(max(0, min(left, 0.5)))
+            if not data and left <= 0: return None, 0
+            self.buf += data
+
+    def expect(self, types, timeout):
+        while True:
+            type, pos = self.readHeader(timeout)
+            if type in (ZCAN, ZABORT, ZFERR): raise LinkError("aborted by the loader")
+            if type == ZSKIP: raise Skipped()
+            if type is None or type in types: return type, pos
+
+    # ZRQINIT until a ZRINIT: the loader's buffer size and flags
+    def init(self, timeout=60.0):
+        limit = time.time() + timeout
+        while time.time() < limit:
+            self.link.write(b'rz\r' + hexHeader(ZRQINIT, 0))
+            type, pos = self.expect((ZRINIT,), 2.0)
+            if type == ZRINIT:
+                self.rxBuffer = pos & 0xffff
+                self.rxFlags = pos >> 24
+                return
+        raise LinkError("no ZMODEM receiver")
+
+    # Sends ZRQINIT at each rate, the highest first, and keeps the first one where every
+    # probe got a valid ZRINIT back. Goes over the rates again for wait seconds, while
+    # the loader boots.
+    def findBaud(self, rates, probes=3, wait=0.0):
+        limit = time.time() + wait
+        while True:
+            for baud in rates:
+                self.link.setBaud(baud)
+                self.link.flush()
+                self.buf = b''
+                for i in range(probes):
+                    self.link.write(b'rz\r' + hexHeader(ZRQINIT, 0))
+                    type, pos = self.expect((ZRINIT,), 0.5)
+                    if type != ZRINIT: break
+                else:
+                    self.log("Loader found at %d bauds" % baud)
+                    return baud
+            if time.time() >= limit: break
+        raise LinkError("no loader answers at %s bauds" % ', '.join(str(b) for b in rates))
+
+    # Offers the file, returns the position the loader asks for
+    def offer(self, name, size):
+        info = name.encode() + b'\0' + ('%d %o 100644 0 1 %d' % (size, int(time.time()), size)).encode() + b'\0'
+        for attempt in range(10):
+            self.link.write(binHeader(ZFILE, 1 << 24) + subpacket(info, ZCRCW))
+            type, pos = self.expect((ZRPOS,), 5.0)
+            if type == ZRPOS: return pos
+        raise LinkError("the loader does not answer ZFILE")
+
+    def noteAck(self, pos, pending):
+        now = time.time()
+        while pending and pending[0][0] <= pos:
+            self.latencies.append(now - pending.pop(0)[2])
+            self.clean += 1
+            if self.clean >= 16 and self.window < self.maxWindow:
+                self.window = min(self.maxWindow, self.window + 32)
+                self.clean = 0
+
+    # Starts a new frame at pos after an error, with a smaller window
+    def resend(self, pos):
+        self.retransmits += 1
+        self.window = max(64, self.window // 2)
+        self.clean = 0
+        self.log("ZRPOS %d, window %d" % (pos, self.window))
+        self.link.write(binHeader(ZDATA, pos))
+        return pos
+
+    # Streams data from pos. Each subpacket ends on a sector boundary with ZCRCQ, and the
+    # loader's ZACK for it comes once the sector is on the card.
+    def send(self, data, pos, progress):
+        size = len(data)
+        # wire bytes sent, and (end, wire offset, time) of the sectors not acknowledged
+        wire = 0
+        pending = []
+        timeouts = 0
+        self.clean = 0
+        self.link.write(binHeader(ZDATA, pos))
+
+        while True:
+            if pos >= size:
+                self.link.write(hexHeader(ZEOF, size))
+                type, p = self.expect((ZRINIT, ZRPOS, ZACK), self.timeout)
+                while type == ZACK:
+                    self.noteAck(p, pending)
+                    type, p = self.expect((ZRINIT, ZRPOS, ZACK), self.timeout)
+                if type == ZRINIT: return
+                if type is None:
+                    timeouts += 1
+                    if timeouts == 5: raise LinkError("no answer to ZEOF")
+                    continue
+                pos = self.resend(p)
+                pending = []
+                continue
+
+            n = sectorSize - pos % sectorSize
+            if self.rxBuffer: n = min(n, self.rxBuffer)
+            n = min(n, size - pos)
+            if pos + n == size:
+                end = ZCRCE
+            elif (pos + n) % sectorSize == 0 and self.rxFlags & CANOVIO:
+                end = ZCRCQ
+            elif (pos + n) % sectorSize == 0 or self.rxBuffer:
+                end = ZCRCW
+            else:
+                end = ZCRCG
+            packet = subpacket(data[pos:pos + n], end)
+
+            # Never more than window bytes past a sector the card may still be writing: the
+            # subpacket goes out in pieces as the ZACKs come back
+            sent = 0
+            while sent < len(packet):
+                type, p = self.expect((ZACK, ZRPOS), 0)
+                while type == ZACK:
+                    self.noteAck(p, pending)
+                    type, p = self.expect((ZACK, ZRPOS), 0)
+                if type == ZRPOS: break
+
+                room = len(packet) - sent
+                if pending: room = min(room, pending[0][1] + self.window - wire)
+                if room <= 0:
+                    wait = time.time()
+                    type, p = self.expect((ZACK, ZRPOS), self.timeout)
+                    self.ackWait += time.time() - wait
+                    if type == ZACK:
+                        self.noteAck(p, pending)
+                        continue
+                    # no ZACK in time: resume from the last sector acknowledged
+                    if type is None: type, p = ZRPOS, (pending[0][0] - 1) // sectorSize * sectorSize
+                    break
+
+                self.link.write(packet[sent:sent + room])
+                sent += room
+                wire += room
+
+            if type == ZRPOS:
+                pos = self.resend(p)
+                pending = []
+                continue
+
+            pos += n
+            progress(pos, size)
+
+            if end == ZCRCQ:
+                pending.append((pos, wire, time.time()))
+            elif end == ZCRCW:
+                wait = time.time()
+                type, p = self.expect((ZACK, ZRPOS), self.timeout)
+                self.ackWait += time.time() - wait
+                if type == ZACK:
+                    self.latencies.append(time.time() - wait)
+                    self.link.write(binHeader(ZDATA, pos))
+                else:
+                    pos = self.resend(pos if type is None else p)
+
+    # Ends the session: ZFIN both ways, then "OO"
+    def finish(self):
+        for attempt in range(3):
+            self.link.write(hexHeader(ZFIN, 0))
+            type, pos = self.expect((ZFIN,), 2.0)
+            if type == ZFIN: break
+        self.link.write(b'OO')
+
+    # Reads the NLZSTATS line the loader sends after the session, returns its fields as a
+    # dict of ints, empty if none came within timeout seconds
+    def readStats(self, timeout=2.0):
+        limit = time.time() + timeout
+        while True:
+            i = self.buf.find(b'NLZSTATS ')
+            j = self.buf.find(b'\n', i)
+            if i >= 0 and j >= 0:
+                fields = (f.partition('=') for f in self.buf[i + 9:j].decode('latin-1').split())
+                self.buf = self.buf[j + 1:]
+                return {name: int(value) for name, _, value in fields if value.isdigit()}
+            left = limit - time.time()
+            if left <= 0: return {}
+            try:
+                self.buf += self.link.read(min(left, 0.5))
+            except (LinkError, OSError):
+                return {}
+
+###################################################################################################
+
+if __name__ == '__main__':
+    cmdparser = argparse.ArgumentParser(description='Send a .uze file to NetLoaderZ with ZMODEM')
+    cmdparser.add_argument('filename', help="file to be sent to Uzebox")
+    cmdparser.add_argument('-p', '--port', dest='port', help="serial device wired to the Uzebox UART header")
+    cmdparser.add_argument('-b', '--baud', dest='baud', default='auto', help="baud rate of the port, or auto to find the loader's (default)")
+    cmdparser.add_argument('-B', '--break', dest='sendBreak', action='store_true',
+                           help="send a break first, to return a game built with LOADER_RETURN=1 to the loader")
+    cmdparser.add_argument('-l', '--listen', dest='listen', type=int, help="TCP port to wait on for the Uzebox's WiFi link")
+    cmdparser.add_argument('--stdio', action='store_true', help="talk ZMODEM on stdin/stdout, as sz")
+    cmdparser.add_argument('-w', '--window', dest='window', type=int, default=ringSize - 32,
+                           help="bytes sent past a sector being written, at most (default %d)" % (ringSize - 32))
+    cmdparser.add_argument('-v', '--verbose', action='store_true', help="print the retransmits and the progress")
+    cmdparser.add_argument('-f', '--force', action='store_true', help="force the file to be sent, even if it isn't a valid .uze file")
+    args = cmdparser.parse_args()
+
+    if [args.port is not None, args.listen is not None, args.stdio].count(True) != 1:
+        print("Use one of --port, --listen or --stdio")
+        sys.exit(2)
+
+    # stdout is the link with --stdio
+    out = sys.stderr if args.stdio else sys.stdout
+    def log(*text):
+        print(*text, file=out, flush=True)
+
+    log("NetLoaderZ sender version", version)
+
+    data = open(args.filename, 'rb').read()
+    if data[:6] != b'UZEBOX' and not args.force:
+        log("The specified file doesn't appear to be a valid .uze file. Use --force to send it anyways.")
+        sys.exit(2)
+    gameName = data[14:45].split(b'\0')[0].decode('latin-1')
+
+    if args.port:
+        link = SerialLink(args.port)
+    elif args.listen:
+        server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        server.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        server.bind(('', args.listen))
+        server.listen(1)
+        log("Waiting for the Uzebox on port", args.listen)
+        sock, address = server.accept()
+        sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        server.close()
+        log("Connected to", address[0])
+        link = SocketLink(sock)
+    else:
+        link = Link(0, 1)
+
+    def progress(pos, size):
+        if args.verbose and pos % 4096 == 0: log("%d%%" % (pos * 100 // size))
+
+    sender = ZSender(link, log if args.verbose else (lambda *text: None), args.window)
+    try:
+        if args.port:
+            if args.sendBreak:
+                log("Returning to the loader")
+                link.sendBreak()
+            if args.baud == 'auto':
+                sender.findBaud(sorted(bauds, reverse=True), wait=bootWait if args.sendBreak else 0.0)
+            else:
+                link.setBaud(int(args.baud))
+
+        log("Sending", gameName)
+        start = time.time()
+        sender.init()
+        try:
+            pos = sender.offer(os.path.basename(args.filename), len(data))
+            sender.send(data, pos, progress)
+            skipped = False
+        except Skipped:
+            skipped = True
+        sender.finish()
+        t = time.time() - start
+        stats = sender.readStats()
+    except (LinkError, OSError) as e:
+        log("Error\n" + str(e))
+        try:
+            link.write(b'\x18' * 8 + b'\x08' * 8)
+        except OSError:
+            pass
+        sys.exit(1)
+    finally:
+        link.close()
+
+    if skipped:
+        log("Done! The loader has this rom already, booted in %.2f s" % t)
+        sys.exit()
+
+    lat = sender.latencies or [0]
+    log("Done! %d bytes in %.2f s, %.0f bytes/s" % (len(data), t, len(data) / t))
+    log("%d retransmits, %.2f s waiting for ZACKs, ZACK latency %.1f/%.1f/%.1f ms (min/avg/max)" %
+        (sender.retransmits, sender.ackWait, min(lat) * 1000, sum(lat) / len(lat) * 1000, max(lat) * 1000))
+    if stats:
+        log("Loader: %d bytes/s, %d resends, %d CRC errors, SD write %d/%d/%d scanlines (min/avg/max)%s" %
+            (stats.get('rate', 0), stats.get('resends', 0), stats.get('crc', 0), stats.get('sdmin', 0),
+             stats.get('sdavg', 0), stats.get('sdmax', 0), ", ring peak %d" % stats['peak'] if 'peak' in stats else ''))
@@ -0,0 +1,544 @@
+/*
+ *  SDBench - SD card and filesystem micro-benchmark for the kernel SD stacks
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *  Uzebox is a reserved trade mark
+*/
+
+/*
+ * One ROM is built per SD stack (they can not be linked together as they
+ * define conflicting symbols), selected by SDBENCH_STACK:
+ *
+ *  0: bootlib.s          (SDC_* / FS_*)
+ *  1: sdBase.S           (sdCard*, multi-block streaming, read only)
+ *  2: mmc.s + fat.c      (mmc_*, read only)
+ *  3: fatfs/             (disk_read / disk_write, f_open)
+ *  4: petitfatfs/        (disk_readp / disk_writep, pf_read_stream)
+ *  5: sdblock.c          (SDB_*, multi block transfers, bootlib FS_Find)
+ *
+ * All the sector tests run within the file SDBENCH.DAT in the root directory
+ * of the card, so it is never destructive for the filesystem. The file must
+ * be at least SDBENCH_SPAN sectors long and contiguous (create it on a fresh
+ * card or image, for example with dd if=/dev/zero of=SDBENCH.DAT bs=512
+ * count=256). Write tests overwrite its content.
+ *
+ * Timing uses the kernel's scanline clock (GetScanlineCounter), so the
+ * resolution is one scanline (63.6us) and it stays valid across the SD
+ * routines as they don't disable interrupts.
+ */
+
+#include <stdbool.h>
+#include <avr/io.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <uzebox.h>
+
+#include "../data/font-8x8-full.inc"
+
+#define STACK_BOOTLIB   0
+#define STACK_SDBASE    1
+#define STACK_MMC       2
+#define STACK_FATFS     3
+#define STACK_PETITFS   4
+#define STACK_SDBLOCK   5
+
+#ifndef SDBENCH_STACK
+	#define SDBENCH_STACK STACK_BOOTLIB
+#endif
+
+#if   SDBENCH_STACK == STACK_BOOTLIB
+	#include <bootlib.h>
+	#define BENCH_HAS_WRITE 1
+#elif SDBENCH_STACK == STACK_SDBASE
+	#include <sdBase.h>
+	#define BENCH_HAS_WRITE 0
+#elif SDBENCH_STACK == STACK_MMC
+	#include <mmc.h>
+	#include <fat.h>
+	#define BENCH_HAS_WRITE 0
+#elif SDBENCH_STACK == STACK_FATFS
+	#include <fatfs/ff.h>
+	#include <fatfs/diskio.h>
+	#define BENCH_HAS_WRITE 1
+#elif SDBENCH_STACK == STACK_PETITFS
+	#include <petitfatfs/pff.h>
+	#include <petitfatfs/diskio.h>
+	#define BENCH_HAS_WRITE _PF_USE_WRITE
+#elif SDBENCH_STACK == STACK_SDBLOCK
+	#include <sdblock.h>
+	#define BENCH_HAS_WRITE 1
+#else
+	#error Invalid SDBENCH_STACK
+#endif
+
+#define SDBENCH_SPAN     256  // Sectors of SDBENCH.DAT used by the tests
+#define SDBENCH_SEQ      128  // Sectors in a sequential pass
+#define SDBENCH_RANDOM   64   // Operations in a random pass
+#define SDBENCH_BINS     8    // Latency histogram bins (log2 scanlines)
+
+#define LINES_PER_SEC    15734UL // 28636360Hz / 1820 cycles per line
+
+#define UART_115200_BAUD 30
+
+static const char stack_names[] PROGMEM =
+	"bootlib\0 sdBase\0  mmc\0     fatfs\0   petitfs\0 sdblock\0";
+
+static const char txt_title[] PROGMEM = "SDBENCH - ";
+static const char txt_init[]  PROGMEM = "init";
+static const char txt_open[]  PROGMEM = "open";
+static const char txt_seqr[]  PROGMEM = "seq rd";
+static const char txt_seqw[]  PROGMEM = "seq wr";
+static const char txt_rndr[]  PROGMEM = "rnd rd";
+static const char txt_rndw[]  PROGMEM = "rnd wr";
+static const char txt_fail[]  PROGMEM = "FAIL ";
+static const char txt_na[]    PROGMEM = "n/a";
+static const char txt_done[]  PROGMEM = "Done. Results sent on UART.";
+
+static u8  sector_buf[512];
+static u32 base_sector;
+static u8  line;
+
+typedef struct{
+	u32 ticks;              // Total scanlines for the pass
+	u16 ops;                // Operations completed
+	u16 min, max;           // Per-op latency in scanlines
+	u16 hist[SDBENCH_BINS]; // <2, <4, <8, <16, <32, <64, <128, >=128 lines
+	u8  err;
+} bench_result;
+
+static bench_result res;
+
+
+/*
+ * Stack adapters. Each returns zero on success or the stack's error code.
+ */
+
+#if SDBENCH_STACK == STACK_BOOTLIB
+
+static sdc_struct_t sds;
+
+static u8 stack_init(void){
+	sds.bufp = &sector_buf[0];
+	return FS_Init(&sds);
+}
+
+static u8 stack_open(void){
+	u32 clus = FS_Find(&sds,
+		((u16)('S') << 8) | ((u16)('D')),
+		((u16)('B') << 8) | ((u16)('E')),
+		((u16)('N') << 8) | ((u16)('C')),
+		((u16)('H') << 8) | ((u16)(' ')),
+		((u16)('D') << 8) | ((u16)('A')),
+		((u16)('T') << 8) | ((u16)(0)));
+	if(clus == 0U) return 0xFFU;
+	FS_Select_Cluster(&sds, clus);
+	base_sector = FS_Get_Sector(&sds);
+	return 0;
+}
+
+static u8 stack_read(u32 sector){
+	return SDC_Read_Sector(&sds, base_sector + sector);
+}
+
+static u8 stack_write(u32 sector){
+	return SDC_Write_Sector(&sds, base_sector + sector);
+}
+
+#elif SDBENCH_STACK == STACK_SDBASE
+
+static const char bench_file[] PROGMEM = "SDBENCH DAT";
+
+static u8 stack_init(void){
+	return sdCardInitNoBuffer();
+}
+
+static u8 stack_open(void){
+	base_sector = sdCardFindFileFirstSectorFlash(bench_file);
+	return (base_sector == 0U) ? 0xFFU : 0U;
+}
+
+static u8 stack_read(u32 sector){
+	u8 r = sdCardCueSectorAddress(base_sector + sector);
+	if(r != 0U) return r;
+	sdCardDirectReadSimple(sector_buf, 512);
+	return sdCardStopTransmission();
+}
+
+// sdBase reads sequential data with a single READ_MULTIPLE_BLOCK
+#define STACK_HAS_SEQ_READ 1
+static u8 stack_seq_read(u32 sector, u16 count){
+	u8 r = sdCardCueSectorAddress(base_sector + sector);
+	if(r != 0U) return r;
+	while(count--){
+		sdCardDirectReadSimple(sector_buf, 512);
+		res.ops++;
+	}
+	return sdCardStopTransmission();
+}
+
+#elif SDBENCH_STACK == STACK_MMC
+
+static u8 stack_init(void){
+	InitFat(sector_buf);
+	return 0;
+}
+
+static u8 stack_open(void){
+	DirectoryTableEntry* ent = (DirectoryTableEntry*)(&sector_buf[0]);
+	LoadRootDirectory();
+	for(u8 i = 0; i < 16; i++){
+		if(memcmp_P(ent[i].filename, PSTR("SDBENCH DAT"), 11) == 0){
+			base_sector = GetFileSector(&ent[i]);
+			return 0;
+		}
+	}
+	return 0xFFU;
+}
+
+static u8 stack_read(u32 sector){
+	return mmc_readsector(base_sector + sector);
+}
+
+#elif SDBENCH_STACK == STACK_FATFS
+
+static FATFS fs;
+static FIL fil;
+
+extern DWORD clust2sect(FATFS* fs, DWORD clst);
+
+static u8 stack_init(void){
+	return disk_initialize(0) & STA_NOINIT;
+}
+
+static u8 stack_open(void){
+	u8 r = f_mount(0, &fs);
+	if(r != FR_OK) return r;
+	r = f_open(&fil, "SDBENCH.DAT", FA_READ);
+	if(r != FR_OK) return r;
+	base_sector = clust2sect(&fs, fil.sclust);
+	return 0;
+}
+
+static u8 stack_read(u32 sector){
+	return disk_read(0, sector_buf, base_sector + sector, 1);
+}
+
+static u8 stack_write(u32 sector){
+	return disk_write(0, sector_buf, base_sector + sector, 1);
+}
+
+#elif SDBENCH_STACK == STACK_PETITFS
+
+static FATFS fs;
+
+static u8 stack_init(void){
+	return disk_initialize() & STA_NOINIT;
+}
+
+static u8 stack_open(void){
+	u8 r = pf_mount(&fs);
+	if(r != FR_OK) return r;
+	r = pf_open("SDBENCH.DAT");
+	if(r != FR_OK) return r;
+	base_sector = ((u32)(fs.org_clust - 2U) * fs.csize) + fs.database;
+	return 0;
+}
+
+static u8 stack_read(u32 sector){
+	return disk_readp(sector_buf, base_sector + sector, 0, 512);
+}
+
+// Petit FatFs streams sequential data with pf_read_stream (one READ_MULTIPLE_BLOCK)
+#define STACK_HAS_SEQ_READ 1
+static void stack_sink(u8 data){
+	sector_buf[0] = data;
+}
+
+static u8 stack_seq_read(u32 sector, u16 count){
+	DWORD br;
+	u8 r = pf_lseek(sector << 9);
+	if(r != FR_OK) return r;
+	r = pf_read_stream(stack_sink, (u32)count << 9, &br);
+	res.ops = br >> 9;
+	return r;
+}
+
+#if _PF_USE_WRITE
+static u8 stack_write(u32 sector){
+	u8 r = disk_writep(NULL, base_sector + sector);
+	if(r != RES_OK) return r;
+	r = disk_writep(sector_buf, 512);
+	if(r != RES_OK) return r;
+	return disk_writep(NULL, 0);
+}
+#endif
+
+#elif SDBENCH_STACK == STACK_SDBLOCK
+
+static u8 stack_init(void){
+	return SDB_Init();
+}
+
+static u8 stack_open(void){
+	// File lookup through bootlib, using the block layer's shared buffer
+	sdc_struct_t* sds = SDB_Struct();
+	u8 r = FS_Init(sds);
+	if(r != 0U) return r;
+	u32 clus = FS_Find(sds,
+		((u16)('S') << 8) | ((u16)('D')),
+		((u16)('B') << 8) | ((u16)('E')),
+		((u16)('N') << 8) | ((u16)('C')),
+		((u16)('H') << 8) | ((u16)(' ')),
+		((u16)('D') << 8) | ((u16)('A')),
+		((u16)('T') << 8) | ((u16)(0)));
+	SDB_Invalidate();
+	if(clus == 0U) return 0xFFU;
+	FS_Select_Cluster(sds, clus);
+	base_sector = FS_Get_Sector(sds);
+	return 0;
+}
+
+static u8 stack_read(u32 sector){
+	return SDB_Read_Blocks(base_sector + sector, sector_buf, 1);
+}
+
+// The block layer streams sequential data with a single READ_MULTIPLE_BLOCK
+#define STACK_HAS_SEQ_READ 1
+static void stack_sink(u8 data){
+	sector_buf[0] = data;
+}
+
+static u8 stack_seq_read(u32 sector, u16 count){
+	u8 r = SDB_Read_Stream(base_sector + sector, 0, (u32)count << 9, stack_sink);
+	if(r == 0U) res.ops = count;
+	return r;
+}
+
+static u8 stack_write(u32 sector){
+	return SDB_Write_Blocks(base_sector + sector, sector_buf, 1);
+}
+
+#endif
+
+
+
+/*
+ * Output: every result line goes both on screen and on the UART.
+ */
+
+static void uart_putc(char c){
+	while(UartSendChar(c) == -1);
+}
+
+static void uart_puts_P(const char* str){
+	char c;
+	while((c = pgm_read_byte(str++)) != 0) uart_putc(c);
+}
+
+static void uart_putl(u32 val){
+	char buf[11];
+	ultoa(val, buf, 10);
+	for(u8 i = 0; buf[i] != 0; i++) uart_putc(buf[i]);
+}
+
+static void out_label(const char* label){
+	Print(1, line, label);
+	uart_puts_P(label);
+	uart_putc(',');
+}
+
+static void out_val(u8 x, u32 val, char sep){
+	PrintLong(x, line, val);
+	uart_putl(val);
+	uart_putc(sep);
+}
+
+static void out_eol(void){
+	uart_putc('\r');
+	uart_putc('\n');
+	line++;
+}
+
+static void out_fail(u8 err){
+	Print(8, line, txt_fail);
+	PrintHexByte(13, line, err);
+	uart_puts_P(txt_fail);
+	uart_putl(err);
+	out_eol();
+}
+
+static void out_na(void){
+	Print(8, line, txt_na);
+	uart_puts_P(txt_na);
+	out_eol();
+}
+
+
+/*
+ * Single timed operation (init, open).
+ */
+static void bench_single(const char* label, u8 (*op)(void)){
+	out_label(label);
+	u32 t = GetScanlineCounter();
+	u8 r = op();
+	t = GetScanlinesSince(t);
+	if(r != 0U){ out_fail(r); return; }
+	out_val(14, t, ',');
+	Print(16, line, PSTR("lines"));
+	out_eol();
+}
+
+
+/*
+ * Per-op accounting and result print.
+ */
+static void bench_reset(void){
+	memset(&res, 0, sizeof(res));
+	res.min = 0xFFFFU;
+}
+
+static void bench_account(u32 lat){
+	u16 l = (lat > 0xFFFFU) ? 0xFFFFU : (u16)lat;
+	u8  b = 0;
+	if(l < res.min) res.min = l;
+	if(l > res.max) res.max = l;
+	while((b < (SDBENCH_BINS - 1U)) && (l >= (2U << b))) b++;
+	res.hist[b]++;
+	res.ops++;
+}
+
+static void bench_print(const char* label, bool hist){
+	out_label(label);
+	if(res.err != 0U){ out_fail(res.err); return; }
+	if(res.ticks == 0U) res.ticks = 1U;
+
+	// Throughput in bytes/s
+	out_val(8, ((u32)res.ops * 512UL * LINES_PER_SEC) / res.ticks, ',');
+	Print(15, line, PSTR("B/S"));
+	if(hist){
+		out_val(19, res.min, ',');
+		out_val(24, res.max, ',');
+	}
+	out_eol();
+
+	if(hist){
+		// Histogram: counts per log2 latency bin, on one screen line
+		for(u8 i = 0; i < SDBENCH_BINS; i++){
+			PrintByte(4 + (i * 3), line, (u8)res.hist[i], false);
+			uart_putl(res.hist[i]);
+			uart_putc((i == (SDBENCH_BINS - 1U)) ? '\r' : ',');
+		}
+		uart_putc('\n');
+		line++;
+	}
+}
+
+
+/*
+ * Sector passes
+ */
+static void bench_seq(bool write){
+	bench_reset();
+	u32 t = GetScanlineCounter();
+#if STACK_HAS_SEQ_READ
+	if(!write){
+		res.err = stack_seq_read(0, SDBENCH_SEQ);
+	}else
+#endif
+	{
+		for(u16 i = 0; i < SDBENCH_SEQ; i++){
+#if BENCH_HAS_WRITE
+			res.err = write ? stack_write(i) : stack_read(i);
+#else
+			res.err = stack_read(i);
+#endif
+			if(res.err != 0U) break;
+			res.ops++;
+		}
+	}
+	res.ticks = GetScanlinesSince(t);
+}
+
+static void bench_random(bool write){
+	bench_reset();
+	GetPrngNumber(0xACE1U);
+	for(u16 i = 0; i < SDBENCH_RANDOM; i++){
+		u16 sec = GetPrngNumber(0) % SDBENCH_SPAN;
+		u32 t = GetScanlineCounter();
+#if BENCH_HAS_WRITE
+		res.err = write ? stack_write(sec) : stack_read(sec);
+#else
+		res.err = stack_read(sec);
+#endif
+		t = GetScanlinesSince(t);
+		if(res.err != 0U) break;
+		res.ticks += t;
+		bench_account(t);
+	}
+}
+
+
+int main(){
+	ClearVram();
+	SetTileTable(font);
+	SetFontTilesIndex(0);
+
+	UBRR0H = 0;
+	UBRR0L = UART_115200_BAUD;
+	UCSR0A = (1<<U2X0); // double speed mode
+	UCSR0C = (1<<UCSZ01)+(1<<UCSZ00)+(0<<USBS0); //8-bit frame, no parity, 1 stop bit
+	UCSR0B = (1<<RXEN0)+(1<<TXEN0);
+
+	line = 1;
+	Print(1, line, txt_title);
+	Print(11, line, stack_names + (SDBENCH_STACK * 9));
+	uart_puts_P(txt_title);
+	uart_puts_P(stack_names + (SDBENCH_STACK * 9));
+	out_eol();
+	line++;
+
+	ClearVsyncCounter();
+
+	bench_single(txt_init, stack_init);
+	bench_single(txt_open, stack_open);
+	if(base_sector == 0U){
+		while(1);
+	}
+
+	bench_seq(false);
+	bench_print(txt_seqr, false);
+
+	bench_random(false);
+	bench_print(txt_rndr, true);
+
+#if BENCH_HAS_WRITE
+	bench_seq(true);
+	bench_print(txt_seqw, false);
+
+	bench_random(true);
+	bench_print(txt_rndw, true);
+#else
+	out_label(txt_seqw); out_na();
+	out_label(txt_rndw); out_na();
+#endif
+
+	line++;
+	Print(1, line, txt_done);
+
+	while(1){
+		WaitVsync(1);
+	}
+}
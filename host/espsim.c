@@ -0,0 +1,575 @@
+/*
+ * espsim.c
+ *
+ * ESP8266 AT firmware simulator, see espsim.h. Times are counted in
+ * scanlines of the simulated kernel.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "espsim.h"
+
+#define ESP_RESET	PD3
+#define ESP_ENABLE	PA6
+
+#define ESP_MAX_RULES	32
+#define ESP_MAX_EVENTS	64
+#define ESP_SEGMENT		1460	//TCP segment, one +IPD each
+#define ESP_WIRE_LIMIT	8192	//bytes queued on the UART before the server waits
+
+#define ESP_OFF			0
+#define ESP_BOOTING		1
+#define ESP_RUNNING		2
+
+EspConfig esp_config;
+EspStats esp_stats;
+
+typedef struct {
+	char* command;
+	char* reply;
+} EspRule;
+
+//Replies waiting for their time
+typedef struct {
+	uint64_t due;
+	char* data;
+	u16 len;
+} EspEvent;
+
+static EspRule rules[ESP_MAX_RULES];
+static u8 ruleCount;
+static EspEvent events[ESP_MAX_EVENTS];
+static u8 eventCount;
+
+static uint64_t now,bootDone,associateDone;
+static u8 state;
+static bool echo,associated,prevReset;
+static u32 baud,pendingBaud;
+
+//Command line, or payload of AT+CIPSEND
+static char line[512];
+static u16 lineLen;
+static u16 sendRemaining;
+
+//Connection and HTTP server
+static bool connected,droppedOnce;
+static char request[1024];
+static u16 requestLen;
+static u8* response;
+static u32 responseLen,responsePos,responseSize,responseBody;
+static uint64_t responseDue;
+static bool closeAfterResponse;
+static double netCredit;
+
+//Server, and the client played by the harness
+static bool mux,listening,clientConnected,sendToClient;
+static EspClientFunc clientFunc;
+static u8* client;
+static u32 clientLen,clientPos,clientSize;
+static u8 clientPayload[2048];
+static void (*lineFunc)(void);
+
+static u32 _esp_Lines(u32 us){
+	return (u32)(us*SIM_LINE_RATE/1000000.0+0.5);
+}
+
+static void _esp_Log(const char* dir, const char* data, u16 len){
+	if(!esp_config.verbose) return;
+	printf("%9.4f %s ",sim_Seconds(),dir);
+	for(u16 i=0;i<len;i++){
+		u8 c=data[i];
+		if(c=='\r') printf("\\r");
+		else if(c=='\n') printf("\\n");
+		else if(c>=32 && c<127) putchar(c);
+		else printf("\\x%02x",c);
+		if(i==80){ printf("... (%u bytes)",len); break; }
+	}
+	putchar('\n');
+}
+
+static void _esp_Output(const char* data, u16 len){
+	_esp_Log("<",data,len);
+	sim_PeerSend((const u8*)data,len);
+}
+
+static void _esp_Schedule(u32 delayLines, const char* data, u16 len){
+	EspEvent* e;
+
+	if(eventCount==ESP_MAX_EVENTS || len==0) return;
+
+	//keep the order of the replies
+	uint64_t due=now+delayLines;
+	if(eventCount!=0 && events[eventCount-1].due>due) due=events[eventCount-1].due;
+
+	e=&events[eventCount++];
+	e->due=due;
+	e->data=malloc(len);
+	memcpy(e->data,data,len);
+	e->len=len;
+}
+
+static void _esp_Reply(const char* text){
+	_esp_Schedule(_esp_Lines(esp_config.latencyUs),text,strlen(text));
+}
+
+u8 esp_BodyByte(u32 offset){
+	return (u8)((offset*7)^(offset>>8)^(offset>>16));
+}
+
+void esp_AddRule(const char* command, const char* reply){
+	if(ruleCount==ESP_MAX_RULES) return;
+	rules[ruleCount].command=strdup(command);
+	rules[ruleCount].reply=strdup(reply);
+	ruleCount++;
+}
+
+//Script lines are "COMMAND => reply" with C escapes in the reply, like FakeModem.py
+int esp_LoadScript(const char* fileName){
+	char buf[512],reply[512];
+	FILE* f=fopen(fileName,"r");
+	if(f==NULL) return -1;
+
+	while(fgets(buf,sizeof(buf),f)!=NULL){
+		char* sep=strstr(buf,"=>");
+		char *s,*d,*end;
+		if(buf[0]=='#' || sep==NULL) continue;
+
+		for(end=sep;end>buf && (end[-1]==' ' || end[-1]=='\t');end--);
+		*end=0;
+		for(s=sep+2;*s==' ' || *s=='\t';s++);
+
+		for(d=reply;*s!=0 && *s!='\r' && *s!='\n';s++){
+			if(*s!='\\' || s[1]==0){
+				*d++=*s;
+				continue;
+			}
+			switch(*++s){
+				case 'r': *d++='\r'; break;
+				case 'n': *d++='\n'; break;
+				case 't': *d++='\t'; break;
+				default: *d++=*s;
+			}
+		}
+		*d=0;
+		esp_AddRule(buf,reply);
+	}
+	fclose(f);
+	return 0;
+}
+
+static void _esp_Boot(){
+	state=ESP_BOOTING;
+	bootDone=now+_esp_Lines(esp_config.bootUs);
+	eventCount=0;
+	lineLen=0;
+	sendRemaining=0;
+	connected=false;
+	associated=false;
+	mux=listening=clientConnected=sendToClient=false;
+	echo=true;
+	pendingBaud=0;
+	baud=esp_config.defBaud;
+	sim_PeerSetBaud(baud);
+	esp_stats.boots++;
+}
+
+void esp_PowerCycle(void){
+	if(state!=ESP_OFF) _esp_Boot();
+}
+
+
+/*
+ * HTTP server
+ */
+static void _esp_Close(){
+	connected=false;
+	responseLen=responsePos=0;
+	requestLen=0;
+	_esp_Reply("CLOSED\r\n");
+}
+
+static void _esp_Request(){
+	char header[256];
+	const char* p;
+	u32 offset=0,length,i;
+	int n;
+	bool close=(strstr(request,"Connection: close")!=NULL || strstr(request,"HTTP/1.0")!=NULL);
+
+	esp_stats.requests++;
+	p=strstr(request,"Range: bytes=");
+	if(p!=NULL && esp_config.ranges) offset=strtoul(p+13,NULL,10);
+
+	closeAfterResponse=close || !esp_config.keepAlive;
+
+	if(offset>=esp_config.bodySize && offset!=0){
+		n=sprintf(header,"HTTP/1.1 416 Range Not Satisfiable\r\nContent-Length: 0\r\n%s\r\n",closeAfterResponse?"Connection: close\r\n":"");
+		length=0;
+	}else{
+		length=esp_config.bodySize-offset;
+		if(offset!=0){
+			n=sprintf(header,"HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %lu-%lu/%lu\r\n",
+				(unsigned long)offset,(unsigned long)esp_config.bodySize-1,(unsigned long)esp_config.bodySize);
+		}else{
+			n=sprintf(header,"HTTP/1.1 200 OK\r\n");
+		}
+		if(esp_config.chunked){
+			n+=sprintf(header+n,"Transfer-Encoding: chunked\r\n");
+		}else{
+			n+=sprintf(header+n,"Content-Length: %lu\r\n",(unsigned long)length);
+		}
+		n+=sprintf(header+n,"%s\r\n",closeAfterResponse?"Connection: close\r\n":"");
+	}
+
+	free(response);
+	response=malloc(n+length+length/256*8+16);
+	memcpy(response,header,n);
+	responseLen=n;
+	responseBody=n;
+
+	if(esp_config.chunked && length!=0){
+		for(i=0;i<length;i+=512){
+			u32 size=(length-i<512)?length-i:512;
+			responseLen+=sprintf((char*)response+responseLen,"%lx\r\n",(unsigned long)size);
+			for(u32 j=0;j<size;j++) response[responseLen++]=esp_BodyByte(offset+i+j);
+			response[responseLen++]='\r';
+			response[responseLen++]='\n';
+		}
+		responseLen+=sprintf((char*)response+responseLen,"0\r\n\r\n");
+	}else{
+		for(i=0;i<length;i++) response[responseLen++]=esp_BodyByte(offset+i);
+	}
+
+	responseSize=responseLen;
+	responsePos=0;
+	responseDue=now+_esp_Lines(esp_config.serverLatencyUs);
+	netCredit=0;
+}
+
+static void _esp_ServerData(const char* data, u16 len){
+	for(u16 i=0;i<len;i++){
+		if(requestLen<sizeof(request)-1) request[requestLen++]=data[i];
+		request[requestLen]=0;
+		if(requestLen>=4 && memcmp(request+requestLen-4,"\r\n\r\n",4)==0){
+			_esp_Request();
+			requestLen=0;
+		}
+	}
+}
+
+//Sends the response as +IPD segments, at the network speed
+static void _esp_Serve(){
+	char head[24];
+	u32 n;
+	int h;
+
+	if(!connected || responsePos>=responseLen || now<responseDue) return;
+	if(sim_PeerPending()>ESP_WIRE_LIMIT || eventCount!=0) return;
+
+	if(esp_config.netBytesPerSec==0){
+		n=ESP_SEGMENT;
+	}else{
+		netCredit+=esp_config.netBytesPerSec/SIM_LINE_RATE;
+		if(netCredit<ESP_SEGMENT && netCredit<responseLen-responsePos) return;
+		n=(u32)netCredit;
+	}
+	if(n>ESP_SEGMENT) n=ESP_SEGMENT;
+	if(n>responseLen-responsePos) n=responseLen-responsePos;
+
+	//connection lost in the middle of the body
+	if(esp_config.closeAfter!=0 && !droppedOnce && responsePos+n>responseBody+esp_config.closeAfter){
+		n=responseBody+esp_config.closeAfter-responsePos;
+		droppedOnce=true;
+		if(n!=0){
+			h=sprintf(head,"\r\n+IPD,%lu:",(unsigned long)n);
+			_esp_Output(head,h);
+			_esp_Output((char*)response+responsePos,n);
+			esp_stats.bodyBytes+=n;
+		}
+		_esp_Close();
+		return;
+	}
+
+	h=sprintf(head,"\r\n+IPD,%lu:",(unsigned long)n);
+	_esp_Output(head,h);
+	_esp_Output((char*)response+responsePos,n);
+	responsePos+=n;
+	esp_stats.bodyBytes+=n;
+	if(esp_config.netBytesPerSec!=0) netCredit-=n;
+
+	if(responsePos==responseLen && closeAfterResponse) _esp_Close();
+}
+
+
+/*
+ * Server
+ */
+bool esp_ClientConnect(EspClientFunc func){
+	if(!listening || clientConnected) return false;
+	clientConnected=true;
+	clientFunc=func;
+	clientLen=clientPos=0;
+	esp_stats.connects++;
+	_esp_Reply("0,CONNECT\r\n");
+	return true;
+}
+
+void esp_ClientSend(const u8* data, u16 len){
+	if(!clientConnected) return;
+	if(clientLen+len>clientSize){
+		clientSize=(clientLen+len)*2;
+		client=realloc(client,clientSize);
+	}
+	memcpy(client+clientLen,data,len);
+	clientLen+=len;
+}
+
+u32 esp_ClientPending(void){
+	return clientLen-clientPos;
+}
+
+void esp_ClientClose(void){
+	if(!clientConnected) return;
+	clientConnected=false;
+	clientLen=clientPos=0;
+	_esp_Reply("0,CLOSED\r\n");
+}
+
+//Passes what the client sent on as +IPD segments
+static void _esp_ServeClient(){
+	char head[24];
+	u32 n;
+	int h;
+
+	if(!clientConnected || clientPos==clientLen) return;
+	if(sim_PeerPending()>ESP_WIRE_LIMIT || eventCount!=0) return;
+
+	n=clientLen-clientPos;
+	if(n>ESP_SEGMENT) n=ESP_SEGMENT;
+	h=sprintf(head,"\r\n+IPD,0,%lu:",(unsigned long)n);
+	_esp_Output(head,h);
+	_esp_Output((char*)client+clientPos,n);
+	clientPos+=n;
+	if(clientPos==clientLen) clientPos=clientLen=0;
+}
+
+
+/*
+ * AT commands
+ */
+static void _esp_Command(char* cmd){
+	char buf[160];
+	u8 i;
+
+	esp_stats.commands++;
+	_esp_Log(">",cmd,strlen(cmd));
+
+	for(i=0;i<ruleCount;i++){
+		if(strncmp(cmd,rules[i].command,strlen(rules[i].command))==0){
+			_esp_Reply(rules[i].reply);
+			return;
+		}
+	}
+
+	if(strcmp(cmd,"AT")==0){
+		_esp_Reply("\r\nOK\r\n");
+	}else if(strcmp(cmd,"ATE0")==0){
+		echo=false;
+		_esp_Reply("\r\nOK\r\n");
+	}else if(strcmp(cmd,"ATE1")==0){
+		echo=true;
+		_esp_Reply("\r\nOK\r\n");
+	}else if(strcmp(cmd,"AT+RST")==0 || strcmp(cmd,"AT+RESTORE")==0){
+		_esp_Reply("\r\nOK\r\n");
+		bootDone=now+_esp_Lines(esp_config.latencyUs+esp_config.bootUs);
+		state=ESP_BOOTING;
+	}else if(strcmp(cmd,"AT+GMR")==0){
+		_esp_Reply("AT version:1.2.0.0(Jul  1 2016 20:04:45)\r\nSDK version:1.5.4.1(39cb9a32)\r\nespsim\r\nOK\r\n");
+	}else if(strncmp(cmd,"AT+UART_CUR=",12)==0 || strncmp(cmd,"AT+UART_DEF=",12)==0){
+		u32 rate=strtoul(cmd+12,NULL,10);
+		if(rate<110 || rate>4608000){
+			_esp_Reply("\r\nERROR\r\n");
+		}else{
+			_esp_Reply("\r\nOK\r\n");
+			pendingBaud=rate;
+			if(cmd[8]=='D') esp_config.defBaud=rate;
+		}
+	}else if(strcmp(cmd,"AT+CIPSTATUS")==0){
+		if(connected){
+			sprintf(buf,"STATUS:3\r\n+CIPSTATUS:0,\"TCP\",\"10.0.0.1\",80,4000,0\r\n\r\nOK\r\n");
+		}else{
+			sprintf(buf,"STATUS:%c\r\n\r\nOK\r\n",associated?'2':'5');
+		}
+		_esp_Reply(buf);
+	}else if(strncmp(cmd,"AT+CIPSTART=",12)==0){
+		if(connected){
+			_esp_Reply("ALREADY CONNECTED\r\n\r\nERROR\r\n");
+		}else if(!associated){
+			_esp_Reply("\r\nERROR\r\nCLOSED\r\n");
+		}else{
+			connected=true;
+			requestLen=0;
+			responseLen=responsePos=0;
+			esp_stats.connects++;
+			_esp_Reply("CONNECT\r\n\r\nOK\r\n");
+		}
+	}else if(strcmp(cmd,"AT+CIPCLOSE")==0){
+		if(connected){
+			connected=false;
+			responseLen=responsePos=0;
+			_esp_Reply("CLOSED\r\n\r\nOK\r\n");
+		}else{
+			_esp_Reply("\r\nERROR\r\n");
+		}
+	}else if(strncmp(cmd,"AT+CIPSEND=",11)==0){
+		//"AT+CIPSEND=len", or "AT+CIPSEND=link,len" with AT+CIPMUX=1
+		const char* comma=strchr(cmd+11,',');
+		sendToClient=(mux && comma!=NULL);
+		if(sendToClient?(!clientConnected || atoi(cmd+11)!=0):!connected){
+			_esp_Reply("link is not valid\r\n\r\nERROR\r\n");
+		}else{
+			sendRemaining=atoi(sendToClient?comma+1:cmd+11);
+			_esp_Reply("\r\nOK\r\n> ");
+		}
+	}else if(strncmp(cmd,"AT+CIPMUX=",10)==0){
+		mux=(cmd[10]=='1');
+		_esp_Reply("\r\nOK\r\n");
+	}else if(strncmp(cmd,"AT+CIPSERVER=",13)==0){
+		if(!mux){
+			_esp_Reply("\r\nERROR\r\n");
+		}else{
+			listening=(cmd[13]=='1');
+			_esp_Reply("\r\nOK\r\n");
+		}
+	}else if(strncmp(cmd,"AT+CIPMODE=",11)==0 ||
+		strncmp(cmd,"AT+CWMODE",9)==0 || strncmp(cmd,"AT+CWJAP",8)==0 ||
+		strncmp(cmd,"AT+SYSMSG",9)==0){
+		_esp_Reply("\r\nOK\r\n");
+	}else{
+		_esp_Reply("\r\nERROR\r\n");
+	}
+}
+
+static void _esp_Receive(u8 c){
+	if(state!=ESP_RUNNING || esp_config.mute) return;
+
+	//payload of AT+CIPSEND
+	if(sendRemaining!=0){
+		char buf[48];
+		if(!sendToClient){
+			_esp_ServerData((char*)&c,1);
+		}else{
+			if(lineLen<sizeof(clientPayload)) clientPayload[lineLen]=c;
+			if(sendRemaining==1 && clientFunc!=NULL) clientFunc(clientPayload,lineLen+1);
+		}
+		if(--sendRemaining==0){
+			sprintf(buf,"\r\nRecv %u bytes\r\n\r\nSEND OK\r\n",lineLen+1);
+			lineLen=0;
+			_esp_Reply(buf);
+		}else{
+			lineLen++;
+		}
+		return;
+	}
+
+	if(echo) _esp_Output((char*)&c,1);
+
+	if(c=='\n'){
+		if(lineLen!=0 && line[lineLen-1]=='\r') lineLen--;
+		line[lineLen]=0;
+		if(lineLen!=0) _esp_Command(line);
+		lineLen=0;
+	}else if(lineLen<sizeof(line)-1){
+		line[lineLen++]=c;
+	}
+}
+
+static void _esp_Line(){
+	bool enabled,reset;
+
+	now++;
+	if(lineFunc!=NULL) lineFunc();
+
+	//pins driven by uzenet: enable (PA6 output) and reset (PD3 low)
+	enabled=(DDRA&(1<<ESP_ENABLE))!=0;
+	reset=(DDRD&(1<<ESP_RESET))!=0 && (PORTD&(1<<ESP_RESET))==0;
+
+	if(!enabled || reset){
+		state=ESP_OFF;
+		prevReset=true;
+		return;
+	}
+	if(prevReset){
+		prevReset=false;
+		_esp_Boot();
+	}
+
+	if(state==ESP_BOOTING){
+		if(now<bootDone) return;
+		state=ESP_RUNNING;
+		baud=esp_config.defBaud;
+		sim_PeerSetBaud(baud);
+		associateDone=now+_esp_Lines(esp_config.associateUs);
+		_esp_Output("\r\nready\r\n",9);
+	}
+
+	if(state!=ESP_RUNNING) return;
+
+	if(!associated && now>=associateDone){
+		associated=true;
+		if(!esp_config.mute) _esp_Output("WIFI CONNECTED\r\nWIFI GOT IP\r\n",29);
+	}
+
+	//due replies
+	while(eventCount!=0 && events[0].due<=now){
+		_esp_Output(events[0].data,events[0].len);
+		free(events[0].data);
+		memmove(&events[0],&events[1],(eventCount-1)*sizeof(EspEvent));
+		eventCount--;
+	}
+
+	//switch the rate once the OK of AT+UART_CUR is out
+	if(pendingBaud!=0 && eventCount==0 && sim_PeerPending()==0){
+		baud=pendingBaud;
+		pendingBaud=0;
+		sim_PeerSetBaud(baud);
+	}
+
+	_esp_Serve();
+	_esp_ServeClient();
+}
+
+static const SimPeer espPeer={_esp_Receive,_esp_Line};
+
+//Called every scanline, for a harness that drives the other end too
+void esp_SetLineFunc(void (*func)(void)){
+	lineFunc=func;
+}
+
+void esp_Init(void){
+	memset(&esp_stats,0,sizeof(esp_stats));
+	esp_config.defBaud=115200;
+	esp_config.bootUs=300000;
+	esp_config.associateUs=1000000;
+	esp_config.latencyUs=2000;
+	esp_config.serverLatencyUs=20000;
+	esp_config.netBytesPerSec=0;
+	esp_config.bodySize=32768;
+	esp_config.closeAfter=0;
+	esp_config.keepAlive=true;
+	esp_config.ranges=true;
+	esp_config.chunked=false;
+	esp_config.mute=false;
+	esp_config.verbose=false;
+
+	state=ESP_OFF;
+	prevReset=true;
+	now=0;
+	eventCount=0;
+	ruleCount=0;
+	droppedOnce=false;
+	mux=listening=clientConnected=false;
+	lineFunc=NULL;
+	sim_PeerSetBaud(esp_config.defBaud);
+	sim_SetPeer(&espPeer);
+}
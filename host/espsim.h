@@ -0,0 +1,59 @@
+/*
+ * espsim.h
+ *
+ * ESP8266 AT firmware simulator, wired to the simulated UART of kernelsim.
+ * It boots when uzenet enables or resets it, follows AT+UART_CUR, answers
+ * the AT commands used by uzenet.c (plus the rules of a script) and serves
+ * a file over HTTP on any AT+CIPSTART connection, as +IPD segments. Once
+ * AT+CIPSERVER listens, the harness can also play a client of the module.
+ */
+
+#ifndef ESPSIM_H_
+#define ESPSIM_H_
+
+#include "kernelsim.h"
+
+typedef struct {
+	u32 defBaud;			//rate after a reset (AT+UART_DEF), 115200
+	u32 bootUs;				//reset to "ready", 300 ms
+	u32 associateUs;		//"ready" to WIFI GOT IP, 1 s
+	u32 latencyUs;			//end of a command to its reply, 2 ms
+	u32 serverLatencyUs;	//end of an HTTP request to its response, 20 ms
+	u32 netBytesPerSec;		//server to module bandwidth, 0 for unlimited
+	u32 bodySize;			//size of the file served, 32 KB
+	u32 closeAfter;			//drop the first connection after this many body bytes, 0 for never
+	bool keepAlive;			//honour HTTP/1.1 persistent connections
+	bool ranges;			//honour Range requests
+	bool chunked;			//send the body with chunked encoding
+	bool mute;				//never answer (timeout tests)
+	bool verbose;			//print the AT dialog
+} EspConfig;
+
+typedef struct {
+	u32 commands;
+	u32 boots;
+	u32 connects;
+	u32 requests;
+	u32 bodyBytes;			//body bytes sent by the server
+} EspStats;
+
+//Data the Uzebox sends to the client with AT+CIPSEND=0,len
+typedef void (*EspClientFunc)(const u8* data, u16 len);
+
+extern EspConfig esp_config;
+extern EspStats esp_stats;
+
+extern void esp_Init(void);
+extern void esp_PowerCycle(void);
+extern void esp_AddRule(const char* command, const char* reply);
+extern int  esp_LoadScript(const char* fileName);
+extern u8   esp_BodyByte(u32 offset);
+extern void esp_SetLineFunc(void (*func)(void));
+
+//Client of AT+CIPSERVER, link 0, false until the server listens
+extern bool esp_ClientConnect(EspClientFunc func);
+extern void esp_ClientSend(const u8* data, u16 len);
+extern u32  esp_ClientPending(void);
+extern void esp_ClientClose(void);
+
+#endif /* ESPSIM_H_ */
@@ -0,0 +1,7 @@
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#define cli()
+#define sei()
+
+#endif
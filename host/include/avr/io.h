@@ -0,0 +1,65 @@
+/*
+ * Host build: the AVR I/O registers used by the sources under test are plain
+ * variables, read and written by the simulated peripherals in uartsim.c.
+ */
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+extern volatile uint8_t sim_io[64];
+
+#define PORTA	sim_io[0]
+#define DDRA	sim_io[1]
+#define PINA	sim_io[2]
+#define PORTB	sim_io[3]
+#define DDRB	sim_io[4]
+#define PINB	sim_io[5]
+#define PORTC	sim_io[6]
+#define DDRC	sim_io[7]
+#define PORTD	sim_io[8]
+#define DDRD	sim_io[9]
+#define PIND	sim_io[10]
+#define UCSR0A	sim_io[11]
+#define UCSR0B	sim_io[12]
+#define UCSR0C	sim_io[13]
+#define UBRR0L	sim_io[14]
+#define UBRR0H	sim_io[15]
+#define UDR0	sim_io[16]
+#define SPDR	sim_io[17]
+#define SPSR	sim_io[18]
+#define SPCR	sim_io[19]
+
+#define PA0 0
+#define PA1 1
+#define PA2 2
+#define PA3 3
+#define PA4 4
+#define PA5 5
+#define PA6 6
+#define PA7 7
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+#define MPCM0	0
+#define U2X0	1
+#define UPE0	2
+#define DOR0	3
+#define FE0		4
+#define UDRE0	5
+#define TXC0	6
+#define RXC0	7
+#define TXEN0	3
+#define RXEN0	4
+#define UCSZ00	1
+#define UCSZ01	2
+#define USBS0	3
+#define SPIF	7
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ * Host build: flash and RAM share the address space, so the _P functions
+ * are the plain ones.
+ */
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(p)	(*(const uint8_t*)(p))
+#define pgm_read_word(p)	(*(const uint16_t*)(p))
+#define pgm_read_dword(p)	(*(const uint32_t*)(p))
+
+#define strlen_P		strlen
+#define strcpy_P		strcpy
+#define strcat_P		strcat
+#define strcmp_P		strcmp
+#define strncmp_P		strncmp
+#define strncasecmp_P	strncasecmp
+#define strstr_P		strstr
+#define memcpy_P		memcpy
+#define memcmp_P		memcmp
+#define printf_P		printf
+#define sprintf_P		sprintf
+
+#endif
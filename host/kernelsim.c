@@ -0,0 +1,554 @@
+/*
+ * kernelsim.c
+ *
+ * Simulated kernel for the host builds, see kernelsim.h.
+ *
+ * The UART model follows the hardware and soundMixerInline.s: the peer's
+ * bytes cross the wire at the peer's rate into the two byte USART receive
+ * FIFO, which the mixer polls sim_config.polls times per scanline into the
+ * receive ring. A byte completed while the FIFO is full is an overrun, one
+ * polled while the ring is full is dropped. The mixer moves one byte per
+ * scanline from the transmit ring to UDR0, and the USART shifts it out at
+ * the rate set in UBRR0L.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "kernelsim.h"
+
+#if UART_RX_BUFFER_SIZE == 0 || UART_TX_BUFFER_SIZE == 0
+	#error The host build needs the UART rings (UART_RX_BUFFER_SIZE and UART_TX_BUFFER_SIZE)
+#endif
+
+#define SIM_WIRE_SIZE	(1UL<<20)	//bytes the peer can queue on the wire
+#define SIM_RATE_TOLERANCE	0.03	//rate error a UART frame survives
+
+volatile uint8_t sim_io[64];
+
+SimConfig sim_config;
+SimStats sim_stats;
+uint64_t sim_cycles;
+
+static uint64_t nextLine,lines,rng;
+static u16 vsyncCounter;
+static bool inVsync;
+static VsyncCallBackFunc preVsyncFunc,postVsyncFunc;
+static const SimPeer* peer;
+
+//Kernel rings
+static u8 rxBuf[UART_RX_BUFFER_SIZE],txBuf[UART_TX_BUFFER_SIZE];
+static u16 rxHead,rxTail,txHead,txTail;
+
+//USART
+static u8 rxFifo[2],rxFifoCount;
+static bool udrFull,shiftFull;
+static u8 udr,shift;
+static double txCredit;
+
+//Peer side of the wire
+static u8* wire;
+static u32 wireHead,wireTail,peerBaud=115200;
+static double peerCredit;
+
+//EEPROM blocks
+static struct EepromBlockStruct eeprom[EEPROM_MAX_BLOCKS];
+static u8 eepromCount;
+
+
+double sim_Random(void){
+	//xorshift64*
+	rng^=rng>>12;
+	rng^=rng<<25;
+	rng^=rng>>27;
+	return (double)((rng*2685821657736338717ULL)>>11)/(double)(1ULL<<53);
+}
+
+static u16 _sim_RxUsed(void){
+	return (rxHead-rxTail)&(UART_RX_BUFFER_SIZE-1);
+}
+
+u32 sim_UzeboxBaud(void){
+	u16 ubrr=((u16)UBRR0H<<8)|UBRR0L;
+	return F_CPU/(((UCSR0A&(1<<U2X0))?8UL:16UL)*(ubrr+1));
+}
+
+static bool _sim_RatesMatch(void){
+	double uzebox=sim_UzeboxBaud();
+	return (uzebox>peerBaud*(1-SIM_RATE_TOLERANCE) && uzebox<peerBaud*(1+SIM_RATE_TOLERANCE));
+}
+
+static u8 _sim_Garble(u8 c){
+	return c^(u8)(1+sim_Random()*254);
+}
+
+//A byte from the peer completes on the wire
+static void _sim_WireReceive(u8 c){
+	double r=sim_Random();
+
+	if(r<sim_config.dropRate){
+		sim_stats.wireDrops++;
+		return;
+	}
+	if(r<sim_config.dropRate+sim_config.noiseRate){
+		sim_stats.wireDrops++;
+		c=_sim_Garble(c);
+	}
+	if(!_sim_RatesMatch()){
+		sim_stats.frameErrors++;
+		c=_sim_Garble(c);
+	}
+	if(!(UCSR0B&(1<<RXEN0))) return;
+
+	if(rxFifoCount==sizeof(rxFifo)){
+		sim_stats.overruns++;
+		return;
+	}
+	rxFifo[rxFifoCount++]=c;
+}
+
+//One poll of the inline mixer
+static void _sim_Poll(void){
+	u16 next,used;
+
+	if(rxFifoCount==0) return;
+
+	next=(rxHead+1)&(UART_RX_BUFFER_SIZE-1);
+	if(next==rxTail){
+		sim_stats.drops++;
+	}else{
+		rxBuf[rxHead]=rxFifo[0];
+		rxHead=next;
+		sim_stats.rxBytes++;
+		used=_sim_RxUsed();
+		if(used>sim_stats.peak) sim_stats.peak=used;
+	}
+	rxFifo[0]=rxFifo[1];
+	rxFifoCount--;
+}
+
+static void _sim_Transmit(void){
+	//mixer: one byte per line from the ring to UDR0
+	if(!udrFull && txHead!=txTail){
+		udr=txBuf[txTail];
+		txTail=(txTail+1)&(UART_TX_BUFFER_SIZE-1);
+		udrFull=true;
+	}
+
+	if(!(UCSR0B&(1<<TXEN0))) return;
+
+	if(!shiftFull && !udrFull){
+		txCredit=0;
+		return;
+	}
+	txCredit+=sim_UzeboxBaud()/10.0/SIM_LINE_RATE;
+	while(txCredit>=1){
+		if(!shiftFull){
+			if(!udrFull) break;
+			shift=udr;
+			shiftFull=true;
+			udrFull=false;
+		}
+		txCredit-=1;
+		shiftFull=false;
+		sim_stats.txBytes++;
+		if(peer!=NULL && peer->receive!=NULL) peer->receive(_sim_RatesMatch()?shift:_sim_Garble(shift));
+	}
+}
+
+static void _sim_Line(void){
+	if(wireHead==wireTail && !udrFull && !shiftFull && txHead==txTail) sim_stats.idleLines++;
+
+	for(u8 p=0;p<sim_config.polls;p++){
+		if(wireHead==wireTail){
+			peerCredit=0;
+		}else{
+			peerCredit+=peerBaud/10.0/SIM_LINE_RATE/sim_config.polls;
+			while(peerCredit>=1 && wireHead!=wireTail){
+				peerCredit-=1;
+				_sim_WireReceive(wire[wireTail]);
+				wireTail=(wireTail+1)&(SIM_WIRE_SIZE-1);
+			}
+		}
+		_sim_Poll();
+	}
+	_sim_Transmit();
+
+	if(peer!=NULL && peer->line!=NULL) peer->line();
+
+	if(++lines%SIM_LINES_PER_FRAME==0){
+		vsyncCounter++;
+		//the callbacks run with interrupts enabled, the lines go on meanwhile
+		if(!inVsync){
+			inVsync=true;
+			if(preVsyncFunc!=NULL) preVsyncFunc();
+			if(postVsyncFunc!=NULL) postVsyncFunc();
+			inVsync=false;
+		}
+	}
+}
+
+void sim_Advance(u32 cycles){
+	sim_cycles+=cycles;
+	while(sim_cycles>=nextLine){
+		nextLine+=SIM_CYCLES_PER_LINE;
+		_sim_Line();
+	}
+}
+
+double sim_Seconds(void){
+	return sim_cycles/(double)F_CPU;
+}
+
+void sim_Init(u32 seed){
+	if(wire==NULL) wire=malloc(SIM_WIRE_SIZE);
+
+	memset((void*)sim_io,0,sizeof(sim_io));
+	memset(&sim_stats,0,sizeof(sim_stats));
+	sim_config.callCycles=40;
+	sim_config.polls=(UART_RX_DUAL_POLL==1)?2:1;
+	sim_config.dropRate=0;
+	sim_config.noiseRate=0;
+
+	sim_cycles=0;
+	nextLine=SIM_CYCLES_PER_LINE;
+	lines=0;
+	vsyncCounter=0;
+	rng=0x9E3779B97F4A7C15ULL^seed;
+	preVsyncFunc=postVsyncFunc=NULL;
+	peer=NULL;
+
+	rxHead=rxTail=txHead=txTail=0;
+	rxFifoCount=0;
+	udrFull=shiftFull=false;
+	txCredit=0;
+	wireHead=wireTail=0;
+	peerCredit=0;
+}
+
+void sim_SetPeer(const SimPeer* p){
+	peer=p;
+}
+
+void sim_PeerSetBaud(u32 baud){
+	peerBaud=baud;
+}
+
+u32 sim_PeerBaud(void){
+	return peerBaud;
+}
+
+void sim_PeerSend(const u8* data, u16 len){
+	while(len--){
+		wire[wireHead]=*data++;
+		wireHead=(wireHead+1)&(SIM_WIRE_SIZE-1);
+	}
+}
+
+u32 sim_PeerPending(void){
+	return (wireHead-wireTail)&(SIM_WIRE_SIZE-1);
+}
+
+void sim_EepromClear(void){
+	eepromCount=0;
+}
+
+//The EEPROM blocks kept in a file between runs, none if it doesn't exist
+int sim_EepromLoad(const char* fileName){
+	FILE* f=fopen(fileName,"rb");
+
+	eepromCount=0;
+	if(f==NULL) return 0;
+	eepromCount=fread(eeprom,sizeof(eeprom[0]),EEPROM_MAX_BLOCKS-1,f);
+	fclose(f);
+	return 0;
+}
+
+int sim_EepromSave(const char* fileName){
+	FILE* f=fopen(fileName,"wb");
+
+	if(f==NULL) return -1;
+	fwrite(eeprom,sizeof(eeprom[0]),eepromCount,f);
+	fclose(f);
+	return 0;
+}
+
+
+/*
+ * Kernel API
+ */
+static void _sim_Call(void){
+	sim_Advance(sim_config.callCycles);
+}
+
+void WaitVsync(int count){
+	u16 target=vsyncCounter+count;
+	while(vsyncCounter!=target){
+		sim_Advance(SIM_CYCLES_PER_LINE);
+	}
+}
+
+void ClearVsyncCounter(){
+	vsyncCounter=0;
+}
+
+u16 GetVsyncCounter(){
+	_sim_Call();
+	return vsyncCounter;
+}
+
+void SetVsyncCounter(u16 count){
+	vsyncCounter=count;
+}
+
+u32 GetScanlineCounter(){
+	_sim_Call();
+	return (u32)vsyncCounter*SIM_LINES_PER_FRAME+(u32)(lines%SIM_LINES_PER_FRAME);
+}
+
+u32 GetScanlinesSince(u32 start){
+	u32 now=GetScanlineCounter();
+
+	if(now<start) now+=SCANLINE_COUNTER_WRAP;
+	return now-start;
+}
+
+void SetUserPreVsyncCallback(VsyncCallBackFunc func){
+	preVsyncFunc=func;
+}
+
+void SetUserPostVsyncCallback(VsyncCallBackFunc func){
+	postVsyncFunc=func;
+}
+
+void InitUartRxBuffer(){
+	rxHead=rxTail=0;
+}
+
+void InitUartTxBuffer(){
+	txHead=txTail=0;
+}
+
+s16 UartReadChar(){
+	_sim_Call();
+	if(rxHead==rxTail) return -1;
+	u8 c=rxBuf[rxTail];
+	rxTail=(rxTail+1)&(UART_RX_BUFFER_SIZE-1);
+	return c;
+}
+
+u8 UartUnreadCount(){
+	_sim_Call();
+	u16 count=_sim_RxUsed();
+	return (count>255)?255:count;
+}
+
+u16 UartRxCount(){
+	_sim_Call();
+	return _sim_RxUsed();
+}
+
+u16 UartReadBlock(u8* dst, u16 len){
+	_sim_Call();
+	u16 count=_sim_RxUsed();
+	if(len>count) len=count;
+	for(u16 i=0;i<len;i++){
+		dst[i]=rxBuf[rxTail];
+		rxTail=(rxTail+1)&(UART_RX_BUFFER_SIZE-1);
+	}
+	//the copy loop takes about 8 cycles per byte
+	sim_Advance(len*8);
+	return len;
+}
+
+s16 UartPeek(u16 offset){
+	_sim_Call();
+	if(offset>=_sim_RxUsed()) return -1;
+	return rxBuf[(rxTail+offset)&(UART_RX_BUFFER_SIZE-1)];
+}
+
+u16 UartSkip(u16 len){
+	_sim_Call();
+	u16 count=_sim_RxUsed();
+	if(len>count) len=count;
+	rxTail=(rxTail+len)&(UART_RX_BUFFER_SIZE-1);
+	return len;
+}
+
+void UartGoBack(u8 count){
+	rxTail=(rxTail-count)&(UART_RX_BUFFER_SIZE-1);
+}
+
+bool IsUartTxBufferEmpty(){
+	_sim_Call();
+	return (txHead==txTail);
+}
+
+bool IsUartTxBufferFull(){
+	_sim_Call();
+	return (((txHead+1)&(UART_TX_BUFFER_SIZE-1))==txTail);
+}
+
+s8 UartSendChar(u8 data){
+	_sim_Call();
+	u16 next=(txHead+1)&(UART_TX_BUFFER_SIZE-1);
+	if(next==txTail) return -1;
+	txBuf[txHead]=data;
+	txHead=next;
+	return 0;
+}
+
+u16 UartWriteBlock(const u8* src, u16 len){
+	u16 n=0;
+	_sim_Call();
+	while(n<len && ((txHead+1)&(UART_TX_BUFFER_SIZE-1))!=txTail){
+		txBuf[txHead]=src[n++];
+		txHead=(txHead+1)&(UART_TX_BUFFER_SIZE-1);
+	}
+	sim_Advance(n*8);
+	return n;
+}
+
+static u8 _sim_Saturate(u32 n){
+	return (n>255)?255:n;
+}
+
+void UartGetStats(struct UartStatsStruct* stats){
+	stats->frameErrors=_sim_Saturate(sim_stats.frameErrors);
+	stats->overruns=_sim_Saturate(sim_stats.overruns);
+	stats->drops=_sim_Saturate(sim_stats.drops);
+	stats->peak=sim_stats.peak;
+}
+
+void UartResetStats(){
+	sim_stats.frameErrors=0;
+	sim_stats.overruns=0;
+	sim_stats.drops=0;
+	sim_stats.peak=0;
+}
+
+bool isEepromFormatted(){
+	return true;
+}
+
+//First free block, one past the last if none, as the kernel fills holes first
+static u8 _sim_EepromFree(void){
+	u8 i;
+
+	for(i=0;i<eepromCount;i++){
+		if(eeprom[i].id==EEPROM_FREE_BLOCK) break;
+	}
+	return i;
+}
+
+char EepromReadBlock(unsigned int blockId, struct EepromBlockStruct* block){
+	for(u8 i=0;i<eepromCount;i++){
+		if(eeprom[i].id==blockId){
+			*block=eeprom[i];
+			return EEPROM_OK;
+		}
+	}
+	return EEPROM_ERROR_BLOCK_NOT_FOUND;
+}
+
+//Block i is at (i+1)*sizeof(eeprom[0]), after the header block
+char EepromBlockExists(unsigned int blockId, u16* eepromAddr, u8* nextFreeBlockId){
+	u8 free=_sim_EepromFree();
+
+	*eepromAddr=0;
+	if(nextFreeBlockId!=NULL) *nextFreeBlockId=(free<EEPROM_MAX_BLOCKS-1)?free+1:0;
+	for(u8 i=0;i<eepromCount;i++){
+		if(eeprom[i].id==blockId){
+			*eepromAddr=(i+1)*sizeof(eeprom[0]);
+			return EEPROM_OK;
+		}
+	}
+	return EEPROM_ERROR_BLOCK_NOT_FOUND;
+}
+
+unsigned char ReadEeprom(unsigned int addr){
+	u16 i=addr/sizeof(eeprom[0]);
+
+	if(i==0 || i>eepromCount) return 0xff;
+	return ((u8*)&eeprom[i-1])[addr%sizeof(eeprom[0])];
+}
+
+//A byte takes 3.4ms to program
+void WriteEeprom(unsigned int addr,unsigned char value){
+	u16 i=addr/sizeof(eeprom[0]);
+
+	sim_Advance(SIM_CYCLES_PER_EEPROM_BYTE);
+	if(i==0 || i>eepromCount) return;
+	((u8*)&eeprom[i-1])[addr%sizeof(eeprom[0])]=value;
+}
+
+char EepromWriteBlock(struct EepromBlockStruct* block){
+	u8 i;
+
+	sim_Advance(EEPROM_BLOCK_SIZE*SIM_CYCLES_PER_EEPROM_BYTE);
+
+	for(i=0;i<eepromCount;i++){
+		if(eeprom[i].id==block->id) break;
+	}
+	if(i==eepromCount) i=_sim_EepromFree();
+	//the first block holds the EEPROM header
+	if(i==eepromCount){
+		if(eepromCount==EEPROM_MAX_BLOCKS-1) return EEPROM_ERROR_FULL;
+		eepromCount++;
+	}
+	eeprom[i]=*block;
+	return EEPROM_OK;
+}
+
+
+/*
+ * Video, NetLoaderZ's screen is not shown
+ */
+void ClearVram(void){}
+void SetTile(char x, char y, unsigned int tileId){}
+void SetFontTilesIndex(unsigned char index){}
+void SetTileTable(const char* data){}
+void Print(int x, int y, const char* string){}
+void PrintLong(int x, int y, unsigned long val){}
+void PrintChar(int x, int y, char c){}
+void PrintInt(int x, int y, unsigned int val, bool zeropad){}
+void Fill(int x, int y, int width, int height, int tile){}
+
+
+/*
+ * avr-libc
+ */
+static char* _sim_ToString(unsigned long value, bool negative, char* str, int radix){
+	char tmp[34];
+	int n=0;
+	char* p=str;
+
+	do{
+		int d=value%radix;
+		tmp[n++]=(d<10)?('0'+d):('a'+d-10);
+		value/=radix;
+	}while(value!=0);
+
+	if(negative) *p++='-';
+	while(n!=0) *p++=tmp[--n];
+	*p=0;
+	return str;
+}
+
+char* itoa(int value, char* str, int radix){
+	if(radix==10 && value<0) return _sim_ToString(-(long)value,true,str,radix);
+	return _sim_ToString((unsigned int)value,false,str,radix);
+}
+
+char* utoa(unsigned int value, char* str, int radix){
+	return _sim_ToString(value,false,str,radix);
+}
+
+char* ltoa(long value, char* str, int radix){
+	if(radix==10 && value<0) return _sim_ToString(-(unsigned long)value,true,str,radix);
+	return _sim_ToString((unsigned long)value,false,str,radix);
+}
+
+char* ultoa(unsigned long value, char* str, int radix){
+	return _sim_ToString(value,false,str,radix);
+}
@@ -0,0 +1,74 @@
+/*
+ * kernelsim.h
+ *
+ * Host build of the kernel services used by uzenet.c and NetLoaderZ.c: the
+ * vsync and scanline counters, the UART rings served by the inline mixer,
+ * the USART and the EEPROM blocks. Time is simulated in CPU cycles and only advances when
+ * the code under test calls into the kernel, so runs are deterministic and
+ * much faster than real time.
+ */
+
+#ifndef KERNELSIM_H_
+#define KERNELSIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <uzebox.h>
+
+#define SIM_CYCLES_PER_LINE		1820
+#define SIM_LINES_PER_FRAME		262
+#define SIM_LINE_RATE			((double)F_CPU/SIM_CYCLES_PER_LINE)
+#define SIM_CYCLES_PER_EEPROM_BYTE	((u32)(F_CPU*0.0034))
+
+//Device on the other end of the UART wire (the ESP8266 simulator, a pty...)
+typedef struct {
+	void (*receive)(u8 c);	//byte sent by the Uzebox, garbled if the rates differ
+	void (*line)(void);		//called once per scanline, to send or time things
+} SimPeer;
+
+//Faults and costs, can be changed at any time
+typedef struct {
+	u32 callCycles;		//cycles charged per kernel call, 40 by default
+	u8 polls;			//receiver polls per scanline, from UART_RX_DUAL_POLL
+	double dropRate;	//probability that a byte sent by the peer is lost on the wire
+	double noiseRate;	//probability that it is corrupted
+} SimConfig;
+
+typedef struct {
+	u32 rxBytes;		//bytes that reached the receive ring
+	u32 txBytes;		//bytes sent on the wire by the Uzebox
+	u32 overruns;		//bytes lost because the USART was not polled in time
+	u32 drops;			//bytes lost because the receive ring was full
+	u32 frameErrors;	//bytes received at the wrong rate
+	u32 wireDrops;		//bytes dropped or corrupted by the fault injection
+	u16 peak;			//highest receive ring occupancy
+	u32 idleLines;		//scanlines without a byte on the wire either way
+} SimStats;
+
+extern SimConfig sim_config;
+extern SimStats sim_stats;
+extern uint64_t sim_cycles;
+
+extern void sim_Init(u32 seed);
+extern void sim_Advance(u32 cycles);
+extern double sim_Seconds(void);
+extern double sim_Random(void);
+
+extern void sim_SetPeer(const SimPeer* peer);
+extern void sim_PeerSetBaud(u32 baud);
+extern u32  sim_PeerBaud(void);
+extern void sim_PeerSend(const u8* data, u16 len);
+extern u32  sim_PeerPending(void);
+extern u32  sim_UzeboxBaud(void);
+
+extern void sim_EepromClear(void);
+extern int  sim_EepromLoad(const char* fileName);
+extern int  sim_EepromSave(const char* fileName);
+
+//avr-libc conversions missing from the host C library
+extern char* itoa(int value, char* str, int radix);
+extern char* utoa(unsigned int value, char* str, int radix);
+extern char* ltoa(long value, char* str, int radix);
+extern char* ultoa(unsigned long value, char* str, int radix);
+
+#endif /* KERNELSIM_H_ */
@@ -0,0 +1,376 @@
+/*
+ * sdsim.c
+ *
+ * Simulated SD card, see sdsim.h. Only the bootlib functions used by the
+ * loaders are provided. The image may start with a partition table (first
+ * partition used) or directly with the FAT boot sector, as bootlib accepts.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "sdsim.h"
+
+#define SDSIM_PART_ENTRY	0x1be	//first entry of the partition table
+#define SDSIM_PART_START	63		//first partition of the images made by sdsim_Format
+#define SDSIM_SECTORS		32768	//16 MB partition, FAT16 with 2 KB clusters
+#define SDSIM_CSIZE			4
+#define SDSIM_ROOT_ENTRIES	512
+
+SdSimConfig sdsim_config;
+SdSimStats sdsim_stats;
+
+static FILE* image;
+static bool fat32;
+static u8 csize;
+static u32 fatStart,rootStart,rootSectors,dataStart,rootCluster;
+static void (*bootFunc)(void);
+
+
+static void _sdsim_Access(u32 us){
+	if(us>sdsim_stats.worstUs) sdsim_stats.worstUs=us;
+	sdsim_stats.busy+=us/1000000.0;
+	sim_Advance((u32)(us*(F_CPU/1000000.0)));
+}
+
+static bool _sdsim_Read(u32 sector, u8* buf){
+	if(image==NULL || fseek(image,(long)sector*512,SEEK_SET)!=0) return false;
+	if(fread(buf,512,1,image)!=1) memset(buf,0,512);	//past the end of a sparse image
+	return true;
+}
+
+static bool _sdsim_Write(u32 sector, const u8* buf){
+	if(image==NULL || fseek(image,(long)sector*512,SEEK_SET)!=0) return false;
+	return (fwrite(buf,512,1,image)==1);
+}
+
+static u16 _sdsim_Get16(const u8* p){
+	return p[0]|(p[1]<<8);
+}
+
+static u32 _sdsim_Get32(const u8* p){
+	return p[0]|(p[1]<<8)|((u32)p[2]<<16)|((u32)p[3]<<24);
+}
+
+static void _sdsim_Put16(u8* p, u16 v){
+	p[0]=v;
+	p[1]=v>>8;
+}
+
+static void _sdsim_Put32(u8* p, u32 v){
+	_sdsim_Put16(p,v);
+	_sdsim_Put16(p+2,v>>16);
+}
+
+static u32 _sdsim_NextCluster(u32 cluster){
+	u8 buf[512];
+	u32 offset=cluster*(fat32?4:2);
+
+	if(!_sdsim_Read(fatStart+offset/512,buf)) return 0;
+	if(fat32) return _sdsim_Get32(&buf[offset%512])&0x0fffffff;
+	return _sdsim_Get16(&buf[offset%512]);
+}
+
+static bool _sdsim_LastCluster(u32 cluster){
+	return (cluster<2 || cluster>=(fat32?0x0ffffff8UL:0xfff8UL));
+}
+
+//Sector of the file position, the FAT16 root directory is cluster 0
+static u32 _sdsim_Sector(sdc_struct_t* sds){
+	if(sds->cclus==0) return rootStart+sds->csec;
+	return dataStart+(sds->cclus-2)*csize+sds->csec;
+}
+
+static bool _sdsim_Mount(){
+	u8 buf[512];
+	u32 start=0,fatSize,totalSectors;
+
+	if(!_sdsim_Read(0,buf) || _sdsim_Get16(&buf[510])!=0xaa55) return false;
+
+	//partition table or boot sector
+	if(buf[0]!=0xeb && buf[0]!=0xe9){
+		start=_sdsim_Get32(&buf[SDSIM_PART_ENTRY+8]);
+		if(!_sdsim_Read(start,buf) || _sdsim_Get16(&buf[510])!=0xaa55) return false;
+	}
+	if(_sdsim_Get16(&buf[11])!=512 || buf[13]==0) return false;
+
+	csize=buf[13];
+	fatStart=start+_sdsim_Get16(&buf[14]);
+	fatSize=_sdsim_Get16(&buf[22]);
+	if(fatSize==0) fatSize=_sdsim_Get32(&buf[36]);
+	totalSectors=_sdsim_Get16(&buf[19]);
+	if(totalSectors==0) totalSectors=_sdsim_Get32(&buf[32]);
+	rootSectors=(_sdsim_Get16(&buf[17])*32+511)/512;
+	rootStart=fatStart+buf[16]*fatSize;
+	dataStart=rootStart+rootSectors;
+	fat32=(rootSectors==0);
+	rootCluster=fat32?_sdsim_Get32(&buf[44]):0;
+	return (totalSectors>dataStart-start);
+}
+
+void sdsim_Init(void){
+	memset(&sdsim_stats,0,sizeof(sdsim_stats));
+	sdsim_config.readUs=400;
+	sdsim_config.writeUs=1500;
+	sdsim_config.slowEvery=64;
+	sdsim_config.slowUs=10000;
+	bootFunc=NULL;
+}
+
+int sdsim_Open(const char* fileName){
+	sdsim_Close();
+	image=fopen(fileName,"r+b");
+	return (image==NULL)?-1:0;
+}
+
+void sdsim_Close(void){
+	if(image!=NULL) fclose(image);
+	image=NULL;
+}
+
+void sdsim_SetBootFunc(void (*func)(void)){
+	bootFunc=func;
+}
+
+/*
+ * Makes an image with one FAT16 partition holding NETLOAD.BIN, of
+ * fileSectors zeroed sectors. A fragmented file takes every other cluster,
+ * so that each cluster change follows the FAT.
+ */
+int sdsim_Format(const char* fileName, u32 fileSectors, bool fragmented){
+	u8 buf[512];
+	u32 clusters=(fileSectors+SDSIM_CSIZE-1)/SDSIM_CSIZE;
+	u32 step=fragmented?2:1;
+	u32 fatSize=((SDSIM_SECTORS/SDSIM_CSIZE+2)*2+511)/512;
+	u32 fat=SDSIM_PART_START+1,root=fat+2*fatSize,data=root+SDSIM_ROOT_ENTRIES*32/512;
+	FILE* f=fopen(fileName,"w+b");
+
+	if(f==NULL) return -1;
+	sdsim_Close();
+	image=f;
+
+	//partition table
+	memset(buf,0,512);
+	buf[SDSIM_PART_ENTRY+4]=0x06;
+	_sdsim_Put32(&buf[SDSIM_PART_ENTRY+8],SDSIM_PART_START);
+	_sdsim_Put32(&buf[SDSIM_PART_ENTRY+12],SDSIM_SECTORS);
+	_sdsim_Put16(&buf[510],0xaa55);
+	_sdsim_Write(0,buf);
+
+	//boot sector
+	memset(buf,0,512);
+	memcpy(buf,"\xeb\x3c\x90MSWIN4.1",11);
+	_sdsim_Put16(&buf[11],512);
+	buf[13]=SDSIM_CSIZE;
+	_sdsim_Put16(&buf[14],1);
+	buf[16]=2;
+	_sdsim_Put16(&buf[17],SDSIM_ROOT_ENTRIES);
+	_sdsim_Put16(&buf[19],SDSIM_SECTORS);
+	buf[21]=0xf8;
+	_sdsim_Put16(&buf[22],fatSize);
+	_sdsim_Put32(&buf[28],SDSIM_PART_START);
+	buf[38]=0x29;
+	memcpy(&buf[43],"UZEBOX     FAT16   ",19);
+	_sdsim_Put16(&buf[510],0xaa55);
+	_sdsim_Write(SDSIM_PART_START,buf);
+
+	//FATs, the file chain from cluster 2
+	for(u32 s=0;s<fatSize;s++){
+		memset(buf,0,512);
+		for(u32 i=0;i<256;i++){
+			u32 cluster=s*256+i,n;
+			if(cluster==0) _sdsim_Put16(&buf[0],0xfff8);
+			if(cluster==1) _sdsim_Put16(&buf[2],0xffff);
+			if(cluster<2 || (cluster-2)%step!=0) continue;
+			n=(cluster-2)/step;
+			if(n<clusters) _sdsim_Put16(&buf[i*2],(n==clusters-1)?0xffff:cluster+step);
+		}
+		_sdsim_Write(fat+s,buf);
+		_sdsim_Write(fat+fatSize+s,buf);
+	}
+
+	//root directory
+	memset(buf,0,512);
+	memcpy(buf,"NETLOAD BIN",11);
+	buf[11]=0x20;
+	_sdsim_Put16(&buf[26],clusters?2:0);
+	_sdsim_Put32(&buf[28],fileSectors*512);
+	_sdsim_Write(root,buf);
+	memset(buf,0,512);
+	for(u32 s=1;s<SDSIM_ROOT_ENTRIES*32/512;s++) _sdsim_Write(root+s,buf);
+
+	//file data, and the last sector to size the image
+	for(u32 n=0;n<clusters;n++){
+		for(u32 s=0;s<SDSIM_CSIZE;s++) _sdsim_Write(data+n*step*SDSIM_CSIZE+s,buf);
+	}
+	_sdsim_Write(SDSIM_PART_START+SDSIM_SECTORS-1,buf);
+	fflush(image);
+	return 0;
+}
+
+/*
+ * Finds a root directory entry by its 8.3 name, returns its 32 bytes in
+ * entry or false
+ */
+static bool _sdsim_FindEntry(const char name[11], u8* entry){
+	u8 buf[512];
+	u32 cluster=rootCluster,sector=0;
+
+	while(1){
+		u32 lba;
+		if(fat32){
+			if(sector==csize){
+				cluster=_sdsim_NextCluster(cluster);
+				sector=0;
+			}
+			if(_sdsim_LastCluster(cluster)) return false;
+			lba=dataStart+(cluster-2)*csize+sector;
+		}else{
+			if(sector==rootSectors) return false;
+			lba=rootStart+sector;
+		}
+		if(!_sdsim_Read(lba,buf)) return false;
+
+		for(u16 i=0;i<512;i+=32){
+			if(buf[i]==0) return false;
+			if(buf[i]==0xe5 || (buf[i+11]&0x08)) continue;
+			if(memcmp(&buf[i],name,11)==0){
+				memcpy(entry,&buf[i],32);
+				return true;
+			}
+		}
+		sector++;
+	}
+}
+
+static u32 _sdsim_EntryCluster(const u8* entry){
+	return _sdsim_Get16(&entry[26])|(fat32?(u32)_sdsim_Get16(&entry[20])<<16:0);
+}
+
+//Reads a file of the root directory ("NETLOAD.BIN"), returns its size or -1
+long sdsim_ReadFile(const char* name, u8* dst, u32 max){
+	char name83[11];
+	u8 entry[32],buf[512];
+	u32 size,cluster,done=0;
+	u8 i=0;
+
+	if(image==NULL || !_sdsim_Mount()) return -1;
+
+	memset(name83,' ',11);
+	for(const char* p=name;*p!=0;p++){
+		if(*p=='.'){
+			i=8;
+		}else if(i<11){
+			name83[i++]=toupper(*p);
+		}
+	}
+	if(!_sdsim_FindEntry(name83,entry)) return -1;
+
+	size=_sdsim_Get32(&entry[28]);
+	cluster=_sdsim_EntryCluster(entry);
+	while(done<size && done<max && !_sdsim_LastCluster(cluster)){
+		for(u8 s=0;s<csize && done<size && done<max;s++){
+			u32 n=size-done;
+			if(n>512) n=512;
+			if(n>max-done) n=max-done;
+			_sdsim_Read(dataStart+(cluster-2)*csize+s,buf);
+			memcpy(dst+done,buf,n);
+			done+=n;
+		}
+		cluster=_sdsim_NextCluster(cluster);
+	}
+	return size;
+}
+
+
+/*
+ * bootlib
+ */
+uint8_t FS_Init(sdc_struct_t* sds){
+	if(image==NULL) return 1;
+	_sdsim_Access(sdsim_config.readUs*2);
+	if(!_sdsim_Mount()) return 7;
+
+	sds->flags=SDC_FLAGS_INIT|SDC_FLAGS_SDHC|(fat32?SDC_FLAGS_FAT32:0);
+	sds->csize=csize;
+	FS_Select_Root(sds);
+	return 0;
+}
+
+uint32_t FS_Get_Sector(sdc_struct_t* sds){
+	return _sdsim_Sector(sds);
+}
+
+uint8_t FS_Read_Sector(sdc_struct_t* sds){
+	sdsim_stats.reads++;
+	_sdsim_Access(sdsim_config.readUs);
+	return _sdsim_Read(_sdsim_Sector(sds),sds->bufp)?0:1;
+}
+
+uint8_t FS_Write_Sector(sdc_struct_t* sds){
+	bool slow;
+
+	//counted once in the image, the bench can break the link right after
+	slow=(sdsim_config.slowEvery!=0 && (sdsim_stats.writes+1)%sdsim_config.slowEvery==0);
+	_sdsim_Access(slow?sdsim_config.slowUs:sdsim_config.writeUs);
+	if(!_sdsim_Write(_sdsim_Sector(sds),sds->bufp)) return 1;
+	fflush(image);
+	sdsim_stats.writes++;
+	return 0;
+}
+
+uint8_t FS_Next_Sector(sdc_struct_t* sds){
+	u32 next;
+
+	if(sds->cclus==0){
+		if(sds->csec+1>=rootSectors) return 1;
+		sds->csec++;
+		return 0;
+	}
+	if(sds->csec+1<csize){
+		sds->csec++;
+		return 0;
+	}
+	next=_sdsim_NextCluster(sds->cclus);
+	if(_sdsim_LastCluster(next)) return 1;
+	sds->cclus=next;
+	sds->csec=0;
+	return 0;
+}
+
+void FS_Reset_Sector(sdc_struct_t* sds){
+	sds->cclus=sds->fclus;
+	sds->csec=0;
+}
+
+void FS_Select_Root(sdc_struct_t* sds){
+	FS_Select_Cluster(sds,rootCluster);
+}
+
+void FS_Select_Cluster(sdc_struct_t* sds, uint32_t cluster){
+	sds->fclus=cluster;
+	FS_Reset_Sector(sds);
+}
+
+uint32_t FS_Find(sdc_struct_t* sds,
+                 uint16_t ch01, uint16_t ch23, uint16_t ch45, uint16_t ch67,
+                 uint16_t ex01, uint16_t ex2x){
+	const char name[11]={ch01>>8,ch01,ch23>>8,ch23,ch45>>8,ch45,ch67>>8,ch67,ex01>>8,ex01,ex2x>>8};
+	u8 entry[32];
+
+	_sdsim_Access(sdsim_config.readUs);
+	if(!_sdsim_FindEntry(name,entry)) return 0;
+	return _sdsim_EntryCluster(entry);
+}
+
+//CRC-16 with polynomial 0x1021, as sdlib_crc16_byte
+uint16_t SDC_CRC16_Byte(uint16_t crcval, uint8_t byte){
+	u8 x=(crcval>>8)^byte;
+	x^=x>>4;
+	return (crcval<<8)^((u16)x<<12)^((u16)x<<5)^x;
+}
+
+void Bootld_Request(sdc_struct_t* sds){
+	if(bootFunc!=NULL) bootFunc();
+	exit(0);
+}
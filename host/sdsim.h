@@ -0,0 +1,40 @@
+/*
+ * sdsim.h
+ *
+ * bootlib's FS_* functions over a FAT16/FAT32 image file, for the host
+ * builds of NetLoaderZ. Sector reads and writes take simulated time (the
+ * UART keeps receiving meanwhile) and Bootld_Request calls a function of
+ * the harness instead of rebooting.
+ */
+
+#ifndef SDSIM_H_
+#define SDSIM_H_
+
+#include <bootlib.h>
+#include "kernelsim.h"
+
+typedef struct {
+	u32 readUs;		//sector read, 400 us
+	u32 writeUs;	//sector write, 1500 us
+	u32 slowEvery;	//one write in this many is slow (the card erases a block), 0 for never
+	u32 slowUs;		//time of a slow write, 10 ms
+} SdSimConfig;
+
+typedef struct {
+	u32 reads;
+	u32 writes;
+	double busy;	//seconds spent in sector accesses
+	u32 worstUs;	//longest access
+} SdSimStats;
+
+extern SdSimConfig sdsim_config;
+extern SdSimStats sdsim_stats;
+
+extern void sdsim_Init(void);
+extern int  sdsim_Open(const char* fileName);
+extern void sdsim_Close(void);
+extern int  sdsim_Format(const char* fileName, u32 fileSectors, bool fragmented);
+extern long sdsim_ReadFile(const char* name, u8* dst, u32 max);
+extern void sdsim_SetBootFunc(void (*func)(void));
+
+#endif /* SDSIM_H_ */
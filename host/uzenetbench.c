@@ -0,0 +1,313 @@
+/*
+ * uzenetbench.c
+ *
+ * Runs uzenet.c against the ESP8266 simulator and reports the init times,
+ * the AT command latency, the timeouts and the HTTP throughput. Every test
+ * checks its result, the exit code is the number of failures so that the
+ * harness can run in CI.
+ *
+ * Times are simulated: a second of the report is a second of the Uzebox,
+ * whatever the speed of the host.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <avr/pgmspace.h>
+#include "kernelsim.h"
+#include "espsim.h"
+#include "uzenet.h"
+
+#define BENCH_HOST		"uzebox.local"
+#define BENCH_URL		"/rom.uze"
+#define BENCH_AT_COUNT	50
+#define BENCH_LIMIT		120.0	//simulated seconds before a test is stuck
+
+static int failures;
+static u32 seed=1;
+
+static void _bench_Check(bool ok, const char* what){
+	if(!ok){
+		printf("FAIL: %s\n",what);
+		failures++;
+	}
+}
+
+//Bytes corrupted or lost on the wire go through, uzenet has no checksum: they only count on a clean wire
+static bool _bench_Intact(u32 errors){
+	return (errors==0 || sim_config.noiseRate!=0 || sim_config.dropRate!=0);
+}
+
+static void _bench_UartReport(){
+	printf("  uart: %lu bytes in, %lu out, %lu overruns, %lu drops, %lu frame errors, %lu wire faults, peak %u\n",
+		(unsigned long)sim_stats.rxBytes,(unsigned long)sim_stats.txBytes,(unsigned long)sim_stats.overruns,
+		(unsigned long)sim_stats.drops,(unsigned long)sim_stats.frameErrors,(unsigned long)sim_stats.wireDrops,sim_stats.peak);
+}
+
+//Power on: a blank simulator, the module off and the EEPROM empty
+static void _bench_PowerOn(){
+	EspConfig config=esp_config;
+
+	sim_Init(seed);
+	esp_Init();
+	esp_config=config;
+	sim_EepromClear();
+	SetUserPostVsyncCallback(&wifi_Tick);
+}
+
+
+/*
+ * Init
+ */
+static void _bench_Init(const char* name, int expected){
+	double t=sim_Seconds();
+	u32 boots=esp_stats.boots;
+	int r=wifi_Init(NULL);
+
+	printf("init %-13s %7.3f s, result %d, %u boot(s), %lu baud\n",name,sim_Seconds()-t,r,
+		(unsigned)(esp_stats.boots-boots),(unsigned long)sim_UzeboxBaud());
+	_bench_Check(r==expected,name);
+}
+
+static void _bench_Inits(){
+	_bench_Init("cold",WIFI_OK);
+	_bench_Init("warm",WIFI_OK);
+	esp_PowerCycle();
+	_bench_Init("power cycled",WIFI_OK);
+	_bench_UartReport();
+}
+
+
+/*
+ * AT commands
+ */
+static volatile s8 asyncResult;
+static volatile bool asyncDone;
+
+static void _bench_CommandDone(s8 result){
+	asyncResult=result;
+	asyncDone=true;
+}
+
+//The main loop of a game: poll, and tick once per frame
+static void _bench_Loop(volatile bool* done){
+	u16 frame=GetVsyncCounter();
+	double limit=sim_Seconds()+BENCH_LIMIT;
+
+	while(!*done && sim_Seconds()<limit){
+		wifi_Poll();
+		if(GetVsyncCounter()!=frame){
+			frame=GetVsyncCounter();
+			wifi_Tick();
+		}
+	}
+}
+
+static bool _bench_WaitAsync(){
+	_bench_Loop(&asyncDone);
+	return asyncDone;
+}
+
+static void _bench_Commands(){
+	double t,worst=0;
+	int i,r=0;
+
+	//blocking, wifi_Tick() runs from VSYNC
+	t=sim_Seconds();
+	for(i=0;i<BENCH_AT_COUNT;i++){
+		double s=sim_Seconds();
+		wifi_SendString_P(PSTR("AT\r\n"));
+		r=wifi_WaitForTokens(WIFI_TOKEN_MASK(WIFI_TOKEN_OK));
+		if(r!=WIFI_TOKEN_OK) break;
+		if(sim_Seconds()-s>worst) worst=sim_Seconds()-s;
+	}
+	printf("AT blocking      %7.3f ms average, %.3f ms worst\n",(sim_Seconds()-t)*1000/BENCH_AT_COUNT,worst*1000);
+	_bench_Check(r==WIFI_TOKEN_OK,"blocking AT");
+
+	//asynchronous
+	SetUserPostVsyncCallback(NULL);
+	t=sim_Seconds();
+	worst=0;
+	for(i=0;i<BENCH_AT_COUNT;i++){
+		double s=sim_Seconds();
+		asyncDone=false;
+		wifi_QueueCommand_P(PSTR("AT\r\n"),&_bench_CommandDone);
+		if(!_bench_WaitAsync() || asyncResult!=WIFI_OK) break;
+		if(sim_Seconds()-s>worst) worst=sim_Seconds()-s;
+	}
+	printf("AT async         %7.3f ms average, %.3f ms worst\n",(sim_Seconds()-t)*1000/BENCH_AT_COUNT,worst*1000);
+	_bench_Check(i==BENCH_AT_COUNT,"async AT");
+
+	//timeouts, with a module that no longer answers
+	esp_config.mute=true;
+
+	asyncDone=false;
+	t=sim_Seconds();
+	wifi_QueueCommand_P(PSTR("AT\r\n"),&_bench_CommandDone);
+	_bench_WaitAsync();
+	printf("async timeout    %7.3f s, result %d\n",sim_Seconds()-t,asyncResult);
+	_bench_Check(asyncDone && asyncResult==WIFI_ERR_TIMEOUT,"async timeout");
+
+	SetUserPostVsyncCallback(&wifi_Tick);
+	t=sim_Seconds();
+	wifi_SendString_P(PSTR("AT\r\n"));
+	r=wifi_WaitForTokens(WIFI_TOKEN_MASK(WIFI_TOKEN_OK));
+	printf("blocking timeout %7.3f s, result %d\n",sim_Seconds()-t,r);
+	_bench_Check(r==WIFI_ERR_TIMEOUT,"blocking timeout");
+
+	esp_config.mute=false;
+	SetUserPostVsyncCallback(NULL);
+}
+
+
+/*
+ * HTTP
+ */
+static u32 httpReceived,httpErrors,httpOffset;
+static double httpFirstByte;
+static volatile bool httpFinished;
+static s8 httpResult;
+static u16 httpCode;
+
+static void _bench_HttpBody(u8* data, u16 len){
+	if(httpReceived==0) httpFirstByte=sim_Seconds();
+	for(u16 i=0;i<len;i++){
+		if(data[i]!=esp_BodyByte(httpOffset+httpReceived+i)) httpErrors++;
+	}
+	httpReceived+=len;
+}
+
+static void _bench_HttpDone(s8 result, u16 responseCode){
+	httpResult=result;
+	httpCode=responseCode;
+	httpFinished=true;
+}
+
+//Downloads from offset, as NetLoaderZ does: polls all the time, ticks once per frame
+static double _bench_Get(u32 offset){
+	static char host[]=BENCH_HOST;
+	static char url[]=BENCH_URL;
+	double t=sim_Seconds();
+
+	httpReceived=0;
+	httpErrors=0;
+	httpOffset=offset;
+	httpFinished=false;
+	httpResult=WIFI_ERR;
+	httpCode=0;
+
+	if(HttpGetRange(host,80,url,offset,&_bench_HttpBody,&_bench_HttpDone)!=WIFI_OK) return 0;
+
+	_bench_Loop(&httpFinished);
+	return sim_Seconds()-t;
+}
+
+static void _bench_Http(){
+	double t;
+	u32 connects;
+
+	//one file, connection closed after it
+	UartResetStats();
+	HttpSetKeepAlive(false);
+	t=_bench_Get(0);
+	printf("HTTP get         %7.3f s, %lu bytes, %.0f bytes/s, result %d, code %u, %lu bad bytes\n",t,
+		(unsigned long)httpReceived,httpReceived/t,httpResult,httpCode,(unsigned long)httpErrors);
+	_bench_UartReport();
+	_bench_Check(httpResult==WIFI_OK && httpReceived==esp_config.bodySize && _bench_Intact(httpErrors),"HTTP get");
+
+	//keep-alive: the second request skips AT+CIPSTART
+	HttpSetKeepAlive(true);
+	connects=esp_stats.connects;
+	_bench_Get(0);
+	t=sim_Seconds();
+	_bench_Get(0);
+	printf("keep-alive       %7.3f ms to the first byte, %u connect(s) for 2 requests\n",
+		(httpFirstByte-t)*1000,(unsigned)(esp_stats.connects-connects));
+	_bench_Check(httpResult==WIFI_OK && httpReceived==esp_config.bodySize && _bench_Intact(httpErrors),"keep-alive get");
+	_bench_Check(esp_stats.connects-connects==1,"keep-alive connects");
+	asyncDone=false;
+	HttpClose();
+	wifi_QueueCommand_P(PSTR("AT\r\n"),&_bench_CommandDone);
+	_bench_WaitAsync();
+	HttpSetKeepAlive(false);
+
+	//connection lost halfway, resumed with a Range request
+	esp_config.closeAfter=esp_config.bodySize/2;
+	t=_bench_Get(0);
+	u32 first=httpReceived;
+	_bench_Check(_bench_Intact(httpErrors),"broken get");
+	if(httpResult!=WIFI_OK){
+		t+=_bench_Get(first);
+	}
+	printf("resume           %7.3f s, %lu+%lu bytes of %lu, result %d, code %u, %lu bad bytes\n",t,
+		(unsigned long)first,(unsigned long)httpReceived,(unsigned long)HttpTotalLength(),httpResult,httpCode,
+		(unsigned long)httpErrors);
+	_bench_Check(httpResult==WIFI_OK && first+httpReceived==esp_config.bodySize && _bench_Intact(httpErrors),"resume");
+	_bench_Check(httpCode==206 && _bench_Intact(HttpTotalLength()!=esp_config.bodySize),"resume total length");
+	esp_config.closeAfter=0;
+}
+
+
+static void _bench_Usage(const char* name){
+	printf("Usage: %s [options]\n"
+		"  -s seed     random seed (1)\n"
+		"  -l us       module reply latency (2000)\n"
+		"  -d rate     probability of a byte dropped on the wire (0)\n"
+		"  -n rate     probability of a byte corrupted on the wire (0)\n"
+		"  -b bytes    size of the file served (32768)\n"
+		"  -w bytes/s  server bandwidth, 0 for unlimited (0)\n"
+		"  -B baud     module rate after a reset (115200)\n"
+		"  -p cycles   cycles charged per kernel call (40)\n"
+		"  -c          serve the file with chunked encoding\n"
+		"  -r script   'COMMAND => reply' rules, as for FakeModem.py\n"
+		"  -v          print the AT dialog\n",name);
+}
+
+int main(int argc, char* argv[]){
+	const char* script=NULL;
+	double dropRate=0,noiseRate=0;
+	u32 callCycles=40;
+	int opt;
+
+	sim_Init(seed);
+	esp_Init();
+
+	while((opt=getopt(argc,argv,"s:l:d:n:b:w:B:p:cr:vh"))!=-1){
+		switch(opt){
+			case 's': seed=strtoul(optarg,NULL,0); break;
+			case 'l': esp_config.latencyUs=strtoul(optarg,NULL,0); break;
+			case 'd': dropRate=atof(optarg); break;
+			case 'n': noiseRate=atof(optarg); break;
+			case 'b': esp_config.bodySize=strtoul(optarg,NULL,0); break;
+			case 'w': esp_config.netBytesPerSec=strtoul(optarg,NULL,0); break;
+			case 'B': esp_config.defBaud=strtoul(optarg,NULL,0); break;
+			case 'p': callCycles=strtoul(optarg,NULL,0); break;
+			case 'c': esp_config.chunked=true; break;
+			case 'r': script=optarg; break;
+			case 'v': esp_config.verbose=true; break;
+			default: _bench_Usage(argv[0]); return 1;
+		}
+	}
+
+	_bench_PowerOn();
+	sim_config.callCycles=callCycles;
+	if(script!=NULL && esp_LoadScript(script)!=0){
+		printf("Cannot read %s\n",script);
+		return 1;
+	}
+
+	printf("uzenetbench: %u poll(s) per line, rx ring %u, tx ring %u, drop %g, noise %g\n",
+		sim_config.polls,UART_RX_BUFFER_SIZE,UART_TX_BUFFER_SIZE,dropRate,noiseRate);
+
+	_bench_Inits();
+	_bench_Commands();
+
+	//faults only once the link is up, the init has its own retries
+	sim_config.dropRate=dropRate;
+	sim_config.noiseRate=noiseRate;
+	_bench_Http();
+
+	printf("%d failure(s), %.3f s simulated, %lu commands, %lu requests\n",failures,sim_Seconds(),
+		(unsigned long)esp_stats.commands,(unsigned long)esp_stats.requests);
+	return failures;
+}
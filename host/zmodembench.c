@@ -0,0 +1,431 @@
+/*
+ * zmodembench.c
+ *
+ * Runs NetLoaderZ (the whole rom, built for the host) against a real ZMODEM
+ * sender, "sz -b" by default, connected through a pseudo terminal. The UART
+ * is the simulated one of kernelsim: bytes cross it at the configured rate,
+ * the mixer samples it once or twice per scanline and faults can be
+ * injected. The rom is written to NETLOAD.BIN in a FAT image file.
+ *
+ * The simulation is paced to the wall clock, so the sender's timeouts work
+ * and the times reported are those of a real Uzebox. When the loader boots
+ * the rom, the file in the image is compared with the one sent. Reports
+ * the throughput, the retransmits and the time lost to SD writes and to an
+ * idle line, and exits with 0 if the file arrived intact. Run again with
+ * the same image and EEPROM file (-i, -e) and -k, it checks that the loader
+ * skips a rom already on the card. With -c, the link breaks once the loader
+ * has written that many sectors and the run passes if it got there: a run
+ * after it must not take the rest of the file for the rom sent. The loader's
+ * NLZSTATS summary, sent on the UART after the session, is shown and must be
+ * there.
+ *
+ * Built with BENCH_WIFI=1 (netwinbench), the loader is the NETLOADERZ_WIFI=3
+ * one: its UART goes to the simulated ESP8266 (espsim), the sender is the
+ * module's TCP client and speaks NetLoader.py's windowed protocol. Faults
+ * are injected on the UART once the client is connected.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "kernelsim.h"
+#include "sdsim.h"
+#if BENCH_WIFI == 1
+	#include "espsim.h"
+	#include "netwin.h"
+	#define BENCH_NAME		"netwinbench"
+	#define BENCH_SENDER	"python3 ../NetLoader.py --stdio -i"
+#else
+	#include "zmodem.h"
+	#define BENCH_NAME		"zmodembench"
+	#define BENCH_SENDER	"sz -b"
+#endif
+
+#define BENCH_ROM_SIZE		61440	//largest rom, 60 KB
+#define BENCH_FILE_SECTORS	121		//size of default/netload.bin
+#define BENCH_WIRE_QUEUE	16		//sender bytes taken from the pty ahead of the wire (adapter FIFO)
+#define BENCH_TCP_QUEUE		1460	//same for the TCP client, one segment
+#define BENCH_SYNC_LINES	16		//scanlines between two checks of the wall clock
+
+#define BENCH_SUMMARY_SIZE	256		//longest NLZSTATS line kept
+
+#define BENCH_BOOTED		1
+#define BENCH_TIMEOUT		2
+#define BENCH_SENDER_EXIT	3
+#define BENCH_CUT			4
+
+extern int NetLoaderZ_main(void);
+
+static int master=-1;
+static pid_t sender;
+static int senderStatus=-1;
+static double senderExit;
+static u32 senderBaud;
+//Options, outside main's frame as they are read after the longjmp
+static const char* romName;
+static const char* imageName;
+static const char* eepromName;
+static bool expectSkip;
+static double limit=180;
+static u32 cutWrites;
+static bool verbose;
+static jmp_buf runJump;
+static struct timespec start;
+static double dropRate,noiseRate;
+
+//Transfer window, from the first byte of the sender to the boot
+static double firstByte=-1;
+static u32 idleLinesStart;
+
+static double _bench_Wall(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	return (now.tv_sec-start.tv_sec)+(now.tv_nsec-start.tv_nsec)/1e9;
+}
+
+//Loader's summary line, and the line the Uzebox is sending
+static char summary[BENCH_SUMMARY_SIZE],lineOut[BENCH_SUMMARY_SIZE];
+static u16 lineLen;
+
+//Keeps the last NLZSTATS line from the Uzebox. It follows the ZFIN header,
+//whose line ends with 0x8a rather than a line feed.
+static void _bench_Summary(u8 c){
+	char* p;
+
+	if(c=='\r' || c=='\n'){
+		lineOut[lineLen]=0;
+		p=strstr(lineOut,"NLZSTATS ");
+		if(p!=NULL) strcpy(summary,p+9);
+		lineLen=0;
+	}else if(lineLen<BENCH_SUMMARY_SIZE-1){
+		lineOut[lineLen++]=c;
+	}
+}
+
+//Bytes from the Uzebox to the sender
+static void _bench_Receive(u8 c){
+	_bench_Summary(c);
+	if(write(master,&c,1)!=1 && verbose) printf("pty write failed\n");
+}
+
+#if BENCH_WIFI == 1
+static void _bench_ClientReceive(const u8* data, u16 len){
+	for(u16 i=0;i<len;i++) _bench_Receive(data[i]);
+}
+
+//The sender connects as soon as the module listens, then the wire gets noisy
+static bool _bench_Connected(){
+	static bool connected;
+
+	if(!connected && esp_ClientConnect(&_bench_ClientReceive)){
+		connected=true;
+		sim_config.dropRate=dropRate;
+		sim_config.noiseRate=noiseRate;
+	}
+	return connected;
+}
+#endif
+
+static void _bench_Line(){
+	static u32 lines;
+	u8 buf[BENCH_TCP_QUEUE];
+	double ahead;
+	int status;
+	ssize_t n;
+
+#if BENCH_WIFI != 1
+	if(senderBaud==0) sim_PeerSetBaud(sim_UzeboxBaud());
+#endif
+	if(++lines%BENCH_SYNC_LINES!=0) return;
+
+	//stay behind the wall clock
+	ahead=sim_Seconds()-_bench_Wall();
+	if(ahead>0.001){
+		struct timespec wait={0,(long)(ahead*1e9)};
+		nanosleep(&wait,NULL);
+	}
+
+	//sender to wire, as fast as the line takes them
+#if BENCH_WIFI == 1
+	if(_bench_Connected() && esp_ClientPending()==0){
+		n=read(master,buf,BENCH_TCP_QUEUE);
+#else
+	if(sim_PeerPending()<BENCH_WIRE_QUEUE){
+		n=read(master,buf,BENCH_WIRE_QUEUE-sim_PeerPending());
+#endif
+		if(n>0){
+			if(firstByte<0){
+				firstByte=sim_Seconds();
+				idleLinesStart=sim_stats.idleLines;
+			}
+#if BENCH_WIFI == 1
+			esp_ClientSend(buf,n);
+#else
+			sim_PeerSend(buf,n);
+#endif
+		}
+	}
+
+	if(_bench_Wall()>limit) longjmp(runJump,BENCH_TIMEOUT);
+	if(cutWrites!=0 && sdsim_stats.writes>=cutWrites) longjmp(runJump,BENCH_CUT);
+
+	//the loader never returns, give up a little after the sender
+	if(senderStatus==-1 && waitpid(sender,&status,WNOHANG)==sender){
+		senderStatus=status;
+		senderExit=sim_Seconds();
+	}
+	if(senderStatus!=-1 && sim_Seconds()-senderExit>3 && sim_PeerPending()==0) longjmp(runJump,BENCH_SENDER_EXIT);
+}
+
+static void _bench_Boot(){
+	longjmp(runJump,BENCH_BOOTED);
+}
+
+#if BENCH_WIFI != 1
+static const SimPeer ptyPeer={_bench_Receive,_bench_Line};
+#endif
+
+//Starts the sender on the slave side of a new pty, in raw mode
+static int _bench_StartSender(const char* command, const char* fileName){
+	char* cmd;
+	int slave;
+	struct termios t;
+
+	master=posix_openpt(O_RDWR|O_NOCTTY);
+	if(master<0 || grantpt(master)!=0 || unlockpt(master)!=0) return -1;
+
+	if(asprintf(&cmd,"exec %s '%s'",command,fileName)<0) return -1;
+	sender=fork();
+	if(sender<0) return -1;
+	if(sender==0){
+		setsid();
+		slave=open(ptsname(master),O_RDWR);
+		if(slave<0) _exit(127);
+		tcgetattr(slave,&t);
+		cfmakeraw(&t);
+		tcsetattr(slave,TCSANOW,&t);
+		dup2(slave,0);
+		dup2(slave,1);
+		close(slave);
+		close(master);
+		execl("/bin/sh","sh","-c",cmd,(char*)NULL);
+		_exit(127);
+	}
+	free(cmd);
+	fcntl(master,F_SETFL,O_NONBLOCK);
+	return 0;
+}
+
+static int _bench_MakeRom(const char* fileName, u32 size, u32 seed){
+	FILE* f=fopen(fileName,"wb");
+	if(f==NULL) return -1;
+
+	//an .uze header, then noise that needs every ZMODEM escape
+	srand(seed);
+	for(u32 i=0;i<size;i++){
+		u8 c;
+		if(i<6) c="UZEBOX"[i];
+		else if(i>=14 && i<45) c=(i<30)?BENCH_NAME" rom"[i-14]:0;
+		else c=rand();
+		fputc(c,f);
+	}
+	fclose(f);
+	return 0;
+}
+
+static const char* _bench_Result(int r){
+	switch(r){
+		case BENCH_BOOTED: return "booted";
+		case BENCH_TIMEOUT: return "timeout";
+		case BENCH_CUT: return "cut";
+		default: return "stopped";
+	}
+}
+
+static void _bench_Usage(const char* name){
+	printf("Usage: %s [options]\n"
+		"  -f rom      file to send (a random %u byte rom)\n"
+		"  -x command  sender, the file name is appended (\""BENCH_SENDER"\")\n"
+		"  -i image    FAT image with a NETLOAD.BIN to use, made if missing (a temporary one)\n"
+		"  -e file     EEPROM blocks kept between runs (none)\n"
+		"  -k          fail unless the loader skips the rom, as on the card already\n"
+		"  -c n        break the link after n sector writes, fail unless it gets there\n"
+		"  -F          make the new image with a fragmented NETLOAD.BIN\n"
+		"  -b baud     sender rate, 0 for the loader's (0)\n"
+		"  -d rate     probability of a byte dropped on the wire (0)\n"
+		"  -n rate     probability of a byte corrupted on the wire (0)\n"
+		"  -w us       sector write time (1500)\n"
+		"  -W n,us     one write in n takes us (64,10000)\n"
+		"  -s seed     random seed (1)\n"
+		"  -t seconds  give up after this (180)\n"
+		"  -v          verbose\n",name,BENCH_ROM_SIZE);
+}
+
+int main(int argc, char* argv[]){
+	const char* command=BENCH_SENDER;
+	char romTemp[]="/tmp/"BENCH_NAME"-rom-XXXXXX";
+	char imageTemp[]="/tmp/"BENCH_NAME"-img-XXXXXX";
+	bool fragmented=false,skipped;
+	double t;
+	u32 seed=1,size;
+	u8 *sent,*stored;
+	long fileSize;
+	int opt,r,fd;
+	bool intact;
+	FILE* f;
+
+	sdsim_Init();
+
+	while((opt=getopt(argc,argv,"f:x:i:e:kc:Fb:d:n:w:W:s:t:vh"))!=-1){
+		switch(opt){
+			case 'f': romName=optarg; break;
+			case 'x': command=optarg; break;
+			case 'i': imageName=optarg; break;
+			case 'e': eepromName=optarg; break;
+			case 'k': expectSkip=true; break;
+			case 'c': cutWrites=strtoul(optarg,NULL,0); break;
+			case 'F': fragmented=true; break;
+			case 'b': senderBaud=strtoul(optarg,NULL,0); break;
+			case 'd': dropRate=atof(optarg); break;
+			case 'n': noiseRate=atof(optarg); break;
+			case 'w': sdsim_config.writeUs=strtoul(optarg,NULL,0); break;
+			case 'W': sscanf(optarg,"%u,%u",&sdsim_config.slowEvery,&sdsim_config.slowUs); break;
+			case 's': seed=strtoul(optarg,NULL,0); break;
+			case 't': limit=atof(optarg); break;
+			case 'v': verbose=true; break;
+			default: _bench_Usage(argv[0]); return 2;
+		}
+	}
+
+	if(romName==NULL){
+		fd=mkstemp(romTemp);
+		if(fd<0 || _bench_MakeRom(romTemp,BENCH_ROM_SIZE,seed)!=0) return 2;
+		close(fd);
+		romName=romTemp;
+	}
+	if(imageName==NULL){
+		fd=mkstemp(imageTemp);
+		if(fd<0 || sdsim_Format(imageTemp,BENCH_FILE_SECTORS,fragmented)!=0) return 2;
+		close(fd);
+	}else if(access(imageName,F_OK)!=0){
+		if(sdsim_Format(imageName,BENCH_FILE_SECTORS,fragmented)!=0) return 2;
+	}else if(sdsim_Open(imageName)!=0){
+		printf("Cannot open %s\n",imageName);
+		return 2;
+	}
+
+	f=fopen(romName,"rb");
+	if(f==NULL){
+		printf("Cannot read %s\n",romName);
+		return 2;
+	}
+	fseek(f,0,SEEK_END);
+	size=ftell(f);
+	rewind(f);
+	sent=malloc(size);
+	stored=calloc(size,1);
+	if(fread(sent,1,size,f)!=size) return 2;
+	fclose(f);
+
+	signal(SIGPIPE,SIG_IGN);
+	if(_bench_StartSender(command,romName)!=0){
+		printf("Cannot start %s\n",command);
+		return 2;
+	}
+
+	sim_Init(seed);
+	if(eepromName!=NULL) sim_EepromLoad(eepromName);
+#if BENCH_WIFI == 1
+	esp_Init();
+	esp_config.verbose=verbose;
+	esp_SetLineFunc(&_bench_Line);
+#else
+	sim_SetPeer(&ptyPeer);
+	if(senderBaud!=0) sim_PeerSetBaud(senderBaud);
+	sim_config.dropRate=dropRate;
+	sim_config.noiseRate=noiseRate;
+#endif
+	sdsim_SetBootFunc(&_bench_Boot);
+	clock_gettime(CLOCK_MONOTONIC,&start);
+
+	printf(BENCH_NAME": %s, %lu bytes, %u poll(s) per line, drop %g, noise %g\n",command,(unsigned long)size,
+		sim_config.polls,dropRate,noiseRate);
+
+	r=setjmp(runJump);
+	if(r==0) NetLoaderZ_main();
+
+	t=(firstByte<0)?0:sim_Seconds()-firstByte;
+	//the sender exits once it has read the loader's ZFIN, give it a moment
+	for(int i=0;i<100 && senderStatus==-1;i++){
+		if(waitpid(sender,&senderStatus,WNOHANG)==sender) break;
+		senderStatus=-1;
+		usleep(20000);
+	}
+	if(senderStatus==-1){
+		kill(sender,SIGTERM);
+		waitpid(sender,&senderStatus,0);
+	}
+
+	fileSize=sdsim_ReadFile("NETLOAD.BIN",stored,size);
+	intact=(r==BENCH_BOOTED && fileSize>=(long)size && memcmp(sent,stored,size)==0);
+#if BENCH_WIFI == 1
+	skipped=(r==BENCH_BOOTED && nw_stats.bytes<size);
+#else
+	skipped=(r==BENCH_BOOTED && zm_stats.bytes<size);
+#endif
+
+#if BENCH_WIFI == 1
+	printf("%-8s %7.3f s, %lu bytes, %.0f bytes/s at %lu bauds\n",_bench_Result(r),
+		t,(unsigned long)nw_stats.bytes,(t>0)?nw_stats.bytes/t:0,(unsigned long)sim_PeerBaud());
+	printf("netwin   %u frames, %u acks, %u go backs, %u CRC errors, %u timeouts\n",nw_stats.frames,nw_stats.acks,
+		nw_stats.naks,nw_stats.crcErrors,nw_stats.timeouts);
+#else
+	printf("%-8s %7.3f s, %lu bytes, %.0f bytes/s at %lu bauds\n",_bench_Result(r),
+		t,(unsigned long)zm_stats.bytes,(t>0)?zm_stats.bytes/t:0,(unsigned long)sim_PeerBaud());
+	printf("zmodem   %u frames, %u retransmits, %u CRC errors, %u timeouts\n",zm_stats.frames,zm_stats.retransmits,
+		zm_stats.crcErrors,zm_stats.timeouts);
+#endif
+	printf("stalls   %.3f s SD busy (%lu writes, worst %.1f ms), %.3f s line idle\n",sdsim_stats.busy,
+		(unsigned long)sdsim_stats.writes,sdsim_stats.worstUs/1000.0,(sim_stats.idleLines-idleLinesStart)/SIM_LINE_RATE);
+	printf("uart     %lu bytes in, %lu out, %lu overruns, %lu drops, %lu frame errors, %lu wire faults, peak %u\n",
+		(unsigned long)sim_stats.rxBytes,(unsigned long)sim_stats.txBytes,(unsigned long)sim_stats.overruns,
+		(unsigned long)sim_stats.drops,(unsigned long)sim_stats.frameErrors,(unsigned long)sim_stats.wireDrops,sim_stats.peak);
+	if(WIFEXITED(senderStatus)){
+		printf("sender   exit %d\n",WEXITSTATUS(senderStatus));
+	}else{
+		printf("sender   killed\n");
+	}
+	if(skipped) printf("skipped  the rom was on the card already\n");
+#if BENCH_WIFI != 1
+	printf("summary  %s\n",summary[0]?summary:"none");
+#endif
+	if(cutWrites!=0){
+		printf("%s\n",(r==BENCH_CUT)?"link broken, file left incomplete":"FAIL: the link was not broken");
+		intact=(r==BENCH_CUT);
+	}else{
+		printf("%s\n",intact?"file intact":"FAIL: file differs");
+	}
+#if BENCH_WIFI != 1
+	if(r==BENCH_BOOTED && summary[0]==0){
+		printf("FAIL: no NLZSTATS summary from the loader\n");
+		intact=false;
+	}
+#endif
+	if(expectSkip && !skipped){
+		printf("FAIL: the rom was sent again\n");
+		intact=false;
+	}
+	if(eepromName!=NULL) sim_EepromSave(eepromName);
+
+	sdsim_Close();
+	if(romName==romTemp) unlink(romTemp);
+	if(imageName==NULL) unlink(imageTemp);
+	return intact?0:1;
+}
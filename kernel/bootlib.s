@@ -235,7 +235,7 @@ SD_CRC7_Byte_blk:
 
 
 /*
-** Slow (but small: no table) CRC16 calculation for SD Card commands.
+** Fast (no table, constant time) CRC16 calculation for SD Card sectors.
 **
 ** Calculation must start with 0x0000 CRC value.
 **
@@ -254,26 +254,44 @@ SD_CRC7_Byte_blk:
 SDC_CRC16_Byte:
 
 	rcall bootlib_hasloader
-	brcc  .+4
+	brcc  sdlib_crc16_byte
 	jmp   BL_SD_CRC16_Byte
 
-	eor   r25,     r22     ; crcval ^= (byte << 8)
-	ldi   r22,     0x21
-	ldi   r23,     0x10    ; CRC16 polynomial (0x1021)
-	rcall SD_CRC16_Byte_blk
-	rcall SD_CRC16_Byte_blk
-	rcall SD_CRC16_Byte_blk
-	rcall SD_CRC16_Byte_blk
-	rcall SD_CRC16_Byte_blk
-	rcall SD_CRC16_Byte_blk
-	rcall SD_CRC16_Byte_blk
-
-SD_CRC16_Byte_blk:
-	lsl   r24
-	rol   r25
-	brcc  .+4
-	eor   r24,     r22
-	eor   r25,     r23
+
+
+/*
+** Internal CRC16 (0x1021) byte update used within the sector transfer loops.
+** It takes 17 cycles + call overhead, so it completes well within a single
+** SPI byte transfer, allowing to interleave it with the data shifting out or
+** in without slowing down the transfer.
+**
+** Inputs:
+** r25:r24: CRC value
+**     r22: Byte to add to the calculation
+** Outputs:
+** r25:r24: Resulting CRC value
+** Clobbers:
+** r22, r23
+*/
+sdlib_crc16_byte:
+
+	eor   r22,     r25     ; x = (crcval >> 8) ^ byte
+	mov   r25,     r22
+	swap  r25
+	andi  r25,     0x0F
+	eor   r22,     r25     ; x ^= (x >> 4)
+	mov   r25,     r24     ; crcval <<= 8
+	mov   r23,     r22
+	swap  r23
+	andi  r23,     0xF0
+	eor   r25,     r23     ; crcval ^= (x << 12)
+	lsl   r23
+	mov   r24,     r23
+	eor   r24,     r22     ; crcval ^= (x << 5) (low part) ^ x
+	lsr   r22
+	lsr   r22
+	lsr   r22
+	eor   r25,     r22     ; crcval ^= (x << 5) (high part)
 	ret
 
 
@@ -802,7 +820,7 @@ SD_Read_Sector_l:
 	sbc   r0,      r0
 	out   SPI_DR,  r0
 	st    Z+,      r22     ; Store byte
-	rcall SDC_CRC16_Byte
+	rcall sdlib_crc16_byte ; CRC while the next byte is shifting in
 	rcall sdlib_wait_spi
 	cp    ZL,      r20
 	cpc   ZH,      r21
@@ -916,7 +934,7 @@ SD_Write_Sector_l:
 	ld    r22,     Z+
 	rcall sdlib_wait_spi
 	out   SPI_DR,  r22
-	rcall SDC_CRC16_Byte
+	rcall sdlib_crc16_byte ; CRC while the byte is shifting out
 	cp    ZL,      r20
 	cpc   ZH,      r21
 	brcs  SD_Write_Sector_l
@@ -197,15 +197,83 @@
 	 * Define the UART receive buffer size. Must be a power of 2.
 	 * Not supported with video mode 2.
 	 *
-	 * 0 = no
-	 * 1 = yes
+	 * Up to 256 bytes the ring uses 8 bit indexes. Larger sizes (512 to 2048)
+	 * switch to 16 bit indexes, which costs the inline mixer 2 more cycles
+	 * per scanline.
 	 */
 	#ifndef UART_RX_BUFFER_SIZE
 		#define UART_RX_BUFFER_SIZE 0
 	#else
-		#if UART_RX_BUFFER_SIZE % 2 != 0
+		#if (UART_RX_BUFFER_SIZE & (UART_RX_BUFFER_SIZE - 1)) != 0
 			#error Invalid size for UART_RX_BUFFER_SIZE: must be a power of 2.
 		#endif
+		#if UART_RX_BUFFER_SIZE > 2048
+			#error Invalid size for UART_RX_BUFFER_SIZE: must not exceed 2048.
+		#endif
+	#endif
+
+	#if UART_RX_BUFFER_SIZE > 256
+		#define UART_RX_INDEX_16BIT 1
+	#else
+		#define UART_RX_INDEX_16BIT 0
+	#endif
+
+	/*
+	 * Counts UART framing errors, data overruns and bytes dropped because
+	 * the receive ring was full, and tracks the peak ring occupancy. Read
+	 * them with UartGetStats(). Costs the inline mixer 29 more cycles per
+	 * scanline (31 with a 16 bit ring index).
+	 *
+	 * 0 = no
+	 * 1 = yes
+	 */
+	#ifndef UART_STATS
+		#define UART_STATS 0
+	#endif
+
+	/*
+	 * Polls the UART receiver twice per scanline instead of once. The
+	 * USART holds two received bytes, so this takes up to two bytes per
+	 * line (about 314 kbaud) and makes 230400 bauds sustainable, where a
+	 * single poll loses bytes above about 157 kbaud. Costs the inline
+	 * mixer 34 more cycles per scanline (more with a 16 bit ring index or
+	 * UART_STATS), which only fits video modes with enough free cycles.
+	 *
+	 * 0 = no
+	 * 1 = yes
+	 */
+	#ifndef UART_RX_DUAL_POLL
+		#define UART_RX_DUAL_POLL 0
+	#endif
+
+	//Extra inline mixer cycles of the UART receive options, per poll
+	#if UART_RX_INDEX_16BIT == 1 && UART_STATS == 1
+		#define UART_RX_POLL_EXTRA_CYCLES 33
+	#elif UART_RX_INDEX_16BIT == 1
+		#define UART_RX_POLL_EXTRA_CYCLES 2
+	#elif UART_STATS == 1
+		#define UART_RX_POLL_EXTRA_CYCLES 29
+	#else
+		#define UART_RX_POLL_EXTRA_CYCLES 0
+	#endif
+
+	//The second poll is a 20 cycle poll plus 14 cycles to call both as a routine
+	#if UART_RX_DUAL_POLL == 1
+		#define UART_RX_EXTRA_CYCLES ((2 * UART_RX_POLL_EXTRA_CYCLES) + 20 + 14)
+	#else
+		#define UART_RX_EXTRA_CYCLES UART_RX_POLL_EXTRA_CYCLES
+	#endif
+
+	/*
+	 * Smallest UBRR0L value (double speed mode) the receiver keeps up with,
+	 * for drivers that pick the UART rate of a device, like uzenet. Leaves
+	 * 5% of the polls free: 23 = 149148 bauds with one poll per line,
+	 * 11 = 298295 bauds with UART_RX_DUAL_POLL.
+	 */
+	#if UART_RX_DUAL_POLL == 1
+		#define UART_RX_MIN_UBRR 11
+	#else
+		#define UART_RX_MIN_UBRR 23
 	#endif
 
 	/*
@@ -223,6 +291,34 @@
 		#endif
 	#endif
 
+	/*
+	 * Returns a running game to the rom loader, for development: holding
+	 * LOADER_RETURN_BUTTONS or a break on the UART RX line (held low for
+	 * LOADER_RETURN_BREAK_FRAMES frames without a byte coming in) makes
+	 * the next WaitVsync() boot LOADER_RETURN_FILE from the SD card. The
+	 * game may also call ReturnToLoader() itself. Needs bootlib.o linked.
+	 *
+	 * 0 = no
+	 * 1 = yes
+	 */
+	#ifndef LOADER_RETURN
+		#define LOADER_RETURN 0
+	#endif
+
+	//File name of the loader on the card, 8.3 without the dot, space padded
+	#ifndef LOADER_RETURN_FILE
+		#define LOADER_RETURN_FILE "NETLOADZUZE"
+	#endif
+
+	#ifndef LOADER_RETURN_BUTTONS
+		#define LOADER_RETURN_BUTTONS (BTN_START+BTN_SELECT+BTN_A+BTN_B)
+	#endif
+
+	//The shortest break taken, 100 ms. A byte of zeros keeps the line low 0.16 ms at 57600 bauds.
+	#ifndef LOADER_RETURN_BREAK_FRAMES
+		#define LOADER_RETURN_BREAK_FRAMES 6
+	#endif
+
 	/*
 	 * Screen center adjustment for mode 1 only.
 	 * Useful if your game field absolutely needs a non-even width.
@@ -451,8 +547,8 @@
 			#define CHANNELS WAVE_CHANNELS+NOISE_CHANNELS+PCM_CHANNELS
 			
 			#if UART == 1
-				#define AUDIO_OUT_HSYNC_CYCLES (232)
-				#define AUDIO_OUT_VSYNC_CYCLES (232)
+				#define AUDIO_OUT_HSYNC_CYCLES (232 + UART_RX_EXTRA_CYCLES)
+				#define AUDIO_OUT_VSYNC_CYCLES (232 + UART_RX_EXTRA_CYCLES)
 			#else
 				#define AUDIO_OUT_HSYNC_CYCLES (189)
 				#define AUDIO_OUT_VSYNC_CYCLES (189)
@@ -462,8 +558,8 @@
 			#define CHANNELS WAVE_CHANNELS+NOISE_CHANNELS
 			
 			#if UART == 1
-				#define AUDIO_OUT_HSYNC_CYCLES (187)
-				#define AUDIO_OUT_VSYNC_CYCLES (187)
+				#define AUDIO_OUT_HSYNC_CYCLES (187 + UART_RX_EXTRA_CYCLES)
+				#define AUDIO_OUT_VSYNC_CYCLES (187 + UART_RX_EXTRA_CYCLES)
 			#else
 				#define AUDIO_OUT_HSYNC_CYCLES (144)
 				#define AUDIO_OUT_VSYNC_CYCLES (144)
@@ -510,6 +606,8 @@
 	#define SYNC_PRE_EQ_PULSES 6
 	#define SYNC_EQ_PULSES 6
 	#define SYNC_POST_EQ_PULSES 6
+	#define SCANLINES_PER_FRAME (SYNC_HSYNC_PULSES + ((SYNC_PRE_EQ_PULSES+SYNC_EQ_PULSES+SYNC_POST_EQ_PULSES)/2))
+	#define SCANLINE_COUNTER_WRAP (65536UL*SCANLINES_PER_FRAME)	//GetScanlineCounter() period
 
 	#define SYNC_FLAG_VSYNC			1
 	#define SYNC_FLAG_FIELD			2
@@ -592,7 +690,7 @@
 
 	#ifdef HSYNC_USABLE_CYCLES 
 		#if HSYNC_USABLE_CYCLES - AUDIO_OUT_HSYNC_CYCLES <0
-			#error There is not enough CPU cycles to support the build options. Disable the UART (-DUART=0), audio channel 5 (-DSOUND_CHANNEL_5_ENABLE=0) or the inline mixer (-DSOUND_MIXER=0).
+			#error There is not enough CPU cycles to support the build options. Disable the UART (-DUART=0) or its UART_STATS / UART_RX_DUAL_POLL options, audio channel 5 (-DSOUND_CHANNEL_5_ENABLE=0) or the inline mixer (-DSOUND_MIXER=0).
 		#endif 
 	#endif
 
@@ -0,0 +1,100 @@
+/*-----------------------------------------------------------------------*/
+/* FatFs disk I/O over the kernel SD block layer (sdblock.c)             */
+/*-----------------------------------------------------------------------*/
+/* Link this instead of fatfs/mmc.c (together with sdblock.o and          */
+/* bootlib.o) to share the SD command code with the other SD front ends   */
+/* of the game. FatFs reads and writes its own window (FATFS.win), so     */
+/* build sdblock.c with SDB_CACHE=0 unless bootlib FS_* code shares its   */
+/* sector cache.                                                          */
+/*-----------------------------------------------------------------------*/
+
+#include <avr/io.h>
+#include <sdblock.h>
+#include "diskio.h"
+
+
+static
+DSTATUS Stat = STA_NOINIT;	/* Disk status */
+
+
+
+DSTATUS disk_initialize (
+	BYTE pdrv		/* Physical drive nmuber (0) */
+)
+{
+	if (pdrv) return STA_NOINIT;		/* Supports only single drive */
+	if (SDB_Init() == 0) {
+		Stat &= ~STA_NOINIT;
+	} else {
+		Stat |= STA_NOINIT;
+	}
+	return Stat;
+}
+
+
+
+DSTATUS disk_status (
+	BYTE pdrv		/* Physical drive nmuber (0) */
+)
+{
+	if (pdrv) return STA_NOINIT;	/* Supports only single drive */
+	return Stat;
+}
+
+
+
+DRESULT disk_read (
+	BYTE pdrv,			/* Physical drive nmuber (0) */
+	BYTE *buff,			/* Pointer to the data buffer to store read data */
+	DWORD sector,		/* Start sector number (LBA) */
+	BYTE count			/* Sector count (1..255) */
+)
+{
+	if (pdrv || !count) return RES_PARERR;
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+
+	return SDB_Read_Blocks(sector, buff, count) ? RES_ERROR : RES_OK;
+}
+
+
+
+#if _USE_WRITE
+DRESULT disk_write (
+	BYTE pdrv,			/* Physical drive nmuber (0) */
+	const BYTE *buff,	/* Pointer to the data to be written */
+	DWORD sector,		/* Start sector number (LBA) */
+	BYTE count			/* Sector count (1..255) */
+)
+{
+	if (pdrv || !count) return RES_PARERR;
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+
+	return SDB_Write_Blocks(sector, buff, count) ? RES_ERROR : RES_OK;
+}
+#endif
+
+
+
+#if _USE_IOCTL
+DRESULT disk_ioctl (
+	BYTE pdrv,		/* Physical drive nmuber (0) */
+	BYTE cmd,		/* Control code */
+	void *buff		/* Buffer to send/receive data block */
+)
+{
+	if (pdrv) return RES_PARERR;
+	if (Stat & STA_NOINIT) return RES_NOTRDY;
+
+	switch (cmd) {
+	case CTRL_SYNC :		/* Writes are completed before returning */
+		return RES_OK;
+
+	case MMC_GET_TYPE :		/* Get card type flags (1 byte) */
+		*(BYTE*)buff = (SDB_Struct()->flags & SDC_FLAGS_SDHC) ? (CT_SD2 | CT_BLOCK) : CT_SD2;
+		return RES_OK;
+
+	default:
+		return RES_PARERR;
+	}
+}
+#endif
@@ -3265,6 +3265,84 @@ FRESULT f_truncate (
 
 
 
+#if _USE_EXPAND
+/*-----------------------------------------------------------------------*/
+/* Allocate a Contiguous Blocks to the File                              */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_expand (
+	FIL* fp,		/* Pointer to the file object */
+	DWORD fsz,		/* File size to be expanded to */
+	BYTE opt		/* Operation mode 0:Find and prepare or 1:Find and allocate */
+)
+{
+	FRESULT res;
+	FATFS *fs;
+	DWORD n, clst, stcl, scl, ncl, tcl, lclst = 0;
+
+
+	res = validate(fp);						/* Check validity of the object */
+	fs = fp->fs;
+	if (res != FR_OK) LEAVE_FF(fs, res);
+	if (fp->flag & FA__ERROR)				/* Check abort flag */
+		LEAVE_FF(fs, FR_INT_ERR);
+	if (!fsz || fp->fsize || !(fp->flag & FA_WRITE))	/* Only an empty file opened in write mode */
+		LEAVE_FF(fs, FR_DENIED);
+
+	n = (DWORD)fs->csize * SS(fs);			/* Cluster size */
+	tcl = fsz / n + ((fsz & (n - 1)) ? 1 : 0);	/* Number of clusters required */
+	stcl = fs->last_clust;					/* Search from the last allocated cluster */
+	if (stcl < 2 || stcl >= fs->n_fatent) stcl = 2;
+	scl = clst = stcl; ncl = 0;
+	for (;;) {								/* Find a contiguous cluster block */
+		n = get_fat(fs, clst);
+		if (n == 1) { res = FR_INT_ERR; break; }
+		if (n == 0xFFFFFFFF) { res = FR_DISK_ERR; break; }
+		if (n == 0) {						/* A free cluster: extend the block */
+			if (++ncl == tcl) break;
+		} else {							/* Not free: restart the block after it */
+			scl = clst + 1; ncl = 0;
+		}
+		if (++clst >= fs->n_fatent) {		/* Wrap around, a block can not span the end */
+			clst = 2; scl = 2; ncl = 0;
+		}
+		if (clst == stcl) { res = FR_DENIED; break; }	/* No contiguous block found */
+	}
+
+	if (res == FR_OK) {
+		if (opt) {							/* Allocate the block as a chain */
+			for (clst = scl, n = tcl; n; clst++, n--) {
+				res = put_fat(fs, clst, (n == 1) ? 0x0FFFFFFF : clst + 1);
+				if (res != FR_OK) break;
+				lclst = clst;
+			}
+		} else {							/* Only set the next allocation point */
+			lclst = scl - 1;
+		}
+	}
+
+	if (res == FR_OK) {
+		fs->last_clust = lclst;
+		if (opt) {
+			fp->sclust = scl;				/* Set the chain to the file, top of the file is not changed */
+			fp->fsize = fsz;
+			fp->flag |= FA__WRITTEN;
+			if (fs->free_clust != 0xFFFFFFFF) {
+				fs->free_clust -= tcl;
+				fs->fsi_flag = 1;
+			}
+		}
+	} else {
+		fp->flag |= FA__ERROR;
+	}
+
+	LEAVE_FF(fs, res);
+}
+#endif /* _USE_EXPAND */
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Delete a File or Directory                                            */
 /*-----------------------------------------------------------------------*/
@@ -4323,3 +4401,18 @@ int f_printf (
 
 #endif /* !_FS_READONLY */
 #endif /* _USE_STRFUNC */
+
+
+
+#if !_FS_READONLY
+/*-----------------------------------------------------------------------*/
+/* Default Time Stamp (override it if the system has a real time clock)  */
+/*-----------------------------------------------------------------------*/
+
+__attribute__((weak)) DWORD get_fattime (void)
+{
+	return	  ((DWORD)(2026 - 1980) << 25)	/* Year 2026 */
+			| ((DWORD)1 << 21)				/* Month 1 */
+			| ((DWORD)1 << 16);				/* Day 1, 00:00:00 */
+}
+#endif /* !_FS_READONLY */
@@ -215,6 +215,7 @@ FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data t
 FRESULT f_getfree (const TCHAR* path, DWORD* nclst, FATFS** fatfs);	/* Get number of free clusters on the drive */
 FRESULT f_truncate (FIL* fp);										/* Truncate file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of a writing file */
+FRESULT f_expand (FIL* fp, DWORD fsz, BYTE opt);					/* Allocate a contiguous block to the file */
 FRESULT f_unlink (const TCHAR* path);								/* Delete an existing file or directory */
 FRESULT	f_mkdir (const TCHAR* path);								/* Create a new directory */
 FRESULT f_chmod (const TCHAR* path, BYTE value, BYTE mask);			/* Change attribute of the file/dir */
@@ -10,6 +10,38 @@
 #define _FFCONF 82786	/* Revision ID */
 
 
+/*---------------------------------------------------------------------------/
+/ Kernel Profiles
+/----------------------------------------------------------------------------*/
+
+#ifndef FATFS_PROFILE
+	#define FATFS_PROFILE	0	/* 0:Read only or 1:Read/Write with fast seek */
+#endif
+/* The FATFS_PROFILE option selects a preset for the options below. Any of
+/  them can still be overridden on the command line.
+/
+/   0: Read only, minimized. Smallest code, the kernel default.
+/   1: Read/Write, full function, with fast seek (_USE_FASTSEEK) and
+/      contiguous allocation (f_expand). Files pre-allocated with f_expand
+/      can be written and randomly accessed through a CLMT held in RAM
+/      without walking the FAT on every seek. */
+
+#if FATFS_PROFILE == 1
+	#ifndef _FS_READONLY
+		#define _FS_READONLY	0
+	#endif
+	#ifndef _FS_MINIMIZE
+		#define _FS_MINIMIZE	0
+	#endif
+	#ifndef _USE_FASTSEEK
+		#define _USE_FASTSEEK	1
+	#endif
+	#ifndef _USE_EXPAND
+		#define _USE_EXPAND		1
+	#endif
+#endif
+
+
 /*---------------------------------------------------------------------------/
 / Functions and Buffer Configurations
 /----------------------------------------------------------------------------*/
@@ -54,6 +86,11 @@
 #endif
 /* To enable fast seek feature, set _USE_FASTSEEK to 1. */
 
+#ifndef _USE_EXPAND
+	#define	_USE_EXPAND		0	/* 0:Disable or 1:Enable */
+#endif
+/* To enable f_expand function, set _USE_EXPAND to 1 and set _FS_READONLY to 0 */
+
 #ifndef _USE_LABEL
 	#define _USE_LABEL		0	/* 0:Disable or 1:Enable */
 #endif
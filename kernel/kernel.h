@@ -244,4 +244,16 @@
 		unsigned char data[30];		
 	};
 
+	struct UartStatsStruct{
+		//line errors reported by the UART (saturate at 255)
+		u8 frameErrors;
+		u8 overruns;
+
+		//bytes lost because the receive ring was full (saturates at 255)
+		u8 drops;
+
+		//highest receive ring occupancy seen by the Uart read functions
+		u16 peak;
+	};
+
 #endif
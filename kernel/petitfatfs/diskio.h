@@ -25,6 +25,7 @@ typedef enum {
 
 DSTATUS disk_initialize (void);
 DRESULT disk_readp (BYTE*, DWORD, WORD, WORD);
+DRESULT disk_readm (void (*)(BYTE), DWORD, WORD, DWORD);
 DRESULT disk_writep (const BYTE*, DWORD);
 
 #define STA_NOINIT		0x01	/* Drive not initialized */
@@ -0,0 +1,104 @@
+/*-------------------------------------------------------------------------*/
+/* PFF - Disk I/O over the kernel SD block layer (sdblock.c)               */
+/*-------------------------------------------------------------------------*/
+/* Link this instead of petitfatfs/mmc.c (together with sdblock.o and       */
+/* bootlib.o). Partial sector reads are served from the shared sector cache */
+/* so consecutive directory and FAT accesses within a sector don't go to    */
+/* the card again.                                                          */
+/*-------------------------------------------------------------------------*/
+
+#include <string.h>
+#include <avr/io.h>
+#include <sdblock.h>
+#include "pff.h"
+#include "diskio.h"
+
+
+#define	FORWARD(d)	SPDR = (d); while (!(SPSR & (1<<SPIF)))	/* Data forwarding function */
+
+#ifndef _PF_USE_WRITE
+	#define _PF_USE_WRITE	_FS_USE_WRITE
+#endif
+
+#if _PF_USE_WRITE
+static DWORD wsect;		/* Sector being written */
+static WORD  wc;		/* Bytes already in the cache for it */
+#endif
+
+
+
+DSTATUS disk_initialize (void)
+{
+	return SDB_Init() ? STA_NOINIT : 0;
+}
+
+
+
+DRESULT disk_readp (
+	BYTE *buff,		/* Pointer to the read buffer (NULL:Read bytes are forwarded to the stream) */
+	DWORD lba,		/* Sector number (LBA) */
+	WORD ofs,		/* Byte offset to read from (0..511) */
+	WORD cnt		/* Number of bytes to read (ofs + cnt mus be <= 512) */
+)
+{
+	BYTE *p = SDB_Read(lba);
+
+	if (!p) return RES_ERROR;
+	p += ofs;
+
+	if (buff) {		/* Store data to the memory */
+		memcpy(buff, p, cnt);
+	} else {		/* Forward data to the outgoing stream */
+		do {
+			FORWARD(*p++);
+		} while (--cnt);
+	}
+
+	return RES_OK;
+}
+
+
+
+
+#if _FS_USE_STREAM
+DRESULT disk_readm (
+	void (*func)(BYTE),	/* Pointer to the function receiving the data bytes */
+	DWORD lba,		/* Sector number (LBA) of the first sector */
+	WORD ofs,		/* Byte offset to read from in the first sector (0..511) */
+	DWORD cnt		/* Number of bytes to read */
+)
+{
+	return SDB_Read_Stream(lba, ofs, cnt, func) ? RES_ERROR : RES_OK;
+}
+#endif
+
+
+#if _PF_USE_WRITE
+DRESULT disk_writep (
+	const BYTE *buff,	/* Pointer to the bytes to be written (NULL:Initiate/Finalize sector write) */
+	DWORD sa			/* Number of bytes to send, Sector number (LBA) or zero */
+)
+{
+	BYTE *p = SDB_Struct()->bufp;
+	WORD bc;
+
+	if (buff) {		/* Collect data bytes in the cache */
+		bc = (WORD)sa;
+		if (bc > (512 - wc)) bc = 512 - wc;
+		memcpy(p + wc, buff, bc);
+		wc += bc;
+		return RES_OK;
+	}
+
+	if (sa) {		/* Initiate sector write process */
+		SDB_Invalidate();
+		wsect = sa;
+		wc = 0;
+		return RES_OK;
+	}
+
+	/* Finalize sector write process, left bytes are filled with zeros */
+	memset(p + wc, 0, 512 - wc);
+	return SDB_Write(wsect) ? RES_ERROR : RES_OK;
+}
+#endif
@@ -43,8 +43,10 @@ extern void WaitUs(unsigned int delay);
 #define CMD1	(0x40+1)	/* SEND_OP_COND (MMC) */
 #define	ACMD41	(0xC0+41)	/* SEND_OP_COND (SDC) */
 #define CMD8	(0x40+8)	/* SEND_IF_COND */
+#define CMD12	(0x40+12)	/* STOP_TRANSMISSION */
 #define CMD16	(0x40+16)	/* SET_BLOCKLEN */
 #define CMD17	(0x40+17)	/* READ_SINGLE_BLOCK */
+#define CMD18	(0x40+18)	/* READ_MULTIPLE_BLOCK */
 #define CMD24	(0x40+24)	/* WRITE_BLOCK */
 #define CMD55	(0x40+55)	/* APP_CMD */
 #define CMD58	(0x40+58)	/* READ_OCR */
@@ -159,6 +161,8 @@ BYTE send_cmd (
 	if (cmd == CMD8) n = 0x87;			/* Valid CRC for CMD8(0x1AA) */
 	xmit_spi(n);
 
+	if (cmd == CMD12) rcv_spi();		/* Skip a stuff byte when stop reading */
+
 	/* Receive a command response */
 	n = 10;								/* Wait for a valid response in timeout of 10 attempts */
 	do {
@@ -304,6 +308,70 @@ DRESULT disk_readp (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Read sectors into a stream                                            */
+/*-----------------------------------------------------------------------*/
+
+#if _FS_USE_STREAM
+DRESULT disk_readm (
+	void (*func)(BYTE),	/* Pointer to the function receiving the data bytes */
+	DWORD lba,		/* Sector number (LBA) of the first sector */
+	WORD ofs,		/* Byte offset to read from in the first sector (0..511) */
+	DWORD cnt		/* Number of bytes to read */
+)
+{
+	DRESULT res;
+	BYTE rc, cmd;
+	WORD bc;
+	DWORD nsect;
+
+
+	nsect = (ofs + cnt + 511) / 512;			/* Number of sectors to read */
+	cmd = (nsect > 1) ? CMD18 : CMD17;
+
+	if (!(CardType & CT_BLOCK)) lba *= 512;		/* Convert to byte address if needed */
+
+	res = RES_ERROR;
+	if (send_cmd(cmd, lba) == 0) {		/* READ_MULTIPLE_BLOCK or READ_SINGLE_BLOCK */
+		do {
+			bc = 40000;
+			do {						/* Wait for data packet */
+				rc = rcv_spi();
+			} while (rc == 0xFF && --bc);
+			if (rc != 0xFE) break;
+
+			bc = 512;
+			do {						/* Forward the requested part of the sector */
+				rc = rcv_spi();
+				if (ofs) {
+					ofs--;
+				} else if (cnt) {
+					func(rc);
+					cnt--;
+				}
+			} while (--bc);
+
+			rcv_spi(); rcv_spi();		/* Skip CRC */
+		} while (--nsect);
+
+		if (!nsect) res = RES_OK;
+
+		if (cmd == CMD18) {				/* Stop transmission and wait for end of busy state */
+			send_cmd(CMD12, 0);
+			for (bc = 5000; rcv_spi() != 0xFF && bc; bc--) dly_100us();
+			if (!bc) res = RES_ERROR;
+		}
+	}
+
+	DESELECT();
+	rcv_spi();
+
+	return res;
+}
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Write partial sector                                                  */
 /*-----------------------------------------------------------------------*/
@@ -940,6 +940,69 @@ fr_abort:
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Stream File                                                           */
+/*-----------------------------------------------------------------------*/
+#if _FS_USE_STREAM
+
+FRESULT pf_read_stream (
+	void (*func)(BYTE),	/* Pointer to the function receiving the data bytes */
+	DWORD btr,		/* Number of bytes to read */
+	DWORD* br		/* Pointer to number of bytes read */
+)
+{
+	CLUST clst;
+	DWORD sect, bcs, rcnt;
+	FATFS *fs = FatFs;
+
+
+	*br = 0;
+	if (!fs) return FR_NOT_ENABLED;		/* Check file system */
+	if (!(fs->flag & FA_OPENED))		/* Check if opened */
+		return FR_NOT_OPENED;
+
+	rcnt = fs->fsize - fs->fptr;
+	if (btr > rcnt) btr = rcnt;						/* Truncate btr by remaining bytes */
+	bcs = (DWORD)fs->csize * 512;					/* Cluster size (byte) */
+
+	while (btr)	{									/* Repeat until all data transferred */
+		if ((fs->fptr % bcs) == 0) {				/* On the cluster boundary? */
+			clst = (fs->fptr == 0) ?				/* On the top of the file? */
+				fs->org_clust : get_fat(fs->curr_clust);
+			if (clst <= 1) goto fs_abort;
+			fs->curr_clust = clst;					/* Update current cluster */
+		}
+		sect = clust2sect(fs->curr_clust);			/* Get current sector */
+		if (!sect) goto fs_abort;
+		sect += (BYTE)(fs->fptr / 512 & (fs->csize - 1));
+
+		rcnt = bcs - (fs->fptr % bcs);				/* Bytes left in the current cluster */
+		clst = fs->curr_clust;
+		while (rcnt < btr && get_fat(clst) == clst + 1) {	/* Extend over contiguous clusters */
+			clst++;
+			rcnt += bcs;
+		}
+		if (rcnt > btr) rcnt = btr;
+
+		/* Read the whole run with one multiple block read */
+		if (disk_readm(func, sect, (WORD)(fs->fptr % 512), rcnt)) goto fs_abort;
+
+		fs->curr_clust += (CLUST)((fs->fptr % bcs + rcnt - 1) / bcs);	/* Cluster of the last byte read */
+		fs->fptr += rcnt;							/* Update pointers and counters */
+		fs->dsect = clust2sect(fs->curr_clust) + (BYTE)((fs->fptr - 1) / 512 & (fs->csize - 1));
+		btr -= rcnt; *br += rcnt;
+	}
+
+	return FR_OK;
+
+fs_abort:
+	fs->flag = 0;
+	return FR_DISK_ERR;
+}
+#endif
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Write File                                                            */
 /*-----------------------------------------------------------------------*/
@@ -42,8 +42,17 @@
 	#define	_FS_USE_WRITE	1	/* 1:Enable pf_write() */
 #endif
 
-#define _FS_FAT12	0	/* 1:Enable FAT12 support */
-#define _FS_FAT32	0	/* 1:Enable FAT32 support */
+#ifndef _FS_USE_STREAM
+	#define	_FS_USE_STREAM	1	/* 1:Enable pf_read_stream() */
+#endif
+
+#ifndef _FS_FAT12
+	#define _FS_FAT12	0	/* 1:Enable FAT12 support */
+#endif
+
+#ifndef _FS_FAT32
+	#define _FS_FAT32	1	/* 1:Enable FAT32 support */
+#endif
 
 
 #define	_CODE_PAGE	1
@@ -145,6 +154,7 @@ typedef enum {
 FRESULT pf_mount (FATFS*);						/* Mount/Unmount a logical drive */
 FRESULT pf_open (const char*);					/* Open a file */
 FRESULT pf_read (void*, WORD, WORD*);			/* Read data from the open file */
+FRESULT pf_read_stream (void (*)(BYTE), DWORD, DWORD*);	/* Stream data from the open file to a function */
 FRESULT pf_write (const void*, WORD, WORD*);	/* Write data to the open file */
 FRESULT pf_lseek (DWORD);						/* Move file pointer of the open file */
 FRESULT pf_opendir (DIR*, const char*);			/* Open a directory */
@@ -0,0 +1,286 @@
+/*
+ *  SD Card block device layer with a shared sector cache
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <avr/io.h>
+#include <uzebox.h>
+#include "sdblock.h"
+
+#define SDB_TOKEN_SINGLE   0xFEU // Data token for CMD17 / CMD18 / CMD24
+#define SDB_TOKEN_MULTI    0xFCU // Data token for CMD25
+#define SDB_TOKEN_STOP     0xFDU // Stop transmission token for CMD25
+#define SDB_NO_SECTOR      0xFFFFFFFFUL
+
+static sdc_struct_t sdb_sds;
+#if (SDB_CACHE != 0)
+static u8           sdb_buf[512];
+static u32          sdb_sector = SDB_NO_SECTOR;
+#define SDB_BUF     (&sdb_buf[0])
+#else
+#define SDB_BUF     NULL
+#endif
+
+
+/*
+ * SPI helpers. The CRC is updated while a byte is shifting, it takes less
+ * time than the transfer at the SD SPI rate.
+ */
+static inline void sdb_spi_wait(void){
+	while(!(SPSR & (1<<SPIF)));
+}
+
+static u8 sdb_spi_xchg(u8 data){
+	SPDR = data;
+	sdb_spi_wait();
+	return SPDR;
+}
+
+static inline u16 sdb_crc16(u16 crc, u8 data){
+	u8 x = (u8)(crc >> 8) ^ data;
+	x ^= x >> 4;
+	return (crc << 8) ^ ((u16)x << 12) ^ ((u16)x << 5) ^ x;
+}
+
+static u8 sdb_wait_busy(void){
+	u32 cnt = 0x100000UL;
+	while(sdb_spi_xchg(0xFFU) != 0xFFU){
+		if(--cnt == 0U) return 3;
+	}
+	return 0;
+}
+
+static u8 sdb_release(u8 res){
+	SDC_Release();
+	SPI_Set_Max();
+	return res;
+}
+
+
+/*
+ * Block transfers (card selected, command already sent)
+ */
+static u8 sdb_rx_block(u8* buf){
+	u16 crc = 0;
+	u16 rcrc;
+	u8 data;
+
+	if(SDC_Wait_FF() != SDB_TOKEN_SINGLE) return 3;
+
+	SPDR = 0xFFU;
+	for(u16 i = 0; i < 512U; i++){
+		sdb_spi_wait();
+		data = SPDR;
+		SPDR = 0xFFU;
+		buf[i] = data;
+		crc = sdb_crc16(crc, data);
+	}
+	sdb_spi_wait();
+	rcrc = (u16)SPDR << 8;
+	rcrc |= sdb_spi_xchg(0xFFU);
+
+	if((rcrc != crc) && ((sdb_sds.flags & SDC_FLAGS_CRCOFF) == 0U)) return 4;
+	return 0;
+}
+
+static u8 sdb_tx_block(u8 token, const u8* buf){
+	u16 crc = 0;
+	u8 data;
+
+	sdb_spi_xchg(0xFFU);
+	sdb_spi_xchg(token);
+	for(u16 i = 0; i < 512U; i++){
+		data = buf[i];
+		SPDR = data;
+		crc = sdb_crc16(crc, data);
+		sdb_spi_wait();
+	}
+	sdb_spi_xchg(crc >> 8);
+	sdb_spi_xchg(crc & 0xFFU);
+
+	if((sdb_spi_xchg(0xFFU) & 0x1FU) != 0x05U) return 4;
+	return sdb_wait_busy();
+}
+
+
+
+u8 SDB_Init(void){
+	sdb_sds.bufp = SDB_BUF;
+#if (SDB_CACHE != 0)
+	sdb_sector = SDB_NO_SECTOR;
+#endif
+	return SDC_Init(&sdb_sds);
+}
+
+sdc_struct_t* SDB_Struct(void){
+	sdb_sds.bufp = SDB_BUF;
+	return &sdb_sds;
+}
+
+#if (SDB_CACHE != 0)
+void SDB_Invalidate(void){
+	sdb_sector = SDB_NO_SECTOR;
+}
+
+u8* SDB_Read(u32 sector){
+	if(sector != sdb_sector){
+		sdb_sector = SDB_NO_SECTOR;
+		if(SDB_Read_Blocks(sector, sdb_buf, 1) != 0U) return NULL;
+		sdb_sector = sector;
+	}
+	return sdb_buf;
+}
+
+u8 SDB_Write(u32 sector){
+	u8 res;
+	sdb_sector = SDB_NO_SECTOR;
+	res = SDB_Write_Blocks(sector, sdb_buf, 1);
+	if(res == 0U) sdb_sector = sector;
+	return res;
+}
+#endif
+
+u8 SDB_Read_Blocks(u32 sector, u8* buf, u16 count){
+	u8 res = 0;
+	bool multi = (count > 1U);
+
+	if((sdb_sds.flags & SDC_FLAGS_INIT) == 0U) return 1;
+	if(count == 0U) return 0;
+
+#if (SDB_CACHE != 0)
+	// Reading into the cache from outside of SDB_Read drops its content
+	if(buf == sdb_buf) sdb_sector = SDB_NO_SECTOR;
+#endif
+
+	SPI_Set_SD();
+	if(SDC_Command(multi ? 18 : 17, SDC_Command_Address(&sdb_sds, sector)) != 0U){
+		return sdb_release(2);
+	}
+
+	do{
+		res = sdb_rx_block(buf);
+		if(res != 0U) break;
+		buf += 512;
+	}while(--count);
+
+	if(multi){
+		// Stop the multi block read, then wait for the card
+		SDC_Command(12, 0);
+		if(sdb_wait_busy() != 0U && res == 0U) res = 3;
+	}
+
+	return sdb_release(res);
+}
+
+u8 SDB_Write_Blocks(u32 sector, const u8* buf, u16 count){
+	u8 res = 0;
+	u8 token = (count == 1U) ? SDB_TOKEN_SINGLE : SDB_TOKEN_MULTI;
+
+	if((sdb_sds.flags & SDC_FLAGS_INIT) == 0U) return 1;
+	if(count == 0U) return 0;
+
+#if (SDB_CACHE != 0)
+	// Keep the cache coherent with the card
+	if((sdb_sector != SDB_NO_SECTOR) && (sdb_sector >= sector) && (sdb_sector < (sector + count))){
+		if(buf != sdb_buf){
+			memcpy(sdb_buf, buf + ((size_t)(sdb_sector - sector) << 9), 512);
+		}
+	}
+#endif
+
+	SPI_Set_SD();
+	if(SDC_Command((count == 1U) ? 24 : 25, SDC_Command_Address(&sdb_sds, sector)) != 0U){
+		return sdb_release(2);
+	}
+
+	do{
+		res = sdb_tx_block(token, buf);
+		if(res != 0U) break;
+		buf += 512;
+	}while(--count);
+
+	if(token == SDB_TOKEN_MULTI){
+		sdb_spi_xchg(0xFFU);
+		sdb_spi_xchg(SDB_TOKEN_STOP);
+		sdb_spi_xchg(0xFFU);
+		if(sdb_wait_busy() != 0U && res == 0U) res = 3;
+	}
+
+#if (SDB_CACHE != 0)
+	if(res != 0U) sdb_sector = SDB_NO_SECTOR;
+#endif
+	return sdb_release(res);
+}
+
+u8 SDB_Read_Stream(u32 sector, u16 ofs, u32 cnt, void (*sink)(u8)){
+	u8 res = 0;
+	u16 crc;
+	u16 rcrc;
+	u8 data;
+	u32 count;
+	bool multi;
+
+	if((sdb_sds.flags & SDC_FLAGS_INIT) == 0U) return 1;
+	if(cnt == 0U) return 0;
+
+	count = (ofs + cnt + 511U) >> 9;
+	multi = (count > 1U);
+
+	SPI_Set_SD();
+	if(SDC_Command(multi ? 18 : 17, SDC_Command_Address(&sdb_sds, sector)) != 0U){
+		return sdb_release(2);
+	}
+
+	do{
+		if(SDC_Wait_FF() != SDB_TOKEN_SINGLE){
+			res = 3;
+			break;
+		}
+
+		// The sink runs while the next byte is shifting in
+		crc = 0;
+		SPDR = 0xFFU;
+		for(u16 i = 0; i < 512U; i++){
+			sdb_spi_wait();
+			data = SPDR;
+			SPDR = 0xFFU;
+			crc = sdb_crc16(crc, data);
+			if(ofs != 0U){
+				ofs--;
+			}else if(cnt != 0U){
+				cnt--;
+				sink(data);
+			}
+		}
+		sdb_spi_wait();
+		rcrc = (u16)SPDR << 8;
+		rcrc |= sdb_spi_xchg(0xFFU);
+
+		if((rcrc != crc) && ((sdb_sds.flags & SDC_FLAGS_CRCOFF) == 0U)){
+			res = 4;
+			break;
+		}
+	}while(--count);
+
+	if(multi){
+		SDC_Command(12, 0);
+		if(sdb_wait_busy() != 0U && res == 0U) res = 3;
+	}
+
+	return sdb_release(res);
+}
@@ -0,0 +1,121 @@
+/*
+ *  SD Card block device layer with a shared sector cache
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+
+#ifndef SDBLOCK_H
+#define SDBLOCK_H
+
+
+#include <stdint.h>
+#include <bootlib.h>
+
+
+/*
+** 1: 512 byte sector cache (SDB_Read, SDB_Write, SDB_Invalidate)
+** 0: no cache, SDB_Struct()->bufp is NULL. For FatFs.
+*/
+#ifndef SDB_CACHE
+	#define SDB_CACHE 1
+#endif
+
+
+/*
+** This layer sits on the SD command primitives of bootlib (so it uses the
+** bootloader's copy of them if one is present) and provides single and
+** multi block sector access for every filesystem front end of the kernel.
+**
+** It owns a 512 byte sector cache. Petit FatFs (petitfatfs/diskio_sdblock.c)
+** reads through it and bootlib FS_* users can share it by using SDB_Struct()
+** as their SD data structure instead of allocating their own buffer. FatFs
+** (fatfs/diskio_sdblock.c) reads and writes its own window in the FATFS
+** structure and never uses the cache: build this layer with SDB_CACHE=0 to
+** leave it out, unless bootlib FS_* code of the game shares it.
+**
+** Return values are the same as for bootlib's SDC_Read_Sector and
+** SDC_Write_Sector:
+** 0: Success
+** 1: Card is not initialized
+** 2: Command (CMD17 / CMD18 / CMD24 / CMD25) failed
+** 3: Timed out during waiting
+** 4: CRC error
+*/
+
+
+/*
+** Detects and initializes the SD card (SDC_Init) and invalidates the cache.
+** Returns zero on success, otherwise SDC_Init errors.
+*/
+uint8_t       SDB_Init(void);
+
+
+/*
+** Returns the SD data structure of the block layer. Its bufp is the shared
+** sector cache, so it can be passed to bootlib's FS_* functions. Call
+** SDB_Invalidate() after using those as they load the buffer directly.
+*/
+sdc_struct_t* SDB_Struct(void);
+
+
+#if (SDB_CACHE != 0)
+
+/*
+** Forgets the sector held in the cache.
+*/
+void          SDB_Invalidate(void);
+
+
+/*
+** Loads a sector into the cache (no card access if it is already there).
+** Returns a pointer to the 512 byte cache, NULL on failure.
+*/
+uint8_t*      SDB_Read(uint32_t sector);
+
+
+/*
+** Writes the content of the cache into the given sector, which also becomes
+** the cached sector.
+*/
+uint8_t       SDB_Write(uint32_t sector);
+
+#endif
+
+
+/*
+** Reads count sectors into buf, using a single READ_MULTIPLE_BLOCK when
+** count is above one.
+*/
+uint8_t       SDB_Read_Blocks(uint32_t sector, uint8_t* buf, uint16_t count);
+
+
+/*
+** Writes count sectors from buf, using a single WRITE_MULTIPLE_BLOCK when
+** count is above one. Updates the cache if it holds one of them.
+*/
+uint8_t       SDB_Write_Blocks(uint32_t sector, const uint8_t* buf, uint16_t count);
+
+
+/*
+** Reads cnt bytes starting at byte ofs (0..511) of the given sector and
+** passes them to sink one at a time, using a single READ_MULTIPLE_BLOCK
+** across all the sectors covered. The sink is called while the next byte is
+** transferred, so it should be short. The cache is not used.
+*/
+uint8_t       SDB_Read_Stream(uint32_t sector, uint16_t ofs, uint32_t cnt, void (*sink)(uint8_t));
+
+
+#endif
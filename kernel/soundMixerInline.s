@@ -130,6 +130,170 @@ process_music:
 
 
 
+#if (UART != 0)
+#if (UART_STATS != 0)
+
+; Adds the UART status bit (r0) to a counter saturating at 255 (8 cycles)
+; r1 must be zero or one on entry, it holds the bit on exit. Destroys r17.
+.macro UART_STAT_COUNT bit, counter
+	bst   r0,      \bit
+	bld   r1,      0
+	lds   r17,     \counter
+	add   r17,     r1
+	sbci  r17,     0       ; Saturate at 255
+	sts   \counter, r17
+.endm
+
+#endif
+
+;****************************
+; UART receive poll, the body of the inline mixer's UART slot
+; Moves one byte (if any) from UDR0 into the receive ring in constant time.
+; Leaves r1 zero.
+;
+; Destroys: Z, r0, r1, r18
+;****************************
+
+.macro UART_RX_POLL
+
+#if (UART_RX_INDEX_16BIT != 0) && (UART_STATS != 0)
+
+	; Read UART data, 16 bit ring index with statistics (53 cycles)
+
+	push  r17
+	lds   ZL,      uart_rx_head
+	lds   ZH,      uart_rx_head+1
+	clr   r1
+
+	lds   r0,      _SFR_MEM_ADDR(UCSR0A)
+
+	sbrs  r0,      RXC0    ; Data in?
+	rjmp  uart_rx_none
+	UART_STAT_COUNT FE0,  uart_rx_frame_errors
+	UART_STAT_COUNT DOR0, uart_rx_overruns
+	clr   r1
+	lds   r0,      _SFR_MEM_ADDR(UDR0)
+	subi  ZL,      lo8(-(uart_rx_buf))
+	sbci  ZH,      hi8(-(uart_rx_buf))
+	st    Z+,      r0      ; The slot at the head is always free
+	subi  ZL,      lo8(uart_rx_buf)
+	sbci  ZH,      hi8(uart_rx_buf) ; Next head index
+	andi  ZH,      hi8(UART_RX_BUFFER_SIZE - 1) ; Wrap
+	lds   r17,     uart_rx_tail
+	cp    ZL,      r17
+	lds   r17,     uart_rx_tail+1
+	cpc   ZH,      r17
+	breq  uart_rx_drop     ; Ring full?
+	sts   uart_rx_head, ZL
+	sts   uart_rx_head+1, ZH
+	nop
+	rjmp  uart_rx_done
+
+uart_rx_drop:
+	lds   r17,     uart_rx_drops
+	cpi   r17,     0xFF
+	adc   r17,     r1      ; Saturate at 255
+	sts   uart_rx_drops, r17
+
+uart_rx_done:
+	pop   r17
+
+#elif (UART_RX_INDEX_16BIT != 0)
+
+	; Read UART data, 16 bit ring index (22 cycles)
+
+	lds   ZL,      uart_rx_head
+	lds   ZH,      uart_rx_head+1
+	clr   r1
+
+	lds   r0,      _SFR_MEM_ADDR(UCSR0A)
+
+	sbrs  r0,      RXC0    ; Data in?
+	rjmp  uart_rx_none
+	lds   r0,      _SFR_MEM_ADDR(UDR0)
+	subi  ZL,      lo8(-(uart_rx_buf))
+	sbci  ZH,      hi8(-(uart_rx_buf))
+	st    Z+,      r0
+	subi  ZL,      lo8(uart_rx_buf)
+	sbci  ZH,      hi8(uart_rx_buf) ; Next head index
+	andi  ZH,      hi8(UART_RX_BUFFER_SIZE - 1) ; Wrap
+	sts   uart_rx_head, ZL
+	sts   uart_rx_head+1, ZH
+
+#elif (UART_STATS != 0)
+
+	; Read UART data with statistics (49 cycles)
+
+	push  r17
+	ldi   ZL,      lo8(uart_rx_buf)
+	ldi   ZH,      hi8(uart_rx_buf)
+	lds   r18,     uart_rx_head
+
+	clr   r1
+	add   ZL,      r18
+	adc   ZH,      r1
+	inc   r18
+	andi  r18,     (UART_RX_BUFFER_SIZE - 1) ; Wrap
+
+	lds   r0,      _SFR_MEM_ADDR(UCSR0A)
+
+	sbrs  r0,      RXC0    ; Data in?
+	rjmp  uart_rx_none
+	UART_STAT_COUNT FE0,  uart_rx_frame_errors
+	UART_STAT_COUNT DOR0, uart_rx_overruns
+	clr   r1
+	lds   r0,      _SFR_MEM_ADDR(UDR0)
+	st    Z,       r0      ; The slot at the head is always free
+	lds   r17,     uart_rx_tail
+	cp    r17,     r18
+	breq  uart_rx_drop     ; Ring full?
+	sts   uart_rx_head, r18
+	nop
+	rjmp  .
+	rjmp  uart_rx_done
+
+uart_rx_drop:
+	lds   r17,     uart_rx_drops
+	cpi   r17,     0xFF
+	adc   r17,     r1      ; Saturate at 255
+	sts   uart_rx_drops, r17
+
+uart_rx_done:
+	pop   r17
+
+#else
+
+	; Read UART data (20 cycles)
+
+	ldi   ZL,      lo8(uart_rx_buf)
+	ldi   ZH,      hi8(uart_rx_buf)
+	lds   r18,     uart_rx_head
+
+	clr   r1
+	add   ZL,      r18
+	adc   ZH,      r1
+	inc   r18
+	andi  r18,     (UART_RX_BUFFER_SIZE - 1) ; Wrap
+
+	lds   r0,      _SFR_MEM_ADDR(UCSR0A)
+
+	sbrc  r0,      RXC0    ; Data in?
+	rjmp  uart_rx_in
+	lpm   ZL,      Z
+	rjmp  .
+	rjmp  uart_rx_end
+
+uart_rx_in:
+	lds   r0,      _SFR_MEM_ADDR(UDR0)
+	st    Z,       r0
+	sts   uart_rx_head, r18
+
+#endif
+uart_rx_end:
+.endm
+
+#endif
+
 ;****************************
 ; Inline sound mixing
 ; In: ZL = video phase (1 = Pre-eq / Post-eq, 2 = Hsync, 0 = No sync)
@@ -321,33 +485,20 @@ ch5_nores:
 	sts   _SFR_MEM_ADDR(OCR2A), ZH ; Output sound byte
 
 #if (UART != 0)
+#if (UART_RX_DUAL_POLL != 0)
 
-	; Read UART data (20 cycles)
-
-	ldi   ZL,      lo8(uart_rx_buf)
-	ldi   ZH,      hi8(uart_rx_buf)
-	lds   r18,     uart_rx_head
-
-	clr   r1
-	add   ZL,      r18
-	adc   ZH,      r1
-	inc   r18
-	andi  r18,     (UART_RX_BUFFER_SIZE - 1) ; Wrap
+	; Read UART data twice, the receive FIFO of the USART can hold two
+	; bytes, so up to two bytes per scanline can be taken (14 cycles +
+	; two polls)
 
-	lds   r0,      _SFR_MEM_ADDR(UCSR0A)
+	rcall uart_rx_poll
+	rcall uart_rx_poll
 
-	sbrc  r0,      RXC0    ; Data in?
-	rjmp  uart_rx_in
-	lpm   ZL,      Z
-	rjmp  .
-	rjmp  uart_rx_end
+#else
 
-uart_rx_in:
-	lds   r0,      _SFR_MEM_ADDR(UDR0)
-	st    Z,       r0
-	sts   uart_rx_head, r18
+	UART_RX_POLL
 
-uart_rx_end:
+#endif
 
 	; Send UART data (23 cycles)
 
@@ -385,3 +536,26 @@ uart_tx_end:
 	pop   r18
 
 	ret
+
+#if (UART != 0) && (UART_RX_DUAL_POLL != 0)
+uart_rx_poll:
+	UART_RX_POLL
+	ret
+
+#endif
+#if (UART != 0) && (UART_RX_INDEX_16BIT != 0) && (UART_STATS != 0)
+uart_rx_none:
+	WAIT  r17,     37
+	rjmp  uart_rx_done
+#elif (UART != 0) && (UART_RX_INDEX_16BIT != 0)
+uart_rx_none:
+	lpm   ZL,      Z
+	lpm   ZL,      Z
+	lpm   ZL,      Z
+	nop
+	rjmp  uart_rx_end
+#elif (UART != 0) && (UART_STATS != 0)
+uart_rx_none:
+	WAIT  r17,     29
+	rjmp  uart_rx_done
+#endif
@@ -83,6 +83,8 @@
 	extern void ClearVsyncCounter();
 	extern u16	GetVsyncCounter();	
         extern void SetVsyncCounter(u16 count);
+	extern u32	GetScanlineCounter();
+	extern u32	GetScanlinesSince(u32 start);
 
 	extern void SetRenderingParameters(u8 firstScanlineToRender, u8 verticalTilesToRender);
 
@@ -161,11 +163,18 @@
 	extern void UartGoBack(unsigned char count);
 	extern u8 UartUnreadCount();
 	extern s16 UartReadChar();
+	extern u16 UartRxCount();
+	extern u16 UartReadBlock(u8* dst, u16 len);
+	extern s16 UartPeek(u16 offset);
+	extern u16 UartSkip(u16 len);
 	extern s8 UartSendChar(u8 data);		
+	extern u16 UartWriteBlock(const u8* src, u16 len);
 	extern bool IsUartTxBufferEmpty();
 	extern bool IsUartTxBufferFull();
 	extern void InitUartTxBuffer();
 	extern void InitUartRxBuffer();
+	extern void UartGetStats(struct UartStatsStruct* stats);
+	extern void UartResetStats();
 
 	/*
 	 * Misc functions
@@ -173,6 +182,7 @@
 	extern void WaitClocks(u16 clocks);
 	extern void WaitUs(unsigned int microseconds);
 	extern void SoftReset(void);
+	extern void ReturnToLoader(void);
 	extern bool IsRunningInEmulator(void);
 	extern bool IsPowerSwitchPressed();
 
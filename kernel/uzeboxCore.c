@@ -21,6 +21,7 @@
 #include <stdbool.h>
 #include <avr/io.h>
 #include <stdlib.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
@@ -28,6 +29,10 @@
 
 #include <util/atomic.h> 
 
+#if LOADER_RETURN == 1
+	#include "bootlib.h"
+#endif
+
 /* Video modes may redefine stack top to allocate workspace */
 #ifndef UZEBOX_STACK_TOP
 #define UZEBOX_STACK_TOP 0x10FF
@@ -44,8 +49,8 @@ extern void InitSoundPort();
 void ReadButtons();
 char EepromBlockExistsInternal(unsigned int blockId, u16* eepromAddr, u8* nextFreeBlockId);
 
-extern unsigned char sync_phase;
-extern unsigned char sync_pulse;
+extern volatile unsigned char sync_phase;
+extern volatile unsigned char sync_pulse;
 extern unsigned char sync_flags;
 extern Track tracks[CHANNELS];
 extern volatile unsigned int joypad1_status_lo,joypad2_status_lo;
@@ -58,6 +63,11 @@ extern unsigned char sound_enabled;
 	bool snesMouseEnabled=false;
 #endif
 
+#if LOADER_RETURN == 1
+	volatile bool loader_return_request=false;
+	static void DetectLoaderBreak();
+#endif
+
 u8 joypadsConnectionStatus;
 //u16 prng_state=0;
 
@@ -106,6 +116,42 @@ void SetRenderingParameters(u8 firstScanlineToRender, u8 scanlinesToRender){
 	first_render_line=firstScanlineToRender;
 }
 
+/**
+ * Returns the scanlines since the vsync counter was cleared, wraps after
+ * 65536 frames (18 minutes). The vsync counter increments when the vsync
+ * phase begins, which has 18 half lines, followed by SYNC_HSYNC_PULSES lines.
+ * The switch to hsync leaves the counter as it is, so a change of phase
+ * between the reads is checked too.
+ */
+u32 GetScanlineCounter(){
+	u16 v,line;	//up to 261, past a byte
+	u8 phase;
+
+	do{
+		v=GetVsyncCounter();
+		phase=sync_phase;
+		line=sync_pulse;
+	}while(v!=GetVsyncCounter() || phase!=sync_phase);
+
+	if(phase==0){
+		line=((SYNC_PRE_EQ_PULSES+SYNC_EQ_PULSES+SYNC_POST_EQ_PULSES)-line)>>1;
+	}else{
+		line=((SYNC_PRE_EQ_PULSES+SYNC_EQ_PULSES+SYNC_POST_EQ_PULSES)>>1)+(SYNC_HSYNC_PULSES-line);
+	}
+	return ((u32)v*SCANLINES_PER_FRAME)+line;
+}
+
+/**
+ * Returns the scanlines elapsed since start, a GetScanlineCounter() value,
+ * across the wrap of the counter.
+ */
+u32 GetScanlinesSince(u32 start){
+	u32 now=GetScanlineCounter();
+
+	if(now<start) now+=SCANLINE_COUNTER_WRAP;
+	return now-start;
+}
+
 
 /*
  * I/O initialization table
@@ -313,6 +359,12 @@ void ReadButtons(){
 		SoftReset();
 	}
 
+	#if LOADER_RETURN == 1
+		if(joypad1_status_lo==(LOADER_RETURN_BUTTONS) || joypad2_status_lo==(LOADER_RETURN_BUTTONS)){
+			loader_return_request=true;
+		}
+	#endif
+
 }
 
 /**
@@ -333,6 +385,10 @@ void ReadControllers(){
 			
 	//read the standard buttons
 	ReadButtons();
+
+	#if LOADER_RETURN == 1
+		DetectLoaderBreak();
+	#endif
 }
 
 
@@ -753,10 +809,49 @@ char EepromBlockExists(unsigned int blockId, u16* eepromAddr, u8* nextFreeBlockI
 	 * UART RX/TX buffer functions
 	 */
 
+#if UART_RX_INDEX_16BIT == 1
+	volatile u16 uart_rx_tail;
+	volatile u16 uart_rx_head;
+
+	/*
+	 * The head is written by the mixer within the line interrupt, so a 16 bit
+	 * read can be torn. Read it again until both reads match instead of
+	 * masking interrupts, which would disturb the video timing.
+	 */
+	static inline u16 UartRxHead(){
+		u16 head;
+		do{
+			head=uart_rx_head;
+		}while(head != uart_rx_head);
+		return head;
+	}
+#else
 	volatile u8 uart_rx_tail;
 	volatile u8 uart_rx_head;
+
+	static inline u8 UartRxHead(){
+		return uart_rx_head;
+	}
+#endif
 	volatile u8 uart_rx_buf[UART_RX_BUFFER_SIZE];
 
+#if UART_STATS == 1
+	//line error and drop counters, updated by the mixer
+	volatile u8 uart_rx_frame_errors;
+	volatile u8 uart_rx_overruns;
+	volatile u8 uart_rx_drops;
+	u16 uart_rx_peak;
+#endif
+
+	//number of bytes waiting in the receive ring
+	static inline u16 UartRxUsed(u16 tail){
+		u16 used=(UartRxHead()-tail) & (UART_RX_BUFFER_SIZE-1);
+	#if UART_STATS == 1
+		if(used>uart_rx_peak) uart_rx_peak=used;
+	#endif
+		return used;
+	}
+
 	//obsolete
 	void UartGoBack(u8 count){
 		uart_rx_tail-=count;
@@ -765,16 +860,17 @@ char EepromBlockExists(unsigned int blockId, u16* eepromAddr, u8* nextFreeBlockI
 
 	//obsolete
 	u8 UartUnreadCount(){
-		return uart_rx_head-uart_rx_tail;
+		u16 count=UartRxUsed(uart_rx_tail);
+		return (count > 255) ? 255 : count;
 	}
 
 	bool IsUartRxBufferEmpty(){
-		return (uart_rx_tail==uart_rx_head);
+		return (uart_rx_tail==UartRxHead());
 	}
 
 	s16 UartReadChar(){
 
-		if(uart_rx_head != uart_rx_tail){
+		if(UartRxUsed(uart_rx_tail) != 0){
 
 			u8 data=uart_rx_buf[uart_rx_tail];
 			uart_rx_tail=((uart_rx_tail+1) & (UART_RX_BUFFER_SIZE-1));	//wrap pointer to buffer size			
@@ -785,11 +881,71 @@ char EepromBlockExists(unsigned int blockId, u16* eepromAddr, u8* nextFreeBlockI
 		}
 	}
 
+	u16 UartRxCount(){
+		return UartRxUsed(uart_rx_tail);
+	}
+
+	/*
+	 * Copies up to len received bytes to dst, returns the number of bytes
+	 * copied. The data is taken from the ring in at most two runs.
+	 */
+	u16 UartReadBlock(u8* dst, u16 len){
+		u16 tail=uart_rx_tail;
+		u16 count=UartRxUsed(tail);
+		u16 run=UART_RX_BUFFER_SIZE-tail;
+
+		if(len>count) len=count;
+		if(run>len) run=len;
+		memcpy(dst,(const u8*)&uart_rx_buf[tail],run);
+		memcpy(dst+run,(const u8*)&uart_rx_buf[0],len-run);
+		uart_rx_tail=(tail+len) & (UART_RX_BUFFER_SIZE-1);
+		return len;
+	}
+
+	/*
+	 * Returns the received byte at offset from the read position without
+	 * consuming it, -1 if there is no such byte yet.
+	 */
+	s16 UartPeek(u16 offset){
+		u16 tail=uart_rx_tail;
+
+		if(offset>=UartRxUsed(tail)) return -1;
+		return uart_rx_buf[(tail+offset) & (UART_RX_BUFFER_SIZE-1)];
+	}
+
+	/*
+	 * Drops up to len received bytes, returns the number of bytes dropped.
+	 */
+	u16 UartSkip(u16 len){
+		u16 tail=uart_rx_tail;
+		u16 count=UartRxUsed(tail);
+
+		if(len>count) len=count;
+		uart_rx_tail=(tail+len) & (UART_RX_BUFFER_SIZE-1);
+		return len;
+	}
+
 	void InitUartRxBuffer(){
 		uart_rx_tail=0;
 		uart_rx_head=0;
 	}
 
+#if UART_STATS == 1
+	void UartGetStats(struct UartStatsStruct* stats){
+		stats->frameErrors=uart_rx_frame_errors;
+		stats->overruns=uart_rx_overruns;
+		stats->drops=uart_rx_drops;
+		stats->peak=uart_rx_peak;
+	}
+
+	void UartResetStats(){
+		uart_rx_frame_errors=0;
+		uart_rx_overruns=0;
+		uart_rx_drops=0;
+		uart_rx_peak=0;
+	}
+#endif
+
 	/*
 	 * UART Transmit buffer function
 	 */
@@ -820,6 +976,23 @@ char EepromBlockExists(unsigned int blockId, u16* eepromAddr, u8* nextFreeBlockI
 		}
 	}
 
+	/*
+	 * Queues up to len bytes from src for transmission, returns the number
+	 * of bytes queued (less than len if the buffer gets full).
+	 */
+	u16 UartWriteBlock(const u8* src, u16 len){
+		u8 head=uart_tx_head;
+		u16 space=(uart_tx_tail-head-1) & (UART_TX_BUFFER_SIZE-1);
+		u16 run=UART_TX_BUFFER_SIZE-head;
+
+		if(len>space) len=space;
+		if(run>len) run=len;
+		memcpy((u8*)&uart_tx_buf[head],src,run);
+		memcpy((u8*)&uart_tx_buf[0],src+run,len-run);
+		uart_tx_head=(head+len) & (UART_TX_BUFFER_SIZE-1);	//publish after the data is in place
+		return len;
+	}
+
 	void InitUartTxBuffer(){
 		uart_tx_tail=0;
 		uart_tx_head=0;
@@ -829,6 +1002,67 @@ char EepromBlockExists(unsigned int blockId, u16* eepromAddr, u8* nextFreeBlockI
 #endif
 
 
+#if LOADER_RETURN == 1
+	/*
+	 * Called each frame by ReadControllers(). An idle UART line is high (RX
+	 * has the pull-up), and even a stream of zeros goes high for each stop
+	 * bit, so the line found low for several frames in a row, with no byte
+	 * received meanwhile, is a break sent by the host.
+	 */
+	static void DetectLoaderBreak(){
+		static u8 frames;
+	#if UART == 1
+		static u8 head;
+		u8 h=(u8)UartRxHead();
+		bool received=(h!=head);
+		head=h;
+	#else
+		bool received=false;
+	#endif
+
+		if((PIND&_BV(PD0))!=0 || received){
+			frames=0;
+		}else if(frames<LOADER_RETURN_BREAK_FRAMES){
+			frames++;
+		}else{
+			loader_return_request=true;
+		}
+	}
+
+	#define LOADER_RETURN_CHARS(i) (((u16)(LOADER_RETURN_FILE[i])<<8)|((u16)(LOADER_RETURN_FILE[i+1])))
+
+	/*
+	 * Boots the loader from the card. The game is abandoned: interrupts are
+	 * turned off first, so the sector buffer can take whatever RAM the stack
+	 * runs into. Soft resets if the card or the loader can't be found.
+	 */
+	void ReturnToLoader(){
+		sdc_struct_t sds;
+		u8 buf[512];
+		u32 cluster;
+
+		cli();
+		sds.bufp=buf;
+		if(FS_Init(&sds)==0){
+			cluster=FS_Find(&sds,
+				LOADER_RETURN_CHARS(0),
+				LOADER_RETURN_CHARS(2),
+				LOADER_RETURN_CHARS(4),
+				LOADER_RETURN_CHARS(6),
+				LOADER_RETURN_CHARS(8),
+				((u16)(LOADER_RETURN_FILE[10])<<8));
+			if(cluster!=0){
+				FS_Select_Cluster(&sds,cluster);
+				Bootld_Request(&sds);
+			}
+		}
+
+		SoftReset();
+		while(1);
+	}
+#endif
+
+
 /**
  * Generate a random number based on a LFSR. This function is *much* faster than avr-libc rand();
  * taps: 16 14 13 11; feedback polynomial: x^16 + x^14 + x^13 + x^11 + 1
@@ -34,6 +34,10 @@
 	#define CHAR_ZERO 16 
 #endif
 
+#if LOADER_RETURN == 1
+	extern volatile bool loader_return_request;
+#endif
+
 
 
 //Draws a map of tile at the specified position
@@ -252,6 +256,10 @@ void WaitVsync(int count){
 	for(i=0;i<count;i++){
 		while(!GetVsyncFlag());
 		ClearVsyncFlag();		
+
+		#if LOADER_RETURN == 1
+			if(loader_return_request) ReturnToLoader();
+		#endif
 	}
 }
 
@@ -0,0 +1,267 @@
+/*
+ * netwin.c
+ *
+ * Windowed transfer receiver, see netwin.h. The frames come from the
+ * uzenet data callback in pieces of up to 32 bytes and are parsed one byte
+ * at a time, straight into the caller's sector buffer. A frame is only
+ * passed on once its CRC and offset are checked, but every frame overwrites
+ * the buffer before that. The replies are queued AT+CIPSEND
+ * commands: while one is being sent, newer ones are merged into the next,
+ * since each carries the whole state.
+ */
+#include <stdbool.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <uzebox.h>
+#include <bootlib.h>
+#include "uzenet.h"
+#include "netwin.h"
+
+//Parser states
+#define NW_HUNT		0	//looking for 'N'
+#define NW_MAGIC	1	//'N' seen, looking for 'L'
+#define NW_HEADER	2
+#define NW_DATA		3
+#define NW_CRC		4
+
+#define NW_PENDING	1	//result while the transfer runs
+
+NetWinStats nw_stats;
+
+static u8* buffer;
+static NetWinFileFunc fileFunc;
+static NetWinDataFunc dataFunc;
+
+static u8 state,header[6],errors;
+static u16 count,crc,length;
+static u32 offset,expected,highest;
+static bool started,done,nak,skipped;
+static s8 result;
+
+//Reply being sent, and whether a newer one waits
+static u8 reply[7];
+static bool sending,dirty;
+
+
+static void _nw_Reply();
+
+static void _nw_Sent(s8 sendResult){
+	sending=false;
+	if(dirty || (sendResult!=WIFI_OK && !done)){
+		_nw_Reply();
+	}else if(done){
+		result=NW_OK;
+	}
+}
+
+//Queues the state: the next offset expected, acknowledged or asked for again
+static void _nw_Reply(){
+	u16 c=0;
+
+	if(sending){
+		dirty=true;
+		return;
+	}
+	dirty=false;
+	reply[0]=skipped?'S':nak?'N':'A';
+	reply[1]=expected;
+	reply[2]=expected>>8;
+	reply[3]=expected>>16;
+	reply[4]=expected>>24;
+	for(u8 i=0;i<5;i++) c=SDC_CRC16_Byte(c,reply[i]);
+	reply[5]=c>>8;
+	reply[6]=c;
+	if(wifi_QueueSendTo(wifi_DataLink(),reply,sizeof(reply),&_nw_Sent)==WIFI_OK){
+		sending=true;
+		nw_stats.acks++;
+	}else{
+		dirty=true;		//queue full, try again next frame
+	}
+}
+
+//A frame was damaged or lost: go back. The frames already in flight fail
+//too, so it is asked once, and again when the sender's resent frames fail.
+static void _nw_Error(bool again){
+	if(++errors>NW_MAX_ERRORS) result=NW_ERR_ERRORS;
+	if(!nak || again){
+		nak=true;
+		nw_stats.naks++;
+		_nw_Reply();
+	}
+}
+
+static void _nw_Frame(){
+	if(crc!=0){
+		nw_stats.crcErrors++;
+		_nw_Error(offset==expected);
+		return;
+	}
+
+	//the frames in flight after a skip only get the skip again
+	if(skipped){
+		_nw_Reply();
+		return;
+	}
+
+	if(offset==NW_START){
+		if(!started && length==4){
+			started=true;
+			if(fileFunc!=NULL) fileFunc(buffer[0]|((u32)buffer[1]<<8)|((u32)buffer[2]<<16)|((u32)buffer[3]<<24));
+		}
+		_nw_Reply();
+		return;
+	}
+	if(!started) return;
+
+	//a frame past the expected one means a loss, and a frame before the
+	//furthest one seen means the sender went back and lost it again
+	if(offset!=expected){
+		if(offset>expected){
+			_nw_Error(offset<=highest);
+			highest=offset;
+		}
+		return;
+	}
+
+	errors=0;
+	nak=false;
+	highest=0;
+	if(length==0){
+		done=true;
+	}else{
+		dataFunc(buffer,length);
+		expected+=length;
+		nw_stats.bytes+=length;
+		nw_stats.frames++;
+		if(skipped) done=true;
+	}
+	_nw_Reply();
+}
+
+static void _nw_Data(u8* data, u16 len){
+	u8 c;
+
+	if(data==NULL){
+		if(!done) result=NW_ERR_CLOSED;
+		return;
+	}
+
+	for(u16 i=0;i<len;i++){
+		c=data[i];
+
+		switch(state){
+			case NW_HUNT:
+				if(c=='N') state=NW_MAGIC;
+				break;
+
+			case NW_MAGIC:
+				if(c=='L'){
+					state=NW_HEADER;
+					count=0;
+					crc=0;
+				}else if(c!='N'){
+					state=NW_HUNT;
+				}
+				break;
+
+			case NW_HEADER:
+				header[count++]=c;
+				crc=SDC_CRC16_Byte(crc,c);
+				if(count==6){
+					offset=header[0]|((u32)header[1]<<8)|((u32)header[2]<<16)|((u32)header[3]<<24);
+					length=header[4]|(header[5]<<8);
+					count=0;
+					if(length>NW_FRAME_SIZE){
+						nw_stats.crcErrors++;
+						_nw_Error(false);
+						state=NW_HUNT;
+					}else{
+						state=(length!=0)?NW_DATA:NW_CRC;
+					}
+				}
+				break;
+
+			case NW_DATA:
+				buffer[count++]=c;
+				crc=SDC_CRC16_Byte(crc,c);
+				if(count==length){
+					count=0;
+					state=NW_CRC;
+				}
+				break;
+
+			case NW_CRC:
+				crc=SDC_CRC16_Byte(crc,c);
+				if(++count==2){
+					state=NW_HUNT;
+					_nw_Frame();
+				}
+				break;
+		}
+	}
+}
+
+/*
+ * Called by the data function: the loader has the file already. The sender
+ * is told to stop, and nw_Receive returns NW_OK once it is.
+ */
+void nw_Skip(){
+	skipped=true;
+}
+
+/*
+ * Receives one file from a client of the module's server. fileFunc gets the
+ * size, then dataFunc gets the file in order, one checked frame at a time,
+ * and each frame but the last holds a whole sector. The data is parsed into
+ * buffer (NW_FRAME_SIZE bytes) as it arrives, frames that are then dropped
+ * included, so it only holds a frame during the call to dataFunc: keeping
+ * bytes there until a later call loses them. idleFunc is called once per
+ * frame and may be NULL.
+ *
+ * Returns NW_OK once the end of the file is acknowledged, NW_ERR_CLOSED or
+ * NW_ERR_ERRORS. Waits forever for the sender to start.
+ */
+s8 nw_Receive(u8* buf, NetWinFileFunc file, NetWinDataFunc data, NetWinIdleFunc idleFunc){
+	u16 frame=GetVsyncCounter(),idleFrames=0,timeout;
+	u32 last=0;
+
+	memset(&nw_stats,0,sizeof(nw_stats));
+	buffer=buf;
+	fileFunc=file;
+	dataFunc=data;
+	state=NW_HUNT;
+	errors=0;
+	expected=highest=0;
+	started=done=nak=skipped=false;
+	sending=dirty=false;
+	result=NW_PENDING;
+
+	wifi_SetDataCallBack(&_nw_Data);
+	timeout=wifi_SetTimeout(NW_REPLY_TIMEOUT);
+
+	while(result==NW_PENDING){
+		wifi_Poll();
+
+		if(GetVsyncCounter()!=frame){
+			frame=GetVsyncCounter();
+			wifi_Tick();
+			if(idleFunc!=NULL) idleFunc();
+			if(dirty && !sending) _nw_Reply();
+
+			//nothing new for a while: the reply or the frames after it were
+			//lost. A reply still being sent has the timeout of uzenet.
+			if(nw_stats.bytes!=last || !started || done || sending){
+				last=nw_stats.bytes;
+				idleFrames=0;
+			}else if(++idleFrames>NW_TIMEOUT){
+				idleFrames=0;
+				nw_stats.timeouts++;
+				_nw_Error(true);
+			}
+		}
+	}
+
+	wifi_SetDataCallBack(NULL);
+	wifi_SetTimeout(timeout);
+	return result;
+}
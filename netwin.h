@@ -0,0 +1,71 @@
+/*
+ * netwin.h
+ *
+ * Receiver of NetLoader.py's windowed protocol over an ESP8266 TCP server
+ * (wifi_TcpListen), for NetLoaderZ. The sender keeps a window of frames in
+ * flight; each frame holds one SD sector and its CRC, and the loader sends
+ * back cumulative acknowledgements.
+ *
+ * Frames from the sender:
+ *   'N' 'L' offset(4) length(2) data(length) crc(2)
+ * little endian offset and length, CRC-16/XMODEM of offset to data sent
+ * big endian. Offset NW_START carries the file size (4 bytes), a frame of
+ * length 0 at the end of the file ends the transfer. The reply to NW_START
+ * holds the offset expected, so a sender that connects again while the
+ * loader still runs the transfer resumes it.
+ *
+ * Replies of the loader, 7 bytes:
+ *   'A' offset(4) crc(2)	every byte before offset is written
+ *   'N' offset(4) crc(2)	a frame was lost or damaged, go back to offset
+ *   'S' offset(4) crc(2)	the loader has the file already, stop (nw_Skip)
+ * with the CRC of the first 5 bytes, so that the sender can tell a reply
+ * from the module's text when an AT+CIPSEND goes wrong.
+ *
+ * Nothing stops the module while a sector is written, so the sender keeps
+ * no more than a frame and what the UART ring holds in flight.
+ */
+
+#ifndef NETWIN_H_
+#define NETWIN_H_
+
+#define NW_OK			0
+#define NW_ERR_CLOSED	-1		//the connection closed before the end of the file
+#define NW_ERR_ERRORS	-2		//too many errors in a row
+
+#define NW_FRAME_SIZE	512		//largest frame, one SD sector
+#define NW_START		0xffffffffUL
+
+//Frames without data before the acknowledgement is sent again
+#ifndef NW_TIMEOUT
+	#define NW_TIMEOUT		15		//250 ms
+#endif
+
+//Frames before a reply whose response from the module was lost is given up
+#ifndef NW_REPLY_TIMEOUT
+	#define NW_REPLY_TIMEOUT	30		//0.5 sec
+#endif
+
+//Consecutive errors (bad CRC, lost frames, timeouts) before the transfer is given up
+#ifndef NW_MAX_ERRORS
+	#define NW_MAX_ERRORS	20
+#endif
+
+typedef void (*NetWinFileFunc)(u32 size);
+typedef void (*NetWinDataFunc)(const u8* data, u16 len);
+typedef void (*NetWinIdleFunc)(void);
+
+typedef struct {
+	u32 bytes;			//file bytes received and passed on
+	u16 naks;			//go back requests sent
+	u16 crcErrors;		//frames with a bad CRC
+	u16 timeouts;
+	u16 frames;			//frames passed on
+	u16 acks;			//replies sent
+} NetWinStats;
+
+extern NetWinStats nw_stats;
+
+extern s8 nw_Receive(u8* buffer, NetWinFileFunc fileFunc, NetWinDataFunc dataFunc, NetWinIdleFunc idleFunc);
+extern void nw_Skip(void);
+
+#endif /* NETWIN_H_ */
@@ -7,13 +7,35 @@
 #include <stdbool.h>
 #include <avr/io.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdio.h>
 #include <avr/pgmspace.h>
 #include <uzebox.h>
 #include "uzenet.h"
+#define UZENET_TOKENS_TABLES
+#include "uzenet_tokens.h"
 #include <time.h>
 
 #define WIFI_DEFAULT_TIMEOUT 60*15	//15 sec
+#define WIFI_PROBE_TIMEOUT 6		//100 ms, for an "AT" sent to a module that is already up
+#define WIFI_PROMPT_TIMEOUT 15		//250 ms, for the prompt of AT+CIPSEND
+#define WIFI_PROBE_RETRIES 3
+
+//EEPROM block remembering the module's UART speeds between boots, see wifi_Init()
+#ifndef WIFI_EEPROM_ID
+	#define WIFI_EEPROM_ID 0x5557
+#endif
+#define WIFI_CACHE_VERSION	2
+#define WIFI_CACHE_VER		0	//data[] offsets
+#define WIFI_CACHE_CUR		1	//UBRR0L value the module was left at (AT+UART_CUR)
+#define WIFI_CACHE_DEF		2	//UBRR0L value it boots at (AT+UART_DEF)
+#define WIFI_CACHE_FAILED	3	//UBRR0L value that failed the echo test, 0 if none
+#define WIFI_CACHE_MIN		4	//WIFI_UART_MIN_UBRR when it failed
+
+//Fastest rate the kernel's UART receiver keeps up with, see defines.h
+#ifndef WIFI_UART_MIN_UBRR
+	#define WIFI_UART_MIN_UBRR UART_RX_MIN_UBRR
+#endif
 
 #define ESP_RESET PD3
 #define ESP_ENABLE PA6
@@ -30,8 +52,18 @@
 #define UART_57600_BAUD 60
 #define UART_115200_BAUD 30
 
+//Rates above 115200 bauds, fastest first. The ESP takes any rate in
+//AT+UART_CUR, so these are the ones the AVR divides exactly:
+//11 = 298295 bauds, 15 = 223722 (230400), 23 = 149148
+const u8 wifi_fastSpeeds[] PROGMEM = {11,15,23};
 
-static int _wifi_SendCommandAndWait(const char* strToSend, const char* strToWait);
+
+static int _wifi_SendCommandAndWait(const char* strToSend, u8 token);
+static int _wifi_WaitFor(u8 token);
+static void _wifi_CommandStart();
+static void _wifi_CommandDone(s8 result);
+static void _wifi_Transmit();
+static void _wifi_Receive();
 //int	SendDataAndWait(const char* strToSend, const char* strToWait);
 wifi_CallBackFunc userCallBackFunc=NULL;
 int WaitforIPD();
@@ -39,6 +71,40 @@ int WaitforIPD();
 static bool echo=false;
 static u8 status=WIFI_STAT_UNINIT;
 static u16 wifi_timeout=WIFI_DEFAULT_TIMEOUT,vsyncCounter=0;
+static u8 failedSpeed=0;
+
+//Asynchronous command engine
+#define WIFI_CMD_QUEUE_SIZE	4
+#define WIFI_CHUNK_SIZE		32
+
+#define CMD_PREFIX		0	//sending the command parts
+#define CMD_STR			1
+#define CMD_SUFFIX		2
+#define CMD_PROMPT		3	//waiting for the '>' prompt of AT+CIPSEND
+#define CMD_DATA		4	//sending the payload
+#define CMD_RESPONSE	5	//waiting for the final result
+
+typedef struct {
+	const char* prefix;		//flash
+	const char* str;		//RAM, optional
+	const char* suffix;		//flash, optional
+	const u8* data;			//payload sent after the '>' prompt, optional
+	u16 dataLen;
+	s8 link;				//connection of AT+CIPSEND with AT+CIPMUX=1, -1 for none
+	wifi_CommandCallBackFunc callBack;
+} wifi_Command;
+
+static wifi_Command cmdQueue[WIFI_CMD_QUEUE_SIZE];
+static u8 cmdHead=0,cmdCount=0,cmdState=CMD_PREFIX;
+static u16 cmdSendPos=0,cmdStartTick=0;
+static u8 cmdPromptWait=0;
+static char cmdLenStr[8];
+
+static bool ipdHeader=false;
+static u16 ipdLen=0,ipdRemaining=0;
+static u8 ipdLink=0;
+static u8 matchState=0;
+static wifi_DataCallBackFunc dataCallBackFunc=NULL;
 
 void _userCallBack(u16 status){
 	if(userCallBackFunc!=NULL){
@@ -57,6 +123,30 @@ void _wifi_putchar(u8 c){
 
 }
 
+/*
+ * Feeds a received byte to the AT response automaton (uzenet_tokens.h) and
+ * returns the token it completes, WIFI_TOKEN_NONE otherwise. All the tokens
+ * are matched in a single pass, overlapping ones included.
+ */
+static u8 _wifi_MatchToken(u8 c){
+	u8 cls=0,next;
+	u16 i,end;
+
+	if(c>=TOKEN_FIRST_CHAR && c<=TOKEN_LAST_CHAR) cls=pgm_read_byte(&tokenClass[c-TOKEN_FIRST_CHAR]);
+
+	next=pgm_read_byte(&tokenRoot[cls]);
+	end=pgm_read_byte(&tokenRow[matchState+1]);
+	for(i=pgm_read_byte(&tokenRow[matchState]);i<end;i++){
+		if(pgm_read_byte(&tokenEdgeClass[i])==cls){
+			next=pgm_read_byte(&tokenEdgeState[i]);
+			break;
+		}
+	}
+
+	matchState=next;
+	return pgm_read_byte(&tokenOutput[next]);
+}
+
 static void _wifi_SetUartSpeed(u8 speed){
 	//initialize UART0
 	UBRR0H=0;
@@ -66,6 +156,190 @@ static void _wifi_SetUartSpeed(u8 speed){
 	UCSR0B=(1<<RXEN0)+(1<<TXEN0); //Enable UART TX & RX
 }
 
+/*
+ * Sends "AT" at the given speed and checks that the module answers. Used to
+ * find a module that is already running, so it has a short timeout.
+ */
+static bool _wifi_Probe(u8 speed){
+	_wifi_SetUartSpeed(speed);
+
+	for(u8 i=0;i<WIFI_PROBE_RETRIES;i++){
+		UartSkip(UartRxCount());
+		matchState=0;
+		if(_wifi_SendCommandAndWait(PSTR("AT\r\n"),WIFI_TOKEN_OK)==WIFI_OK) return true;
+	}
+	return false;
+}
+
+/*
+ * Asks the module to move to the given speed and follows it. The module
+ * answers at the old speed, then switches. Returns false when it did not
+ * acknowledge, the UART is switched anyway.
+ */
+static bool _wifi_ChangeSpeed(u8 speed){
+	char baud[8];
+	bool ok;
+
+	ultoa(F_CPU/8/(speed+1),baud,10);
+	wifi_SendString_P(PSTR("AT+UART_CUR="));
+	wifi_SendString(baud);
+	ok=(_wifi_SendCommandAndWait(PSTR(",8,1,0,0\r\n"),WIFI_TOKEN_OK)==WIFI_OK);
+
+	while(!IsUartTxBufferEmpty());
+	WaitVsync(1);
+	UBRR0L=speed;
+	UartSkip(UartRxCount());
+	matchState=0;
+	return ok;
+}
+
+/*
+ * Checks the link at the current speed: the module echoes a line with
+ * alternating bits back, then answers ERROR to it in one burst.
+ */
+const char wifi_echoTest[] PROGMEM = "AT+UZEBOX=UUUU****0123456789";
+
+static bool _wifi_EchoTest(){
+	bool ok;
+
+	if(_wifi_SendCommandAndWait(PSTR("ATE1\r\n"),WIFI_TOKEN_OK)!=WIFI_OK) return false;
+	wifi_SendString_P(wifi_echoTest);
+	wifi_SendString_P(PSTR("\r\n"));
+	ok=(wifi_WaitForString_P(wifi_echoTest,NULL)==WIFI_OK);
+	matchState=0;
+	if(ok) ok=(_wifi_WaitFor(WIFI_TOKEN_ERROR)==WIFI_OK);
+	if(_wifi_SendCommandAndWait(PSTR("ATE0\r\n"),WIFI_TOKEN_OK)!=WIFI_OK) return false;
+	return ok;
+}
+
+/*
+ * Moves the module from the speed it answers at to the fastest rate of
+ * wifi_fastSpeeds the kernel's receiver sustains, checking each with the
+ * echo test. A rate that fails is remembered in failedSpeed and not tried
+ * again. Falls back to 115200 bauds. Returns the UBRR0L value in use, 0 if
+ * the module was lost.
+ */
+static u8 _wifi_SetFastestSpeed(u8 speed){
+	u8 i,fast;
+
+	wifi_timeout=WIFI_PROBE_TIMEOUT;
+
+	for(i=0;i<sizeof(wifi_fastSpeeds);i++){
+		fast=pgm_read_byte(&wifi_fastSpeeds[i]);
+		if(fast<WIFI_UART_MIN_UBRR || fast<=failedSpeed) continue;
+
+		if(_wifi_ChangeSpeed(fast) && _wifi_EchoTest()) return fast;
+
+		#ifdef WIFI_DEBUG
+			printf_P(PSTR("wifi_debug - speed %i failed\r\n"),fast);
+		#endif
+
+		//it may still understand us, otherwise it did not switch
+		failedSpeed=fast;
+		_wifi_ChangeSpeed(speed);
+		if(!_wifi_Probe(speed)) return 0;
+	}
+
+	if(speed!=UART_115200_BAUD && !_wifi_ChangeSpeed(UART_115200_BAUD)) return 0;
+	return UART_115200_BAUD;
+}
+
+//Remembers the speeds for the next _wifi_FastInit(), the EEPROM is only written when they change
+static void _wifi_SaveSpeeds(u8 defSpeed, u8 curSpeed){
+	struct EepromBlockStruct block;
+
+	if(EepromReadBlock(WIFI_EEPROM_ID,&block)==EEPROM_OK && block.data[WIFI_CACHE_VER]==WIFI_CACHE_VERSION &&
+		block.data[WIFI_CACHE_CUR]==curSpeed && block.data[WIFI_CACHE_DEF]==defSpeed &&
+		block.data[WIFI_CACHE_FAILED]==failedSpeed && block.data[WIFI_CACHE_MIN]==WIFI_UART_MIN_UBRR){
+		return;
+	}
+
+	memset(&block,0,sizeof(block));
+	block.id=WIFI_EEPROM_ID;
+	block.data[WIFI_CACHE_VER]=WIFI_CACHE_VERSION;
+	block.data[WIFI_CACHE_CUR]=curSpeed;
+	block.data[WIFI_CACHE_DEF]=defSpeed;
+	block.data[WIFI_CACHE_FAILED]=failedSpeed;
+	block.data[WIFI_CACHE_MIN]=WIFI_UART_MIN_UBRR;
+	EepromWriteBlock(&block);
+}
+
+/*
+ * Asks the module whether it is associated and only waits for WIFI GOT IP
+ * when it is not, as the message may have been sent long ago or lost while
+ * the UART speed changed.
+ */
+static int _wifi_WaitForIP(){
+	s16 c;
+
+	//STATUS:2 got IP, 3 connected, 4 disconnected, 5 not associated yet
+	wifi_SendString_P(PSTR("AT+CIPSTATUS\r\n"));
+	if(wifi_WaitForTokens(WIFI_TOKEN_MASK(WIFI_TOKEN_STATUS))!=WIFI_TOKEN_STATUS) return WIFI_ERR;
+	vsyncCounter=0;
+	while((c=UartReadChar())==-1){
+		if(vsyncCounter>wifi_timeout) return WIFI_ERR;
+	}
+	if(_wifi_WaitFor(WIFI_TOKEN_OK)!=WIFI_OK) return WIFI_ERR;
+
+	if(c<'2' || c>'4'){
+		if(wifi_WaitForTokens(WIFI_TOKEN_MASK(WIFI_TOKEN_GOT_IP))==WIFI_ERR_TIMEOUT){
+			return WIFI_ERR_IP;
+		}
+	}
+	return WIFI_OK;
+}
+
+/*
+ * Brings up the module without resetting it, from the speeds stored in the
+ * EEPROM by a previous wifi_Init(). The module keeps its association across
+ * Uzebox resets, so when it already has an IP address the whole init is a
+ * few AT commands. Returns WIFI_ERR when the slow path must be taken.
+ */
+static int _wifi_FastInit(){
+	struct EepromBlockStruct block;
+	u8 speed;
+	int r;
+
+	if(EepromReadBlock(WIFI_EEPROM_ID,&block)!=EEPROM_OK || block.data[WIFI_CACHE_VER]!=WIFI_CACHE_VERSION){
+		return WIFI_ERR;
+	}
+	if(block.data[WIFI_CACHE_MIN]==WIFI_UART_MIN_UBRR) failedSpeed=block.data[WIFI_CACHE_FAILED];
+
+	//left at the speed the last rom set, or power cycled and back to its default one
+	wifi_timeout=WIFI_PROBE_TIMEOUT;
+	speed=block.data[WIFI_CACHE_CUR];
+	if(!_wifi_Probe(speed)){
+		speed=block.data[WIFI_CACHE_DEF];
+		if(speed==block.data[WIFI_CACHE_CUR] || !_wifi_Probe(speed)) return WIFI_ERR;
+	}
+
+	#ifdef WIFI_DEBUG
+		printf_P(PSTR("wifi_debug - module found at speed %i\r\n"),speed);
+	#endif
+
+	//power cycled, negotiate the speed again
+	if(speed!=block.data[WIFI_CACHE_CUR]){
+		speed=_wifi_SetFastestSpeed(speed);
+		if(speed==0) return WIFI_ERR;
+		_wifi_SaveSpeeds(block.data[WIFI_CACHE_DEF],speed);
+	}
+
+	status=WIFI_STAT_READY;
+	_userCallBack(status);
+
+	wifi_timeout=WIFI_DEFAULT_TIMEOUT;
+	if(_wifi_SendCommandAndWait(PSTR("ATE0\r\n"),WIFI_TOKEN_OK)!=WIFI_OK) return WIFI_ERR;
+	status=WIFI_STAT_CONNECTED;
+	_userCallBack(status);
+
+	r=_wifi_WaitForIP();
+	if(r!=WIFI_OK) return r;
+	status=WIFI_STAT_IP;
+	_userCallBack(status);
+
+	return WIFI_OK;
+}
+
 /* Initialize the wifi module
  *
  * callCackFunc: user function to be called on status change
@@ -77,15 +351,26 @@ static void _wifi_SetUartSpeed(u8 speed){
  *  AT+CWJAP_DEF ssid,pwd
  *  AT+CIPMUX=0
  *  AT+SYSMSG_DEF=0
+ *
+ * The speeds that worked are kept in the EEPROM block WIFI_EEPROM_ID. When
+ * the module answers at one of them it is not reset: the boot banner, the
+ * association and AT+GMR are skipped and the link is up in a few frames.
+ * Otherwise the module is reset at each speed until it prints "ready".
+ * wifi_Tick() must be called during the init for the timeouts to expire.
  */
 int wifi_Init(wifi_CallBackFunc callBackFunc){
 	userCallBackFunc=callBackFunc;
 
 	u8 speed[] = {UART_9600_BAUD,UART_115200_BAUD,UART_57600_BAUD,UART_38400_BAUD,UART_19200_BAUD,0}; //try speeds in order of most common
-	int i=0;
+	int i=0,r;
 
 	PORTD|=(1<<ESP_RESET);
 
+	//enable module, a no-op when a previous rom left it running
+	DDRA|=(1<<ESP_ENABLE);
+	r=_wifi_FastInit();
+	if(r!=WIFI_ERR) return r;
+
 	wifi_timeout=60;
 
 
@@ -104,7 +389,7 @@ int wifi_Init(wifi_CallBackFunc callBackFunc){
 		#endif
 
 
-		if(wifi_WaitForString_P(PSTR("ready\r\n"),NULL)==WIFI_OK) {
+		if(wifi_WaitForTokens(WIFI_TOKEN_MASK(WIFI_TOKEN_READY))==WIFI_TOKEN_READY) {
 			break;
 		}
 
@@ -123,38 +408,34 @@ int wifi_Init(wifi_CallBackFunc callBackFunc){
 		printf_P(PSTR("wifi_debug -DEF Speed is %i\r\n"),speed[i]);
 	#endif
 
-	//Set the speed at 115200 bauds if not already set
-	if(speed[i]!=30){
-		wifi_SendString_P(PSTR("AT+UART_CUR=115200,8,1,0,0\r\n"));
-		wifi_WaitForString_P(PSTR("OK\r\n"),NULL);
-		UBRR0L=30;
+	//Set the fastest speed the kernel can receive at, 115200 bauds at least
+	r=_wifi_SetFastestSpeed(speed[i]);
+	if(r==0) return WIFI_ERR_INIT;
+	_wifi_SaveSpeeds(speed[i],r);
 
-		#ifdef WIFI_DEBUG
-			printf_P(PSTR("wifi_debug - Setting speed to 115200\r\n"));
-		#endif
-	}
+	#ifdef WIFI_DEBUG
+		printf_P(PSTR("wifi_debug - Speed set to %i\r\n"),r);
+	#endif
 
 
 	status=WIFI_STAT_READY;
 	_userCallBack(status);
 
 	wifi_timeout=WIFI_DEFAULT_TIMEOUT;
-	wifi_SendString_P(PSTR("ATE0\r\n"));
-	if(wifi_WaitForString_P(PSTR("OK\r\n"),NULL)==WIFI_ERR_TIMEOUT){
+	if(_wifi_SendCommandAndWait(PSTR("ATE0\r\n"),WIFI_TOKEN_OK)==WIFI_ERR_TIMEOUT){
 		return WIFI_ERR_CMD;
 	}
 	status=WIFI_STAT_CONNECTED;
 	_userCallBack(status);
 
 
-	if(wifi_WaitForString_P(PSTR("WIFI GOT IP\r\n"),NULL)==WIFI_ERR_TIMEOUT){
+	if(_wifi_WaitForIP()!=WIFI_OK){
 		return WIFI_ERR_IP;
 	}
 	status=WIFI_STAT_IP;
 	_userCallBack(status);
 
-	wifi_SendString_P(PSTR("AT+GMR\r\n"));
-	wifi_WaitForString_P(PSTR("OK\r\n"),NULL);
+	_wifi_SendCommandAndWait(PSTR("AT+GMR\r\n"),WIFI_TOKEN_OK);
 
 
 	return WIFI_OK;
@@ -165,19 +446,15 @@ void wifi_RestoreDefaultSettings(){
 
 	//todo: find uart speed
 
-	wifi_SendString_P(PSTR("AT+RESTORE\r\n"));
-	wifi_WaitForString_P(PSTR("OK\r\n"),NULL);
+	_wifi_SendCommandAndWait(PSTR("AT+RESTORE\r\n"),WIFI_TOKEN_OK);
 
-	wifi_SendString_P(PSTR("AT+UART_DEF=9600,8,1,0,0\r\n"));
-	wifi_WaitForString_P(PSTR("OK\r\n"),NULL);
+	_wifi_SendCommandAndWait(PSTR("AT+UART_DEF=9600,8,1,0,0\r\n"),WIFI_TOKEN_OK);
 
 	_wifi_SetUartSpeed(UART_9600_BAUD);
 
-	wifi_SendString_P(PSTR("AT+CWMODE_DEF=1\r\n"));
-	wifi_WaitForString_P(PSTR("OK\r\n"),NULL);
+	_wifi_SendCommandAndWait(PSTR("AT+CWMODE_DEF=1\r\n"),WIFI_TOKEN_OK);
 
-	wifi_SendString_P(PSTR("AT+CWJAP_DEF=\"uzenet\",\"h6dkj90xghrwx89hncx59ktre61hb2k77de67v1\"\r\n"));
-	wifi_WaitForString_P(PSTR("OK\r\n"),NULL);
+	_wifi_SendCommandAndWait(PSTR("AT+CWJAP_DEF=\"uzenet\",\"h6dkj90xghrwx89hncx59ktre61hb2k77de67v1\"\r\n"),WIFI_TOKEN_OK);
 
 	//AT+SAVETRANSLINK=0: wifi passthough-mode: not enabled by default.
 	//AT+CWDHCP_DEF=1,1: Enable DHCP for station mode
@@ -194,9 +471,280 @@ void wifi_Reset(){
 
 /*
  * Must be called by the main program once per field (60hz).
+ *
+ * Also runs the asynchronous command engine: sends the queued commands,
+ * matches the module's responses, delivers +IPD data and invokes the
+ * callbacks. It never waits, so call it from the main loop. The blocking
+ * functions must not be used while commands are queued or a data callback
+ * is set, as both would read the UART.
  */
 void wifi_Tick(){
 	vsyncCounter++;
+
+	wifi_Poll();
+
+	//the module waits for the payload even when its prompt was damaged on
+	//the wire, so it is sent anyway after a while
+	if(cmdCount!=0 && cmdState==CMD_PROMPT && ++cmdPromptWait>WIFI_PROMPT_TIMEOUT){
+		cmdState=CMD_DATA;
+	}
+
+	if(cmdCount!=0 && (u16)(vsyncCounter-cmdStartTick)>wifi_timeout){
+		_wifi_CommandDone(WIFI_ERR_TIMEOUT);
+	}
+}
+
+/*
+ * Runs the command engine without advancing the timeouts. Call it in a
+ * loop (with wifi_Tick() once per field) to drain the UART faster than
+ * once per frame, for example during a download.
+ */
+void wifi_Poll(){
+	if(cmdCount==0 && dataCallBackFunc==NULL) return;
+
+	_wifi_Receive();
+	_wifi_Transmit();
+}
+
+/*
+ * Queues an AT command made of a flash prefix, an optional RAM string and
+ * an optional flash suffix (which normally ends with "\r\n"). The callback
+ * gets WIFI_OK, WIFI_ERR_CMD or WIFI_ERR_TIMEOUT once the module answered.
+ * The RAM string must remain valid until then.
+ *
+ * Returns WIFI_ERR if the queue is full.
+ */
+int wifi_QueueCommand(const char* prefix, const char* str, const char* suffix, wifi_CommandCallBackFunc func){
+	if(cmdCount==WIFI_CMD_QUEUE_SIZE) return WIFI_ERR;
+
+	wifi_Command* cmd=&cmdQueue[(cmdHead+cmdCount)%WIFI_CMD_QUEUE_SIZE];
+	cmd->prefix=prefix;
+	cmd->str=str;
+	cmd->suffix=suffix;
+	cmd->data=NULL;
+	cmd->dataLen=0;
+	cmd->link=-1;
+	cmd->callBack=func;
+
+	if(cmdCount++==0) _wifi_CommandStart();
+	return WIFI_OK;
+}
+
+int wifi_QueueCommand_P(const char* cmd, wifi_CommandCallBackFunc func){
+	return wifi_QueueCommand(cmd,NULL,NULL,func);
+}
+
+/*
+ * Queues data for the open connection (AT+CIPSEND=len). The callback gets
+ * WIFI_OK on "SEND OK". The data must remain valid until then.
+ */
+int wifi_QueueSend(const u8* data, u16 len, wifi_CommandCallBackFunc func){
+	if(wifi_QueueCommand(PSTR("AT+CIPSEND="),NULL,PSTR("\r\n"),func)!=WIFI_OK) return WIFI_ERR;
+
+	wifi_Command* cmd=&cmdQueue[(cmdHead+cmdCount-1)%WIFI_CMD_QUEUE_SIZE];
+	cmd->data=data;
+	cmd->dataLen=len;
+	return WIFI_OK;
+}
+
+/*
+ * Queues data for one of the connections of a server (AT+CIPSEND=link,len),
+ * for example the one of the last +IPD (wifi_DataLink).
+ */
+int wifi_QueueSendTo(u8 link, const u8* data, u16 len, wifi_CommandCallBackFunc func){
+	if(wifi_QueueSend(data,len,func)!=WIFI_OK) return WIFI_ERR;
+
+	cmdQueue[(cmdHead+cmdCount-1)%WIFI_CMD_QUEUE_SIZE].link=link;
+	return WIFI_OK;
+}
+
+//Connection of the last +IPD received with AT+CIPMUX=1
+u8 wifi_DataLink(){
+	return ipdLink;
+}
+
+/*
+ * Sets the function receiving the +IPD payloads, in chunks of up to 32
+ * bytes. It is called with a NULL pointer and a zero length when the
+ * module reports the connection as CLOSED. NULL stops the engine from
+ * reading the UART while no command is queued.
+ */
+void wifi_SetDataCallBack(wifi_DataCallBackFunc func){
+	dataCallBackFunc=func;
+}
+
+/*
+ * Sets how long a command waits for its response, in frames, and returns
+ * the previous value. wifi_Init sets WIFI_DEFAULT_TIMEOUT (15 sec).
+ */
+u16 wifi_SetTimeout(u16 frames){
+	u16 previous=wifi_timeout;
+	wifi_timeout=frames;
+	return previous;
+}
+
+bool wifi_Busy(){
+	return (cmdCount!=0);
+}
+
+static void _wifi_CommandStart(){
+	cmdState=CMD_PREFIX;
+	cmdSendPos=0;
+	cmdPromptWait=0;
+	cmdStartTick=vsyncCounter;
+}
+
+static void _wifi_CommandDone(s8 result){
+	wifi_CommandCallBackFunc func=cmdQueue[cmdHead].callBack;
+
+	cmdHead=(cmdHead+1)%WIFI_CMD_QUEUE_SIZE;
+	if(--cmdCount!=0) _wifi_CommandStart();
+
+	//called last, so that it can queue the next command
+	if(func!=NULL) func(result);
+}
+
+//Sends as much of a flash string as the TX ring takes, true once all is sent
+static bool _wifi_SendPart_P(const char* str){
+	char c;
+	if(str!=NULL){
+		while((c=pgm_read_byte(str+cmdSendPos))!=0){
+			if(UartSendChar(c)==-1) return false;
+			cmdSendPos++;
+		}
+	}
+	cmdSendPos=0;
+	return true;
+}
+
+static bool _wifi_SendPart(const u8* data, u16 len){
+	if(data!=NULL){
+		cmdSendPos+=UartWriteBlock(data+cmdSendPos,len-cmdSendPos);
+		if(cmdSendPos!=len) return false;
+	}
+	cmdSendPos=0;
+	return true;
+}
+
+static void _wifi_Transmit(){
+	if(cmdCount==0) return;
+	wifi_Command* cmd=&cmdQueue[cmdHead];
+
+	switch(cmdState){
+		case CMD_PREFIX:
+			if(!_wifi_SendPart_P(cmd->prefix)) return;
+			if(cmd->data!=NULL && cmd->str==NULL){
+				char* p=cmdLenStr;
+				if(cmd->link>=0){
+					*p++='0'+cmd->link;
+					*p++=',';
+				}
+				utoa(cmd->dataLen,p,10);
+				cmd->str=cmdLenStr;
+			}
+			cmdState=CMD_STR;
+			//fall through
+		case CMD_STR:
+			if(cmd->str!=NULL && !_wifi_SendPart((const u8*)cmd->str,strlen(cmd->str))) return;
+			cmdState=CMD_SUFFIX;
+			//fall through
+		case CMD_SUFFIX:
+			if(!_wifi_SendPart_P(cmd->suffix)) return;
+			cmdState=(cmd->data!=NULL)?CMD_PROMPT:CMD_RESPONSE;
+			break;
+		case CMD_DATA:
+			if(!_wifi_SendPart(cmd->data,cmd->dataLen)) return;
+			cmdState=CMD_RESPONSE;
+			break;
+	}
+}
+
+//Handles a token recognized in the response stream
+static void _wifi_Token(u8 token){
+	s8 result;
+
+	switch(token){
+		case WIFI_TOKEN_OK:
+		case WIFI_TOKEN_SEND_OK:
+			result=WIFI_OK;
+			break;
+		case WIFI_TOKEN_ERROR:
+		case WIFI_TOKEN_FAIL:
+		case WIFI_TOKEN_SEND_FAIL:
+			result=WIFI_ERR_CMD;
+			break;
+		case WIFI_TOKEN_PROMPT:
+			if(cmdCount!=0 && cmdState==CMD_PROMPT) cmdState=CMD_DATA;
+			return;
+		case WIFI_TOKEN_IPD:
+			ipdHeader=true;
+			ipdLen=0;
+			return;
+		case WIFI_TOKEN_CLOSED:
+			if(dataCallBackFunc!=NULL) dataCallBackFunc(NULL,0);
+			return;
+		case WIFI_TOKEN_GOT_IP:
+			status=WIFI_STAT_IP;
+			_userCallBack(status);
+			return;
+		case WIFI_TOKEN_DISCONNECT:
+			status=WIFI_STAT_READY;
+			_userCallBack(status);
+			return;
+		default:
+			return;
+	}
+
+	if(cmdCount==0) return;
+
+	//the OK of AT+CIPSEND comes before its prompt
+	if(cmdState==CMD_RESPONSE || (cmdState==CMD_PROMPT && result!=WIFI_OK)){
+		_wifi_CommandDone(result);
+	}
+}
+
+static void _wifi_Receive(){
+	u8 buf[WIFI_CHUNK_SIZE];
+	u8 c,n;
+	s16 r;
+
+	while(1){
+		if(ipdRemaining!=0){
+			//payload bytes go straight to the data callback
+			n=UartReadBlock(buf,(ipdRemaining<sizeof(buf))?ipdRemaining:sizeof(buf));
+			if(n==0) return;
+			ipdRemaining-=n;
+			if(dataCallBackFunc!=NULL) dataCallBackFunc(buf,n);
+			continue;
+		}
+
+		//one byte at a time, so that the payload following a +IPD
+		//header stays in the ring
+		r=UartReadChar();
+		if(r==-1) return;
+		c=r&(0xff);
+		if(echo) _wifi_putchar(c);
+
+		if(ipdHeader){
+			//"+IPD,len:" or "+IPD,id,len:". A header damaged on the wire is
+			//dropped, rather than taking the responses after it as payload.
+			if(c==':'){
+				ipdHeader=false;
+				ipdRemaining=ipdLen;
+			}else if(c==','){
+				ipdLink=ipdLen;
+				ipdLen=0;
+			}else if(c>='0' && c<='9' && ipdLen<1000){
+				ipdLen=ipdLen*10+(c-'0');
+			}else{
+				ipdHeader=false;
+			}
+			continue;
+		}
+
+		c=_wifi_MatchToken(c);
+		if(c!=WIFI_TOKEN_NONE) _wifi_Token(c);
+	}
 }
 
 void wifi_Echo(bool echoOn){
@@ -216,35 +764,59 @@ int wifi_SendString_P(const char* str){
 }
 
 int wifi_SendString(char* str){
+	u16 len=strlen(str);
 
-	while(1){
-		char c=*str++;
-		if(c==0)break;
-		while(UartSendChar(c)==-1); //block if buffer full
-		if(echo) _wifi_putchar(c);
-	};
+	if(echo){
+		for(char* s=str;*s!=0;s++) _wifi_putchar(*s);
+	}
+
+	while(len!=0){
+		u16 n=UartWriteBlock((u8*)str,len); //block if buffer full
+		str+=n;
+		len-=n;
+	}
 
 	return WIFI_OK;
 }
 
+//Longest prefix of str ending the received text, after c mismatched at p
+static const char* _wifi_Fallback(const char* str, const char* p, u8 c){
+	u8 j=p-str,k,i;
+
+	for(k=j;k>0;k--){
+		if(pgm_read_byte(str+k-1)!=c) continue;
+		for(i=0;i<k-1;i++){
+			if(pgm_read_byte(str+i)!=pgm_read_byte(str+j-k+1+i)) break;
+		}
+		if(i==k-1) return str+k;
+	}
+	return str;
+}
+
 int wifi_WaitForString_P(const char* str, char* rxbuf){
-	u8 c;
-	s16 result;
+	u8 c,i,n;
+	u8 buf[16];
 	const char* p=str;
 	vsyncCounter=0;
 
 	while(1){
-		result=UartReadChar();
-		if(result!=-1){
+		//The match can not end before the rest of the string is received,
+		//so reading that many bytes never consumes data following it.
+		n=strlen_P(p);
+		if(n>sizeof(buf)) n=sizeof(buf);
+		n=UartReadBlock(buf,n);
+
+		for(i=0;i<n;i++){
 
-			c=result&(0xff);
+			c=buf[i];
 			if(rxbuf!=NULL)*rxbuf++=c;
 			if(echo)	_wifi_putchar(c);
 
-			if(c==pgm_read_byte(p++)){
+			if(c==pgm_read_byte(p)){
+				p++;
 				if(pgm_read_byte(p)==0)	return WIFI_OK;
 			}else{
-				p=str; //reset string compare
+				p=_wifi_Fallback(str,p,c); //overlapping prefixes, "OOK" matches "OK"
 			}
 		}
 
@@ -254,6 +826,41 @@ int wifi_WaitForString_P(const char* str, char* rxbuf){
 	}
 }
 
+/*
+ * Waits for one of the AT response tokens of uzenet_tokens.h, given as a
+ * mask of WIFI_TOKEN_MASK(WIFI_TOKEN_xxx). Returns the token received or
+ * WIFI_ERR_TIMEOUT. All the tokens are looked for in a single pass, so a
+ * caller can wait for OK and ERROR (or SEND OK, CLOSED and +IPD) at once.
+ */
+int wifi_WaitForTokens(u16 mask){
+	s16 r;
+	u8 token;
+	vsyncCounter=0;
+
+	while(1){
+		r=UartReadChar();
+		if(r!=-1){
+			if(echo) _wifi_putchar(r);
+			token=_wifi_MatchToken(r);
+			if(mask&WIFI_TOKEN_MASK(token)) return token;
+		}
+
+		if(vsyncCounter>wifi_timeout){
+			return WIFI_ERR_TIMEOUT;
+		}
+	}
+}
+
+//Waits for the given token, an error response ends the wait early
+static int _wifi_WaitFor(u8 token){
+	int r=wifi_WaitForTokens(WIFI_TOKEN_MASK(token)|WIFI_TOKEN_MASK(WIFI_TOKEN_ERROR)|
+		WIFI_TOKEN_MASK(WIFI_TOKEN_FAIL)|WIFI_TOKEN_MASK(WIFI_TOKEN_SEND_FAIL));
+
+	if(r==token) return WIFI_OK;
+	if(r==WIFI_ERR_TIMEOUT) return r;
+	return WIFI_ERR_CMD;
+}
+
 int wifi_TcpConnect(char* host, u16 port, bool passthrough){
 	char port_str[6];
 	itoa(port,port_str,10);
@@ -263,16 +870,34 @@ int wifi_TcpConnect(char* host, u16 port, bool passthrough){
 	wifi_SendString("\",");
 	wifi_SendString(port_str);
 	wifi_SendString(",7200\r\n");
-	if(wifi_WaitForString_P(PSTR("OK\r\n"),NULL)!=WIFI_OK) return WIFI_ERR;
+	if(_wifi_WaitFor(WIFI_TOKEN_OK)!=WIFI_OK) return WIFI_ERR;
 
 	if(passthrough){
-		if(_wifi_SendCommandAndWait(PSTR("AT+CIPMODE=1\r\n"),PSTR("OK\r\n"))!=WIFI_OK) return WIFI_ERR;
-		if(_wifi_SendCommandAndWait(PSTR("AT+CIPSEND\r\n"),PSTR(">"))) return WIFI_ERR;
+		if(_wifi_SendCommandAndWait(PSTR("AT+CIPMODE=1\r\n"),WIFI_TOKEN_OK)!=WIFI_OK) return WIFI_ERR;
+		if(_wifi_SendCommandAndWait(PSTR("AT+CIPSEND\r\n"),WIFI_TOKEN_PROMPT)!=WIFI_OK) return WIFI_ERR;
 	}
 
 	return WIFI_OK;
 }
 
+/*
+ * Starts a TCP server on the module (AT+CIPMUX=1, AT+CIPSERVER). The data
+ * of the clients comes as "+IPD,link,len:" segments to the data callback,
+ * and wifi_QueueSendTo answers them.
+ */
+int wifi_TcpListen(u16 port){
+	char port_str[6];
+	itoa(port,port_str,10);
+
+	if(_wifi_SendCommandAndWait(PSTR("AT+CIPMUX=1\r\n"),WIFI_TOKEN_OK)!=WIFI_OK) return WIFI_ERR;
+	wifi_SendString_P(PSTR("AT+CIPSERVER=1,"));
+	wifi_SendString(port_str);
+	wifi_SendString("\r\n");
+	if(_wifi_WaitFor(WIFI_TOKEN_OK)!=WIFI_OK) return WIFI_ERR;
+
+	return WIFI_OK;
+}
+
 
 u8 wifi_UnreadCount(){
 	return UartUnreadCount();
@@ -282,7 +907,7 @@ s16 wifi_ReadChar(){
 	return UartReadChar();
 }
 
-s16 wifi_SendChar(char c){
+int wifi_SendChar(char c){
 	while(UartSendChar(c)==-1); //block if buffer full
 	if(echo) _wifi_putchar(c);
 	return WIFI_OK; //todo: timeout?
@@ -301,28 +926,34 @@ int ReceiveHtmlBody(char* rxbuf,int len){
 
 	while(1){
 
-		r=UartReadChar();
+		if(inBody){
+			//copy the body straight from the receive buffer
+			u16 n=UartReadBlock((u8*)buf,len-headerSize-bodySize);
+			if(echo){
+				for(u16 i=0;i<n;i++) _wifi_putchar(buf[i]);
+			}
+			buf+=n;
+			bodySize+=n;
+			r=-1;
+		}else{
+			r=UartReadChar();
+		}
+
 		if(r!=-1){
 
 			c=r&(0xff);
 			if(echo) _wifi_putchar(c);
 
-			if(inBody){
-				*buf=c;
-				buf++;
-				bodySize++;
-			}else{
-				if(c==pgm_read_byte(p)){
-					p++;
-					if(pgm_read_byte(p)==0){
-						inBody=true;
-					}
-				}else{
-					//reset string compare
-					p=bodyMarker;
+			if(c==pgm_read_byte(p)){
+				p++;
+				if(pgm_read_byte(p)==0){
+					inBody=true;
 				}
-				headerSize++;
+			}else{
+				//reset string compare
+				p=bodyMarker;
 			}
+			headerSize++;
 
 		}
 
@@ -340,62 +971,31 @@ int ReceiveHtmlBody(char* rxbuf,int len){
 }
 
 //wait for +IPD marker and return size of data
-const char ipd[] PROGMEM = "+IPD,0,";
 int WaitforIPD(){
-	u8 c;
-	s16 data;
+	s16 r;
+	u16 len=0;
 
-	const char* p=ipd;
-	char rxbuf[16];
-	char* buf=rxbuf;
-	vsyncCounter=0;
+	r=wifi_WaitForTokens(WIFI_TOKEN_MASK(WIFI_TOKEN_IPD));
+	if(r<0) return r;
 
+	//"len:" or "id,len:"
 	while(1){
-		data=UartReadChar();
-		if(data!=-1){
-
-			c=data&(0xff);
-			if(echo) _wifi_putchar(c);
-
-			if(c==pgm_read_byte(p)){
-				p++;
-				if(pgm_read_byte(p)==0){
-
-					//now wait for the ":"character
-					while(1){
-						data=UartReadChar();
-						if(data!=-1){
-							c=data&(0xff);
-							*buf=c;
-							if(echo) _wifi_putchar(c);
-							if(c==':'){
-								*buf=0;
-								break;
-							}
-							buf++;
-						}
-						if(vsyncCounter>wifi_timeout) return WIFI_ERR_TIMEOUT;
-					}
-					//extract size value from buffer
-					return atoi(rxbuf);
-				}
-			}else{
-				//reset string compare
-				p=ipd;
-			}
+		r=UartReadChar();
+		if(r!=-1){
+			if(echo) _wifi_putchar(r);
+			if(r==':') return len;
+			len=(r==',')?0:(len*10+(r-'0'));
 		}
-
 		if(vsyncCounter>wifi_timeout) return WIFI_ERR_TIMEOUT;
 	}
-
 }
 
 
 
 
-static int _wifi_SendCommandAndWait(const char* strToSend, const char* strToWait){
+static int _wifi_SendCommandAndWait(const char* strToSend, u8 token){
 	wifi_SendString_P(strToSend);
-	return wifi_WaitForString_P(strToWait, NULL);
+	return _wifi_WaitFor(token);
 }
 
 //int SendDataAndWait(const char* strToSend, const char* strToWait){
@@ -407,26 +1007,333 @@ int HttpGet(char* host,u16 port,char* url, HttpResponse* response){
 	wifi_SendString_P(PSTR("AT+CIPSTART=\"TCP\",\""));
 	wifi_SendString(host);
 	wifi_SendString_P(PSTR("\",80\r\n"));
-	wifi_WaitForString_P(PSTR("OK\r\n"),NULL);
-	_wifi_SendCommandAndWait(PSTR("AT+CIPSENDEX=256\r\n\f"),PSTR(">"));
+	_wifi_WaitFor(WIFI_TOKEN_OK);
+	_wifi_SendCommandAndWait(PSTR("AT+CIPSENDEX=256\r\n\f"),WIFI_TOKEN_PROMPT);
 	wifi_SendString_P(PSTR("GET "));
 	wifi_SendString(url);
 	wifi_SendString_P(PSTR(" HTTP/1.0\r\nHost: "));
 	wifi_SendString(host);
 	wifi_SendString_P(PSTR(":80\r\n\r\n\f"));
-	wifi_WaitForString_P(PSTR("SEND OK\r\n"),NULL);
+	_wifi_WaitFor(WIFI_TOKEN_SEND_OK);
 
 	int len=WaitforIPD();
 	if(len<0)return len; //error!
 	int res=ReceiveHtmlBody(response->content,len);
 	if(res<0)return res; //error!
 
-	wifi_WaitForString_P(PSTR("CLOSED\r\n"),NULL);
+	wifi_WaitForTokens(WIFI_TOKEN_MASK(WIFI_TOKEN_CLOSED));
 
 	return WIFI_OK;
 }
 
 
+/*
+ * Streaming HTTP client, running on the asynchronous command engine
+ */
+#define HTTP_STATUS		0	//waiting for the status line
+#define HTTP_HEADER		1
+#define HTTP_BODY		2	//plain body, Content-Length or up to CLOSED
+#define HTTP_CHUNK_SIZE	3
+#define HTTP_CHUNK_DATA	4
+#define HTTP_CHUNK_END	5	//CRLF following the chunk data
+#define HTTP_DONE		6
+
+//Longest line kept, a whole "Content-Range: bytes first-last/total" with
+//32 bit values. The rest of a longer line is dropped.
+#define HTTP_LINE_SIZE	64
+
+static char httpRequest[HTTP_REQUEST_SIZE];
+static char httpTarget[40];
+static char httpLine[HTTP_LINE_SIZE];
+static u8 httpLineLen,httpState=HTTP_DONE;
+static bool httpLineCut;
+static bool httpChunked,httpKeepAlive=false,httpOpen=false,httpReused,httpPersist;
+static u16 httpCode;
+static u32 httpRemaining,httpContentLength,httpTotalLength,httpSkip,httpOffset;
+static HttpBodyFunc httpBodyFunc;
+static HttpDoneFunc httpDoneFunc;
+
+static void _http_Connected(s8 result);
+
+static void _http_Done(s8 result){
+	httpState=HTTP_DONE;
+	wifi_SetDataCallBack(NULL);
+
+	//the server closes the connection unless both sides keep it
+	if(result!=WIFI_OK || !httpPersist) httpOpen=false;
+
+	if(httpDoneFunc!=NULL) httpDoneFunc(result,httpCode);
+}
+
+//Opens a new connection for the request, closing the one that was kept
+static int _http_Connect(){
+	if(httpOpen){
+		httpOpen=false;
+		wifi_QueueCommand_P(PSTR("AT+CIPCLOSE\r\n"),NULL);
+	}
+	return wifi_QueueCommand(PSTR("AT+CIPSTART=\"TCP\",\""),httpTarget,PSTR("\r\n"),_http_Connected);
+}
+
+//Handles a complete status, header or chunk size line
+static void _http_Line(){
+	char* p;
+
+	switch(httpState){
+		case HTTP_STATUS:
+			if(strncmp_P(httpLine,PSTR("HTTP/"),5)==0){
+				char* code=strchr(httpLine,' ');
+				if(code!=NULL) httpCode=atoi(code+1);
+				//HTTP/1.0 servers close after each response
+				httpPersist=httpKeepAlive && (strncmp_P(httpLine,PSTR("HTTP/1.0"),8)!=0);
+				httpState=HTTP_HEADER;
+			}
+			break;
+
+		case HTTP_HEADER:
+			if(httpLineLen!=0){
+				//a cut header would give a wrong value, the status and
+				//chunk size lines only need their start
+				if(httpLineCut) break;
+				if(strncasecmp_P(httpLine,PSTR("Content-Length:"),15)==0){
+					httpContentLength=strtoul(httpLine+15,NULL,10);
+				}else if(strncasecmp_P(httpLine,PSTR("Transfer-Encoding:"),18)==0){
+					httpChunked=(strstr_P(httpLine,PSTR("chunked"))!=NULL);
+				}else if(strncasecmp_P(httpLine,PSTR("Content-Range:"),14)==0){
+					//bytes first-last/total
+					p=strchr(httpLine,'/');
+					if(p!=NULL && p[1]!='*') httpTotalLength=strtoul(p+1,NULL,10);
+				}else if(strncasecmp_P(httpLine,PSTR("Connection:"),11)==0){
+					if(strstr_P(httpLine,PSTR("close"))!=NULL) httpPersist=false;
+				}
+				break;
+			}
+
+			//end of the headers
+			if(httpCode==200){
+				//the server ignored the range, drop what the caller already has
+				httpSkip=httpOffset;
+				httpTotalLength=httpContentLength;
+			}else if(httpCode!=206){
+				httpOffset=0;
+			}
+
+			if(httpCode<200 || httpCode>299){
+				httpPersist=false;
+				_http_Done(WIFI_ERR_HTTP);
+			}else if(httpChunked){
+				httpState=HTTP_CHUNK_SIZE;
+			}else if(httpContentLength==0){
+				_http_Done(WIFI_OK);
+			}else{
+				//a body delimited by the close can not be followed by another response
+				if(httpContentLength==HTTP_UNTIL_CLOSED) httpPersist=false;
+				httpRemaining=httpContentLength;
+				httpState=HTTP_BODY;
+			}
+			break;
+
+		case HTTP_CHUNK_SIZE:
+			httpRemaining=strtoul(httpLine,NULL,16);
+			if(httpRemaining==0){
+				_http_Done(WIFI_OK); //trailers are ignored
+			}else{
+				httpState=HTTP_CHUNK_DATA;
+			}
+			break;
+
+		case HTTP_CHUNK_END:
+			httpState=HTTP_CHUNK_SIZE;
+			break;
+	}
+}
+
+//Data callback, gets the payload of the +IPD segments
+static void _http_Data(u8* data, u16 len){
+	u8 c;
+	u16 n;
+
+	if(data==NULL){
+		//connection closed
+		httpOpen=false;
+		if(httpReused && httpState==HTTP_STATUS && httpLineLen==0){
+			//the server dropped the kept connection before answering, retry on a new one
+			httpReused=false;
+			if(_http_Connect()!=WIFI_OK) _http_Done(WIFI_ERR);
+		}else if(httpState==HTTP_BODY && httpContentLength==HTTP_UNTIL_CLOSED){
+			_http_Done(WIFI_OK);
+		}else if(httpState!=HTTP_DONE){
+			_http_Done(WIFI_ERR_RECEIVE);
+		}
+		return;
+	}
+
+	while(len!=0 && httpState!=HTTP_DONE){
+
+		if(httpState==HTTP_BODY || httpState==HTTP_CHUNK_DATA){
+			n=(len<httpRemaining)?len:httpRemaining;
+			if(httpSkip!=0){
+				if(n>httpSkip) n=httpSkip;
+				httpSkip-=n;
+			}else{
+				httpBodyFunc(data,n);
+			}
+			data+=n;
+			len-=n;
+
+			if(httpRemaining!=HTTP_UNTIL_CLOSED){
+				httpRemaining-=n;
+				if(httpRemaining==0){
+					if(httpState==HTTP_BODY){
+						_http_Done(WIFI_OK);
+					}else{
+						httpState=HTTP_CHUNK_END;
+					}
+				}
+			}
+			continue;
+		}
+
+		c=*data++;
+		len--;
+		if(c=='\n'){
+			if(httpLineLen!=0 && httpLine[httpLineLen-1]=='\r') httpLineLen--;
+			httpLine[httpLineLen]=0;
+			_http_Line();
+			httpLineLen=0;
+			httpLineCut=false;
+		}else if(httpLineLen<(sizeof(httpLine)-1)){
+			httpLine[httpLineLen++]=c;
+		}else{
+			httpLineCut=true;
+		}
+	}
+}
+
+static void _http_Sent(s8 result){
+	if(result==WIFI_OK) return;
+
+	if(httpReused){
+		//"link is not valid": the kept connection was closed meanwhile
+		httpReused=false;
+		httpOpen=false;
+		if(_http_Connect()!=WIFI_OK) _http_Done(WIFI_ERR);
+	}else{
+		_http_Done(result);
+	}
+}
+
+static void _http_Connected(s8 result){
+	if(result!=WIFI_OK){
+		_http_Done(result);
+		return;
+	}
+	httpOpen=true;
+	wifi_SetDataCallBack(_http_Data);
+	if(wifi_QueueSend((u8*)httpRequest,strlen(httpRequest),_http_Sent)!=WIFI_OK){
+		_http_Done(WIFI_ERR);
+	}
+}
+
+/*
+ * Keeps the connection open after each response (HTTP/1.1 persistent
+ * connections), so that the next request to the same host and port skips
+ * AT+CIPSTART and the TCP handshake. Off by default. A connection the
+ * server closed meanwhile is opened again transparently.
+ */
+void HttpSetKeepAlive(bool keepAlive){
+	httpKeepAlive=keepAlive;
+}
+
+//Closes the connection kept by HttpSetKeepAlive
+int HttpClose(){
+	if(!httpOpen) return WIFI_OK;
+	httpOpen=false;
+	return wifi_QueueCommand_P(PSTR("AT+CIPCLOSE\r\n"),NULL);
+}
+
+/*
+ * Starts an HTTP GET and streams the response body to bodyFunc as it
+ * arrives, so that it can be of any size (Content-Length, chunked or up to
+ * the connection close). bodyFunc can write to the SD card, it is called
+ * from wifi_Tick() / wifi_Poll(). doneFunc gets WIFI_OK once the whole
+ * body was passed, WIFI_ERR_HTTP for a non 2xx response code (the body is
+ * not passed), or the error of the connection.
+ *
+ * A non zero offset asks for the body from that byte on (Range request),
+ * to resume an interrupted download. If the server ignores the range the
+ * bytes before it are dropped, so bodyFunc always starts at the offset. A
+ * server answers 416 when the offset is past the end of the file.
+ *
+ * Returns WIFI_ERR if the request does not fit in HTTP_REQUEST_SIZE or the
+ * command queue is busy.
+ */
+int HttpGetRange(char* host, u16 port, char* url, u32 offset, HttpBodyFunc bodyFunc, HttpDoneFunc doneFunc){
+	char port_str[6];
+	char target[sizeof(httpTarget)];
+	char num[11];
+	int r;
+	itoa(port,port_str,10);
+
+	if(wifi_Busy() || strlen(host)+strlen(port_str)+3>sizeof(target)) return WIFI_ERR;
+	if(strlen(url)+strlen(host)+72>sizeof(httpRequest)) return WIFI_ERR;
+
+	//host",port for AT+CIPSTART
+	strcpy(target,host);
+	strcat_P(target,PSTR("\","));
+	strcat(target,port_str);
+
+	strcpy_P(httpRequest,PSTR("GET "));
+	strcat(httpRequest,url);
+	strcat_P(httpRequest,PSTR(" HTTP/1.1\r\nHost: "));
+	strcat(httpRequest,host);
+	if(offset!=0){
+		strcat_P(httpRequest,PSTR("\r\nRange: bytes="));
+		ultoa(offset,num,10);
+		strcat(httpRequest,num);
+		strcat_P(httpRequest,PSTR("-"));
+	}
+	if(!httpKeepAlive) strcat_P(httpRequest,PSTR("\r\nConnection: close"));
+	strcat_P(httpRequest,PSTR("\r\n\r\n"));
+
+	httpBodyFunc=bodyFunc;
+	httpDoneFunc=doneFunc;
+	httpState=HTTP_STATUS;
+	httpLineLen=0;
+	httpLineCut=false;
+	httpChunked=false;
+	httpCode=0;
+	httpContentLength=HTTP_UNTIL_CLOSED;
+	httpTotalLength=HTTP_UNTIL_CLOSED;
+	httpRemaining=HTTP_UNTIL_CLOSED;
+	httpOffset=offset;
+	httpSkip=0;
+
+	//the data callback is set once connected, the CLOSED of AT+CIPCLOSE is not ours
+	httpReused=(httpOpen && strcmp(target,httpTarget)==0);
+	if(httpReused){
+		wifi_SetDataCallBack(_http_Data);
+		r=wifi_QueueSend((u8*)httpRequest,strlen(httpRequest),_http_Sent);
+	}else{
+		strcpy(httpTarget,target);
+		r=_http_Connect();
+	}
+	if(r!=WIFI_OK){
+		httpState=HTTP_DONE;
+		wifi_SetDataCallBack(NULL);
+	}
+	return r;
+}
 
+int HttpGetStream(char* host, u16 port, char* url, HttpBodyFunc bodyFunc, HttpDoneFunc doneFunc){
+	return HttpGetRange(host,port,url,0,bodyFunc,doneFunc);
+}
 
+//Body size announced by the server, HTTP_UNTIL_CLOSED if unknown
+u32 HttpContentLength(){
+	return httpContentLength;
+}
 
+//Size of the whole file, also known for a range response, HTTP_UNTIL_CLOSED if unknown
+u32 HttpTotalLength(){
+	return httpTotalLength;
+}
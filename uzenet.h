@@ -8,6 +8,8 @@
 #ifndef UZENET_H_
 #define UZENET_H_
 
+#include "uzenet_tokens.h"
+
 #define WIFI_OK					0
 
 #define WIFI_STAT_UNINIT		0
@@ -21,26 +23,42 @@
 #define WIFI_ERR_INIT			-4
 #define WIFI_ERR_IP				-5
 #define WIFI_ERR_CMD			-6
+#define WIFI_ERR_HTTP			-7
 
 #define HTTP_GET	0
 #define HTTP_POST	1
 
 
 typedef void (*wifi_CallBackFunc)(s8 status);
+typedef void (*wifi_CommandCallBackFunc)(s8 result);
+typedef void (*wifi_DataCallBackFunc)(u8* data, u16 len);
 
 extern void wifi_Tick();
+extern void wifi_Poll();
 extern void wifi_Reset();
 extern void wifi_Echo(bool echoOn);
 extern int 	wifi_Init(wifi_CallBackFunc func);
 extern int 	wifi_SendString_P(const char* str);
 extern int 	wifi_SendString(char* str);
 extern int 	wifi_WaitForString_P(const char* str, char* rxbuf);
+extern int 	wifi_WaitForTokens(u16 mask);
 extern int 	wifi_TcpConnect(char* host, u16 port, bool passthrough);
+extern int 	wifi_TcpListen(u16 port);
 extern u8   wifi_UnreadCount();
 extern s16  wifi_ReadChar();
 extern int  wifi_SendChar(char c);
 extern void wifi_RestoreDefaultSettings();
 
+//Asynchronous commands, processed by wifi_Tick()
+extern int  wifi_QueueCommand(const char* prefix, const char* str, const char* suffix, wifi_CommandCallBackFunc func);
+extern int  wifi_QueueCommand_P(const char* cmd, wifi_CommandCallBackFunc func);
+extern int  wifi_QueueSend(const u8* data, u16 len, wifi_CommandCallBackFunc func);
+extern int  wifi_QueueSendTo(u8 link, const u8* data, u16 len, wifi_CommandCallBackFunc func);
+extern u8   wifi_DataLink();
+extern void wifi_SetDataCallBack(wifi_DataCallBackFunc func);
+extern bool wifi_Busy();
+extern u16  wifi_SetTimeout(u16 frames);
+
 
 //TODO: put in some other lib
 
@@ -59,5 +77,21 @@ typedef struct {
 
 extern int HttpGet(char* host,u16 port,char* url, HttpResponse* response);
 
+//Streaming GET, see uzenet.c
+#ifndef HTTP_REQUEST_SIZE
+	#define HTTP_REQUEST_SIZE 128
+#endif
+#define HTTP_UNTIL_CLOSED	0xffffffffUL
+
+typedef void (*HttpBodyFunc)(u8* data, u16 len);
+typedef void (*HttpDoneFunc)(s8 result, u16 responseCode);
+
+extern int HttpGetStream(char* host, u16 port, char* url, HttpBodyFunc bodyFunc, HttpDoneFunc doneFunc);
+extern int HttpGetRange(char* host, u16 port, char* url, u32 offset, HttpBodyFunc bodyFunc, HttpDoneFunc doneFunc);
+extern void HttpSetKeepAlive(bool keepAlive);
+extern int HttpClose();
+extern u32 HttpContentLength();
+extern u32 HttpTotalLength();
+
 
 #endif /* UZENET_H_ */
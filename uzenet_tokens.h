@@ -0,0 +1,100 @@
+/*
+ * uzenet_tokens.h
+ *
+ * Generated by uzenet_tokens.py, do not edit.
+ * AT response matcher: 14 tokens, 104 states, 30 byte classes, 122 transitions
+ */
+
+#ifndef UZENET_TOKENS_H_
+#define UZENET_TOKENS_H_
+
+#define WIFI_TOKEN_NONE			0
+#define WIFI_TOKEN_OK					1	//OK\r\n
+#define WIFI_TOKEN_ERROR				2	//ERROR\r\n
+#define WIFI_TOKEN_FAIL					3	//FAIL\r\n
+#define WIFI_TOKEN_SEND_OK				4	//SEND OK\r\n
+#define WIFI_TOKEN_SEND_FAIL			5	//SEND FAIL\r\n
+#define WIFI_TOKEN_CLOSED				6	//CLOSED\r\n
+#define WIFI_TOKEN_IPD					7	//+IPD,
+#define WIFI_TOKEN_PROMPT				8	//>
+#define WIFI_TOKEN_READY				9	//ready\r\n
+#define WIFI_TOKEN_CONNECT				10	//CONNECT\r\n
+#define WIFI_TOKEN_GOT_IP				11	//WIFI GOT IP\r\n
+#define WIFI_TOKEN_DISCONNECT			12	//WIFI DISCONNECT\r\n
+#define WIFI_TOKEN_CONNECTED			13	//WIFI CONNECTED\r\n
+#define WIFI_TOKEN_STATUS				14	//STATUS:
+
+#define WIFI_TOKEN_MASK(t)		(1U<<(t))
+
+#endif /* UZENET_TOKENS_H_ */
+
+
+//Tables, for the matcher in uzenet.c only
+#if defined(UZENET_TOKENS_TABLES) && !defined(UZENET_TOKENS_TABLES_H_)
+#define UZENET_TOKENS_TABLES_H_
+
+#define TOKEN_FIRST_CHAR	10
+#define TOKEN_LAST_CHAR		121
+
+//Byte class of the characters TOKEN_FIRST_CHAR..TOKEN_LAST_CHAR
+static const u8 tokenClass[] PROGMEM = {
+	1,0,0,2,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,3,0,0,0,0,0,0,0,0,0,
+	0,4,5,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	6,0,0,0,7,0,0,8,0,9,10,11,12,13,0,14,
+	0,15,16,0,17,18,19,0,20,21,22,23,0,24,0,0,
+	0,0,0,0,0,0,0,25,0,0,26,27,0,0,0,0,
+	0,0,0,0,0,0,0,0,28,0,0,0,0,0,0,29,
+};
+
+//Next state from the initial state, per byte class
+static const u8 tokenRoot[] PROGMEM = {
+	0,0,0,0,41,0,0,46,0,33,0,5,12,0,0,0,
+	0,0,1,0,0,18,0,0,62,0,0,0,47,0,
+};
+
+//Transitions of each state that differ from tokenRoot: tokenRow[s]..tokenRow[s+1]-1
+static const u8 tokenRow[] PROGMEM = {
+	0,0,1,2,3,3,4,5,6,8,9,10,10,11,12,13,
+	14,15,15,17,19,20,21,23,24,25,26,26,27,28,29,30,
+	31,31,33,34,36,38,41,42,43,43,44,45,46,47,47,47,
+	48,49,50,51,52,53,53,55,56,57,59,62,63,64,64,65,
+	66,68,69,72,73,75,76,77,78,79,80,80,81,82,85,87,
+	89,90,91,93,96,97,98,98,100,102,103,104,106,109,111,113,
+	114,115,115,116,117,118,119,122,122,
+};
+
+static const u8 tokenEdgeClass[] PROGMEM = {
+	15,2,1,20,20,18,15,20,2,1,8,14,16,2,1,11,
+	22,17,20,10,3,12,18,15,2,1,8,14,16,2,1,16,
+	18,18,15,21,11,22,10,17,20,2,1,14,19,10,5,27,
+	25,26,29,2,1,15,17,17,11,9,20,16,18,22,2,1,
+	14,12,8,14,3,9,10,13,18,15,22,3,14,19,2,1,
+	14,21,9,11,22,16,18,15,17,17,11,9,20,16,18,22,
+	2,1,16,18,15,17,17,11,9,20,16,18,22,2,11,10,
+	20,2,1,8,22,23,21,6,11,22,
+};
+
+static const u8 tokenEdgeState[] PROGMEM = {
+	2,3,4,6,7,8,2,9,10,11,13,14,15,16,17,19,
+	98,20,6,21,22,27,23,24,25,26,28,29,30,31,32,34,
+	54,35,2,36,37,98,38,20,6,39,40,42,43,44,45,48,
+	49,50,51,52,53,2,55,56,57,58,6,34,54,59,60,61,
+	63,64,13,65,66,87,75,67,68,2,69,70,71,72,73,74,
+	76,77,78,19,98,34,79,2,80,81,82,83,6,34,54,84,
+	85,86,34,88,2,89,90,91,92,6,34,54,93,60,94,95,
+	6,96,97,99,100,101,102,103,19,98,
+};
+
+//Token recognized on entering each state
+static const u8 tokenOutput[] PROGMEM = {
+	0,0,0,0,1,0,0,0,0,0,0,2,0,0,0,0,
+	0,3,0,0,0,0,0,0,0,0,4,0,0,0,0,0,
+	5,0,0,0,0,0,0,0,6,0,0,0,0,7,8,0,
+	0,0,0,0,0,9,0,0,0,0,0,0,0,10,0,0,
+	0,0,0,0,0,0,0,0,0,0,11,0,0,0,0,0,
+	0,0,0,0,0,0,12,0,0,0,0,0,0,0,0,0,
+	0,13,0,0,0,0,0,14,
+};
+
+#endif
@@ -0,0 +1,145 @@
+# Generates uzenet_tokens.h, the automaton matching the ESP8266 AT responses in uzenet.c.
+# Run it again after changing the token list: python3 uzenet_tokens.py > uzenet_tokens.h
+#
+# It is an Aho-Corasick automaton turned into a deterministic one, so the matcher does a
+# single step per received byte whatever the number of tokens, and overlapping prefixes
+# ("OOK\r\n", "SEND SEND OK\r\n") are matched. A state only stores the transitions that
+# differ from the ones of the initial state, which keeps the tables small.
+
+import sys
+
+# Tokens: name, text. The longest token ending at a byte is the one reported.
+tokens = [
+    ('OK',         'OK\r\n'),
+    ('ERROR',      'ERROR\r\n'),
+    ('FAIL',       'FAIL\r\n'),
+    ('SEND_OK',    'SEND OK\r\n'),
+    ('SEND_FAIL',  'SEND FAIL\r\n'),
+    ('CLOSED',     'CLOSED\r\n'),
+    ('IPD',        '+IPD,'),
+    ('PROMPT',     '>'),
+    ('READY',      'ready\r\n'),
+    ('CONNECT',    'CONNECT\r\n'),
+    ('GOT_IP',     'WIFI GOT IP\r\n'),
+    ('DISCONNECT', 'WIFI DISCONNECT\r\n'),
+    ('CONNECTED',  'WIFI CONNECTED\r\n'),
+    ('STATUS',     'STATUS:'),
+]
+
+# Byte classes: each character used by a token, class 0 for every other byte
+chars = sorted(set(''.join(text for name, text in tokens)))
+charClass = {c: i + 1 for i, c in enumerate(chars)}
+classes = len(chars) + 1
+
+# Trie
+goto = [{}]
+output = [0]
+for tokenId, (name, text) in enumerate(tokens, 1):
+    state = 0
+    for c in text:
+        if c not in goto[state]:
+            goto.append({})
+            output.append(0)
+            goto[state][c] = len(goto) - 1
+        state = goto[state][c]
+    output[state] = tokenId
+
+# Failure links in breadth first order, then the complete transition function
+fail = [0] * len(goto)
+delta = [[0] * classes for s in goto]
+order = [0]
+for state in order:
+    for c, nextState in goto[state].items():
+        order.append(nextState)
+        if state != 0:
+            f = fail[state]
+            while f != 0 and c not in goto[f]: f = fail[f]
+            fail[nextState] = goto[f].get(c, 0)
+            if output[nextState] == 0: output[nextState] = output[fail[nextState]]
+for state in order:
+    for c in chars:
+        cls = charClass[c]
+        if c in goto[state]:
+            delta[state][cls] = goto[state][c]
+        elif state != 0:
+            delta[state][cls] = delta[fail[state]][cls]
+
+if len(goto) > 255:
+    sys.exit("Too many states for an u8 state index")
+
+# Sparse rows: the transitions that differ from the initial state
+rows = [0]
+edgeClass = []
+edgeState = []
+for state in range(len(goto)):
+    for cls in range(classes):
+        if state != 0 and delta[state][cls] != delta[0][cls]:
+            edgeClass.append(cls)
+            edgeState.append(delta[state][cls])
+    rows.append(len(edgeClass))
+
+first, last = ord(chars[0]), ord(chars[-1])
+classMap = [charClass.get(chr(c), 0) for c in range(first, last + 1)]
+
+def table(values, perLine=16):
+    lines = []
+    for i in range(0, len(values), perLine):
+        lines.append('\t' + ','.join(str(v) for v in values[i:i + perLine]) + ',')
+    return '\n'.join(lines)
+
+print('/*')
+print(' * uzenet_tokens.h')
+print(' *')
+print(' * Generated by uzenet_tokens.py, do not edit.')
+print(' * AT response matcher: %d tokens, %d states, %d byte classes, %d transitions' % (len(tokens), len(goto), classes, len(edgeClass)))
+print(' */')
+print()
+print('#ifndef UZENET_TOKENS_H_')
+print('#define UZENET_TOKENS_H_')
+print()
+print('#define WIFI_TOKEN_NONE\t\t\t0')
+for tokenId, (name, text) in enumerate(tokens, 1):
+    define = '#define WIFI_TOKEN_' + name
+    print('%s%s%d\t//%s' % (define, '\t' * max(1, (40 - len(define) + 3) // 4), tokenId, repr(text)[1:-1]))
+print()
+print('#define WIFI_TOKEN_MASK(t)\t\t(1U<<(t))')
+print()
+print('#endif /* UZENET_TOKENS_H_ */')
+print()
+print()
+print('//Tables, for the matcher in uzenet.c only')
+print('#if defined(UZENET_TOKENS_TABLES) && !defined(UZENET_TOKENS_TABLES_H_)')
+print('#define UZENET_TOKENS_TABLES_H_')
+print()
+print('#define TOKEN_FIRST_CHAR\t%d' % first)
+print('#define TOKEN_LAST_CHAR\t\t%d' % last)
+print()
+print('//Byte class of the characters TOKEN_FIRST_CHAR..TOKEN_LAST_CHAR')
+print('static const u8 tokenClass[] PROGMEM = {')
+print(table(classMap))
+print('};')
+print()
+print('//Next state from the initial state, per byte class')
+print('static const u8 tokenRoot[] PROGMEM = {')
+print(table(delta[0]))
+print('};')
+print()
+print('//Transitions of each state that differ from tokenRoot: tokenRow[s]..tokenRow[s+1]-1')
+print('static const u%d tokenRow[] PROGMEM = {' % (8 if len(edgeClass) < 256 else 16))
+print(table(rows))
+print('};')
+print()
+print('static const u8 tokenEdgeClass[] PROGMEM = {')
+print(table(edgeClass))
+print('};')
+print()
+print('static const u8 tokenEdgeState[] PROGMEM = {')
+print(table(edgeState))
+print('};')
+print()
+print('//Token recognized on entering each state')
+print('static const u8 tokenOutput[] PROGMEM = {')
+print(table(output))
+print('};')
+print()
+print('#endif')
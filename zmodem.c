@@ -0,0 +1,470 @@
+/*
+ * zmodem.c
+ *
+ * ZMODEM receiver, as lrzsz's rz: hex headers out, hex and CRC16 binary
+ * headers in, data subpackets checked by CRC and ZRPOS to resume after an
+ * error. The bytes come from the kernel's UART rings (the mixer polls the
+ * USART on every scanline), so the file callback can write a sector to the
+ * SD card while the next bytes arrive.
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+#include <uzebox.h>
+#include "zmodem.h"
+
+#define ZPAD		'*'
+#define ZDLE		0x18
+#define ZBIN		'A'
+#define ZHEX		'B'
+
+//Frame types
+#define ZRQINIT		0
+#define ZRINIT		1
+#define ZSINIT		2
+#define ZACK		3
+#define ZFILE		4
+#define ZSKIP		5
+#define ZNAK		6
+#define ZABORT		7
+#define ZFIN		8
+#define ZRPOS		9
+#define ZDATA		10
+#define ZEOF		11
+#define ZCAN		16
+
+//Subpacket ends and escapes following a ZDLE
+#define ZCRCE		'h'		//frame ends, header follows
+#define ZCRCG		'i'		//frame continues
+#define ZCRCQ		'j'		//frame continues, ZACK expected
+#define ZCRCW		'k'		//frame ends, ZACK expected
+#define ZRUB0		'l'		//0x7f
+#define ZRUB1		'm'		//0xff
+
+//ZRINIT flags: full duplex, receives during SD writes
+#define CANFDX		0x01
+#define CANOVIO		0x02
+
+//Results of the byte readers besides the bytes
+#define GOT_TIMEOUT	-1
+#define GOT_CAN		-2		//five CAN (ZDLE) in a row
+#define GOT_ERROR	-3		//bad escape or CRC
+#define GOT_END		0x100	//or'ed with the subpacket end
+
+#define XON			0x11
+#define XOFF		0x13
+
+#define ZM_FINISH_TIMEOUT	60	//frames to wait for the "OO" after ZFIN
+
+ZModemStats zm_stats;
+
+static u8 buffer[ZM_BUFFER_SIZE+1];
+static u8 hdr[4];
+static u16 lastFrame,idleFrames,timeout;
+static ZModemIdleFunc idleFunc;
+static bool skipped;
+
+
+u16 zm_Crc16(u16 crc, u8 c){
+	crc^=(u16)c<<8;
+	for(u8 i=0;i<8;i++){
+		crc=(crc&0x8000)?(crc<<1)^0x1021:(crc<<1);
+	}
+	return crc;
+}
+
+//Once per frame: the user's idle function and the timeout count
+static void _zm_Tick(){
+	u16 frame=GetVsyncCounter();
+	if(frame!=lastFrame){
+		idleFrames+=(u16)(frame-lastFrame);
+		lastFrame=frame;
+		if(idleFunc!=NULL) idleFunc();
+	}
+}
+
+static s16 _zm_ReadByte(){
+	s16 c;
+	while((c=UartReadChar())==-1){
+		_zm_Tick();
+		if(idleFrames>timeout){
+			idleFrames=0;
+			return GOT_TIMEOUT;
+		}
+	}
+	idleFrames=0;
+	return c;
+}
+
+//Reads a byte of a binary header or subpacket, undoing the ZDLE escapes
+static s16 _zm_ReadEscaped(){
+	s16 c;
+	u8 cans=1;
+
+	do{
+		c=_zm_ReadByte();
+		if(c<0 || c==ZDLE) break;
+		//flow control characters are always escaped, raw ones come from the line
+		if((c&0x7f)!=XON && (c&0x7f)!=XOFF) return c;
+	}while(1);
+	if(c<0) return c;
+
+	while(1){
+		c=_zm_ReadByte();
+		if(c<0) return c;
+
+		switch(c){
+			case ZDLE:
+				if(++cans==5) return GOT_CAN;
+				continue;
+			case ZCRCE:
+			case ZCRCG:
+			case ZCRCQ:
+			case ZCRCW:
+				return GOT_END|c;
+			case ZRUB0:
+				return 0x7f;
+			case ZRUB1:
+				return 0xff;
+			case XON:
+			case XON|0x80:
+			case XOFF:
+			case XOFF|0x80:
+				continue;
+		}
+		if((c&0x60)==0x40) return c^0x40;
+		return GOT_ERROR;
+	}
+}
+
+static s16 _zm_ReadHex(){
+	s16 c;
+	u8 value=0;
+
+	for(u8 i=0;i<2;i++){
+		c=_zm_ReadByte();
+		if(c<0) return c;
+		c&=0x7f;
+		if(c>='0' && c<='9') c-='0';
+		else if(c>='a' && c<='f') c-='a'-10;
+		else if(c>='A' && c<='F') c-='A'-10;
+		else return GOT_ERROR;
+		value=(value<<4)|c;
+	}
+	return value;
+}
+
+/*
+ * Waits for a header, skipping anything else (the sender's "rz\r", the end
+ * of a subpacket dropped after an error...). Returns its type with its
+ * four bytes in hdr, or a GOT_ code.
+ */
+static s16 _zm_ReadHeader(){
+	s16 c,type=0;
+	u8 d[7],cans=0;
+	u16 crc=0;
+	bool hex;
+
+	while(1){
+		c=_zm_ReadByte();
+		if(c<0) return c;
+
+		if(c==ZDLE){
+			if(++cans==5) return GOT_CAN;
+			continue;
+		}
+		cans=0;
+		if(c!=ZPAD) continue;
+
+		//ZPAD [ZPAD] ZDLE ZHEX|ZBIN
+		do{
+			c=_zm_ReadByte();
+		}while(c==ZPAD);
+		if(c<0) return c;
+		if(c!=ZDLE) continue;
+		c=_zm_ReadByte();
+		if(c<0) return c;
+		if(c==ZHEX || c==ZBIN) break;
+	}
+
+	hex=(c==ZHEX);
+	for(u8 i=0;i<7;i++){
+		c=hex?_zm_ReadHex():_zm_ReadEscaped();
+		if(c<0) return c;
+		if(c&GOT_END) return GOT_ERROR;
+		d[i]=c;
+		crc=zm_Crc16(crc,c);
+	}
+	if(crc!=0){
+		zm_stats.crcErrors++;
+		return GOT_ERROR;
+	}
+
+	//a hex header ends with CR LF
+	if(hex){
+		c=_zm_ReadByte();
+		if((c&0x7f)=='\r') _zm_ReadByte();
+	}
+
+	type=d[0];
+	memcpy(hdr,&d[1],4);
+	return type;
+}
+
+static u32 _zm_HeaderPos(){
+	return hdr[0]|((u32)hdr[1]<<8)|((u32)hdr[2]<<16)|((u32)hdr[3]<<24);
+}
+
+static u8 _zm_PutHex(u8* frame, u8 value){
+	const char digits[]="0123456789abcdef";
+	frame[0]=digits[value>>4];
+	frame[1]=digits[value&0xf];
+	return 2;
+}
+
+static void _zm_Send(const u8* data, u8 len){
+	while(len){
+		u8 n=UartWriteBlock(data,len);
+		data+=n;
+		len-=n;
+	}
+}
+
+//Queues a hex header, the mixer sends it while we keep receiving
+static void _zm_SendHeader(u8 type, u32 pos){
+	u8 frame[24];
+	u8 d[5]={type,pos,pos>>8,pos>>16,pos>>24};
+	u8 n=0;
+	u16 crc=0;
+
+	frame[n++]=ZPAD;
+	frame[n++]=ZPAD;
+	frame[n++]=ZDLE;
+	frame[n++]=ZHEX;
+	for(u8 i=0;i<5;i++){
+		n+=_zm_PutHex(&frame[n],d[i]);
+		crc=zm_Crc16(crc,d[i]);
+	}
+	n+=_zm_PutHex(&frame[n],crc>>8);
+	n+=_zm_PutHex(&frame[n],crc&0xff);
+	frame[n++]='\r';
+	frame[n++]='\n'|0x80;
+	if(type!=ZFIN && type!=ZACK) frame[n++]=XON;
+
+	_zm_Send(frame,n);
+}
+
+//ZRINIT: subpackets up to our buffer, full duplex
+static void _zm_SendInit(){
+	_zm_SendHeader(ZRINIT,ZM_BUFFER_SIZE|((u32)(CANFDX|CANOVIO)<<24));
+}
+
+static void _zm_Retransmit(u32 pos){
+	zm_stats.retransmits++;
+	_zm_SendHeader(ZRPOS,pos);
+}
+
+static void _zm_Cancel(){
+	static const u8 cancel[]={ZDLE,ZDLE,ZDLE,ZDLE,ZDLE,ZDLE,ZDLE,ZDLE,8,8,8,8,8,8,8,8};
+	_zm_Send(cancel,sizeof(cancel));
+}
+
+/*
+ * Reads a data subpacket into buffer. Returns its end (ZCRCE, ZCRCG, ZCRCQ
+ * or ZCRCW) with its length in len, or a GOT_ code.
+ */
+static s16 _zm_ReadData(u16* len){
+	s16 c,end;
+	u16 n=0,crc=0;
+
+	while(1){
+		c=_zm_ReadEscaped();
+		if(c<0) return c;
+		if(c&GOT_END) break;
+		if(n==ZM_BUFFER_SIZE) return GOT_ERROR;
+		buffer[n++]=c;
+		crc=zm_Crc16(crc,c);
+	}
+
+	end=c&0xff;
+	crc=zm_Crc16(crc,end);
+	for(u8 i=0;i<2;i++){
+		c=_zm_ReadEscaped();
+		if(c<0) return c;
+		if(c&GOT_END) return GOT_ERROR;
+		crc=zm_Crc16(crc,c);
+	}
+	if(crc!=0){
+		zm_stats.crcErrors++;
+		return GOT_ERROR;
+	}
+
+	buffer[n]=0;
+	*len=n;
+	return end;
+}
+
+//Waits for the "OO" ending the session, so that it does not reach the next rom
+static void _zm_Finish(){
+	u8 o=0;
+
+	_zm_SendHeader(ZFIN,0);
+	timeout=ZM_FINISH_TIMEOUT;
+	while(o<2){
+		s16 c=_zm_ReadByte();
+		if(c<0) break;
+		o=(c=='O')?o+1:0;
+	}
+}
+
+/*
+ * Called by the data function: the receiver has the file already. The
+ * sender gets a ZSKIP after the subpacket and ends the session, and the
+ * rest of the file is dropped.
+ */
+void zm_Skip(){
+	skipped=true;
+}
+
+/*
+ * Receives one file. fileFunc gets the name and size from the sender (the
+ * size is 0 if unknown), then dataFunc gets the file contents in order, in
+ * checked subpackets of up to ZM_BUFFER_SIZE bytes. A subpacket that fails
+ * is never passed: the sender is asked to go back to the last good byte.
+ * Further files of the batch are skipped. idleFunc is called once per
+ * frame and may be NULL.
+ *
+ * Returns ZM_OK once the sender ended the session after the file, or
+ * ZM_ERR_ABORT / ZM_ERR_ERRORS. Waits forever for a sender to start.
+ */
+s8 zm_Receive(ZModemFileFunc fileFunc, ZModemDataFunc dataFunc, ZModemIdleFunc idle){
+	s16 type,end;
+	u32 pos=0;
+	u16 len;
+	u8 errors=0;
+	bool started=false,done=false;
+
+	memset(&zm_stats,0,sizeof(zm_stats));
+	idleFunc=idle;
+	lastFrame=GetVsyncCounter();
+	idleFrames=0;
+	timeout=ZM_TIMEOUT;
+	skipped=false;
+
+	_zm_SendInit();
+
+	while(1){
+		type=_zm_ReadHeader();
+
+		switch(type){
+			case GOT_CAN:
+			case ZCAN:
+			case ZABORT:
+				return ZM_ERR_ABORT;
+
+			case GOT_TIMEOUT:
+			case GOT_ERROR:
+				if(type==GOT_TIMEOUT) zm_stats.timeouts++;
+				if(!started || done){
+					_zm_SendInit();
+					break;
+				}
+				if(++errors>ZM_MAX_ERRORS){
+					_zm_Cancel();
+					return ZM_ERR_ERRORS;
+				}
+				_zm_Retransmit(pos);
+				break;
+
+			case ZRQINIT:
+				if(!started || done) _zm_SendInit();
+				break;
+
+			case ZSINIT:
+				//the attention string is not used, we never interrupt the sender
+				if(_zm_ReadData(&len)<0){
+					_zm_SendHeader(ZNAK,0);
+				}else{
+					_zm_SendHeader(ZACK,1);
+				}
+				break;
+
+			case ZFILE:
+				if(_zm_ReadData(&len)<0){
+					_zm_SendHeader(ZNAK,0);
+					break;
+				}
+				//the next file of the batch, or ours again after a lost ZRPOS
+				if(done){
+					_zm_SendHeader(ZSKIP,0);
+					break;
+				}
+				if(started){
+					_zm_SendHeader(ZRPOS,pos);
+					break;
+				}
+				//name, then size in decimal and other fields
+				if(fileFunc!=NULL){
+					u16 n=strlen((char*)buffer);
+					fileFunc((char*)buffer,(n+1<len)?strtoul((char*)buffer+n+1,NULL,10):0);
+				}
+				started=true;
+				pos=0;
+				_zm_SendHeader(ZRPOS,pos);
+				break;
+
+			case ZDATA:
+				if(!started || done) break;
+				if(_zm_HeaderPos()!=pos){
+					_zm_Retransmit(pos);
+					break;
+				}
+				zm_stats.frames++;
+
+				while(1){
+					end=_zm_ReadData(&len);
+					if(end<0){
+						if(end==GOT_CAN) return ZM_ERR_ABORT;
+						if(end==GOT_TIMEOUT) zm_stats.timeouts++;
+						if(++errors>ZM_MAX_ERRORS){
+							_zm_Cancel();
+							return ZM_ERR_ERRORS;
+						}
+						_zm_Retransmit(pos);
+						break;
+					}
+					errors=0;
+					if(len!=0){
+						dataFunc(buffer,len);
+						pos+=len;
+						zm_stats.bytes+=len;
+					}
+					_zm_Tick();
+
+					if(skipped){
+						done=true;
+						_zm_SendHeader(ZSKIP,0);
+						break;
+					}
+					if(end==ZCRCQ || end==ZCRCW) _zm_SendHeader(ZACK,pos);
+					if(end==ZCRCE || end==ZCRCW) break;
+				}
+				break;
+
+			case ZEOF:
+				//an old ZEOF is ignored, the sender sends it again after our ZRPOS
+				if(skipped){
+					_zm_SendHeader(ZSKIP,0);
+				}else if(started && _zm_HeaderPos()==pos){
+					done=true;
+					_zm_SendInit();
+				}
+				break;
+
+			case ZFIN:
+				_zm_Finish();
+				return done?ZM_OK:ZM_ERR_ABORT;
+		}
+	}
+}
@@ -0,0 +1,49 @@
+/*
+ * zmodem.h
+ *
+ * ZMODEM receiver for NetLoaderZ. It only talks to the kernel (UART rings
+ * and vsync counter), so it builds unchanged for the host harness.
+ */
+
+#ifndef ZMODEM_H_
+#define ZMODEM_H_
+
+#define ZM_OK			0
+#define ZM_ERR_ABORT	-1		//the sender cancelled the transfer
+#define ZM_ERR_ERRORS	-2		//too many errors in a row
+
+//Largest data subpacket accepted, advertised to the sender in ZRINIT.
+//The sender waits for a ZACK after each buffer of data.
+#ifndef ZM_BUFFER_SIZE
+	#define ZM_BUFFER_SIZE	1024
+#endif
+
+//Frames without a byte before a header is sent again
+#ifndef ZM_TIMEOUT
+	#define ZM_TIMEOUT		60*10	//10 sec
+#endif
+
+//Consecutive errors (bad CRC, timeouts) before the transfer is given up
+#ifndef ZM_MAX_ERRORS
+	#define ZM_MAX_ERRORS	20
+#endif
+
+typedef void (*ZModemFileFunc)(const char* name, u32 size);
+typedef void (*ZModemDataFunc)(const u8* data, u16 len);
+typedef void (*ZModemIdleFunc)(void);
+
+typedef struct {
+	u32 bytes;			//file bytes received and passed on
+	u16 retransmits;	//ZRPOS sent after the transfer started
+	u16 crcErrors;		//headers and subpackets with a bad CRC
+	u16 timeouts;
+	u16 frames;			//ZDATA frames
+} ZModemStats;
+
+extern ZModemStats zm_stats;
+
+extern s8 zm_Receive(ZModemFileFunc fileFunc, ZModemDataFunc dataFunc, ZModemIdleFunc idleFunc);
+extern void zm_Skip(void);
+extern u16 zm_Crc16(u16 crc, u8 c);
+
+#endif /* ZMODEM_H_ */